@@ -0,0 +1,415 @@
+/* cache.c - An in-memory cache of responses.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <event.h>
+#include <evhttp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "cache.h"
+#include "log.h"
+
+/* The longest we consider a response without an explicit expiration
+   time fresh.  */
+#define CACHE_HEURISTIC_MAX (24 * 60 * 60)
+
+/* The largest object we cache as a fraction of the cache's size.  */
+#define CACHE_OBJECT_FRACTION 8
+
+static int
+cache_entry_compare (struct cache_entry *a, struct cache_entry *b)
+{
+  return strcmp (a->key, b->key);
+}
+
+RB_HEAD(cache_tree, cache_entry);
+RB_PROTOTYPE(cache_tree, cache_entry, tree_node, cache_entry_compare)
+RB_GENERATE(cache_tree, cache_entry, tree_node, cache_entry_compare)
+
+/* Entries, most recently used first.  */
+LIST_CLASS(cache_lru, struct cache_entry, lru_node, true)
+
+static struct cache_tree cache_tree = RB_INITIALIZER (&cache_tree);
+static struct cache_lru_list cache_lru;
+
+/* The maximum number of bytes to use and the number of bytes
+   used.  */
+static size_t cache_max;
+static size_t cache_used;
+
+void
+cache_init (size_t bytes)
+{
+  cache_max = bytes;
+  cache_lru_list_init (&cache_lru, "cache lru");
+}
+
+/* Parse the HTTP date STRING.  Returns -1 on failure.  */
+static time_t
+cache_parse_date (const char *string)
+{
+  if (! string)
+    return -1;
+
+  struct tm tm;
+  memset (&tm, 0, sizeof (tm));
+  /* RFC 1123 and RFC 850 dates.  We don't bother with asctime's
+     format.  */
+  if (! strptime (string, "%a, %d %b %Y %H:%M:%S", &tm)
+      && ! strptime (string, "%a, %d-%b-%y %H:%M:%S", &tm))
+    return -1;
+
+  return timegm (&tm);
+}
+
+/* Return whether the Cache-Control header value VALUE includes the
+   directive DIRECTIVE.  If it does and ARG is not NULL, stores the
+   directive's numeric argument (or -1 if none) in *ARG.  */
+static bool
+cache_control_has (const char *value, const char *directive, int *arg)
+{
+  if (! value)
+    return false;
+
+  int len = strlen (directive);
+  const char *p = value;
+  while (*p)
+    {
+      while (*p == ' ' || *p == '\t' || *p == ',')
+	p ++;
+
+      if (strncasecmp (p, directive, len) == 0
+	  && (p[len] == 0 || p[len] == ',' || p[len] == '='
+	      || p[len] == ' ' || p[len] == '\t'))
+	{
+	  if (arg)
+	    {
+	      *arg = -1;
+	      if (p[len] == '=')
+		{
+		  const char *n = p + len + 1;
+		  if (*n == '"')
+		    n ++;
+		  if (isdigit (*n))
+		    *arg = atoi (n);
+		}
+	    }
+	  return true;
+	}
+
+      p = strchr (p, ',');
+      if (! p)
+	break;
+    }
+
+  return false;
+}
+
+/* Return a string identifying the values of the request headers
+   CLIENT_HEADERS named by the Vary header VARY.  The result must be
+   freed.  Returns NULL on allocation failure.  */
+static char *
+cache_vary_signature (const char *vary, struct http_headers *client_headers)
+{
+  size_t size = 1;
+  char *signature = calloc (size, 1);
+  if (! signature)
+    return NULL;
+
+  const char *p = vary;
+  while (*p)
+    {
+      while (*p == ' ' || *p == '\t' || *p == ',')
+	p ++;
+      if (! *p)
+	break;
+
+      const char *end = p;
+      while (*end && *end != ',' && *end != ' ' && *end != '\t')
+	end ++;
+
+      char name[end - p + 1];
+      memcpy (name, p, end - p);
+      name[end - p] = 0;
+      p = end;
+
+      if (strcasecmp (name, "Accept-Encoding") == 0)
+	/* We don't forward Accept-Encoding; the key includes the
+	   encoding that we chose.  */
+	continue;
+
+      const char *value = http_headers_find (client_headers, name) ?: "";
+
+      size_t more = strlen (name) + 1 + strlen (value) + 1;
+      char *s = realloc (signature, size + more);
+      if (! s)
+	{
+	  free (signature);
+	  return NULL;
+	}
+      signature = s;
+      sprintf (signature + size - 1, "%s:%s\n", name, value);
+      size += more;
+    }
+
+  return signature;
+}
+
+bool
+cache_request_shareable (struct http_headers *client_headers)
+{
+  /* Responses to requests with credentials are private.  */
+  return cache_max > 0 && ! http_headers_get (client_headers,
+						 HEADER_AUTHORIZATION);
+}
+
+bool
+cache_entry_matches (struct cache_entry *entry,
+		     struct http_headers *client_headers)
+{
+  if (! entry->vary)
+    return true;
+
+  char *signature = cache_vary_signature (entry->vary, client_headers);
+  bool match = signature && strcmp (signature, entry->vary_signature) == 0;
+  free (signature);
+  return match;
+}
+
+static void
+cache_remove (struct cache_entry *entry)
+{
+  RB_REMOVE (cache_tree, &cache_tree, entry);
+  cache_lru_list_unlink (&cache_lru, entry);
+  cache_used -= entry->size;
+  cache_entry_free (entry);
+}
+
+struct cache_entry *
+cache_lookup (const char *key, struct http_headers *client_headers)
+{
+  if (! cache_request_shareable (client_headers))
+    return NULL;
+
+  const char *pragma = http_headers_get (client_headers, HEADER_PRAGMA);
+  const char *cache_control
+    = http_headers_get (client_headers, HEADER_CACHE_CONTROL);
+  if ((pragma && strcasecmp (pragma, "no-cache") == 0)
+      || cache_control_has (cache_control, "no-cache", NULL)
+      || cache_control_has (cache_control, "no-store", NULL))
+    /* The client insists on a response from the origin.  */
+    return NULL;
+
+  int key_len = strlen (key);
+  struct cache_entry *k = alloca (sizeof (*k) + key_len + 1);
+  memcpy (k->key, key, key_len + 1);
+
+  struct cache_entry *entry = RB_FIND (cache_tree, &cache_tree, k);
+  if (! entry)
+    return NULL;
+
+  if (entry->expires <= time (NULL))
+    {
+      log ("Cache: %s is stale", key);
+      cache_remove (entry);
+      return NULL;
+    }
+
+  if (! cache_entry_matches (entry, client_headers))
+    return NULL;
+
+  /* Move to the front of the LRU list.  */
+  cache_lru_list_unlink (&cache_lru, entry);
+  cache_lru_list_push (&cache_lru, entry);
+
+  return entry;
+}
+
+struct cache_entry *
+cache_entry_new (const char *key, struct http_headers *client_headers,
+		 int status_code, const char *status_string,
+		 struct evkeyvalq *response_headers)
+{
+  if (! cache_request_shareable (client_headers))
+    return NULL;
+
+  const char *cache_control
+    = http_headers_get (client_headers, HEADER_CACHE_CONTROL);
+  if (cache_control_has (cache_control, "no-store", NULL))
+    return NULL;
+
+  switch (status_code)
+    {
+    case 200: case 203: case 300: case 301: case 410:
+      break;
+    default:
+      return NULL;
+    }
+
+  cache_control = evhttp_find_header (response_headers, "Cache-Control");
+  if (cache_control_has (cache_control, "no-store", NULL)
+      || cache_control_has (cache_control, "no-cache", NULL)
+      || cache_control_has (cache_control, "private", NULL))
+    return NULL;
+
+  if (evhttp_find_header (response_headers, "Set-Cookie"))
+    /* Don't give one user's cookie to another.  */
+    return NULL;
+
+  const char *vary = evhttp_find_header (response_headers, "Vary");
+  if (vary && strchr (vary, '*'))
+    return NULL;
+
+  /* Determine how long the response is fresh.  */
+  time_t now = time (NULL);
+  time_t date = cache_parse_date (evhttp_find_header (response_headers,
+						      "Date"));
+  if (date == -1)
+    date = now;
+
+  int lifetime;
+  int max_age;
+  time_t expires;
+  time_t last_modified;
+  if (cache_control_has (cache_control, "s-maxage", &max_age)
+      && max_age >= 0)
+    lifetime = max_age;
+  else if (cache_control_has (cache_control, "max-age", &max_age)
+	   && max_age >= 0)
+    lifetime = max_age;
+  else if ((expires
+	    = cache_parse_date (evhttp_find_header (response_headers,
+						    "Expires"))) != -1)
+    lifetime = expires - date;
+  else if ((last_modified
+	    = cache_parse_date (evhttp_find_header (response_headers,
+						    "Last-Modified"))) != -1
+	   && last_modified < date)
+    /* The usual heuristic: a tenth of the time since the document was
+       last changed.  */
+    {
+      lifetime = (date - last_modified) / 10;
+      if (lifetime > CACHE_HEURISTIC_MAX)
+	lifetime = CACHE_HEURISTIC_MAX;
+    }
+  else
+    return NULL;
+
+  const char *age_string = evhttp_find_header (response_headers, "Age");
+  int age = age_string ? atoi (age_string) : 0;
+  if (age < 0)
+    age = 0;
+
+  if (lifetime - age <= 0)
+    return NULL;
+
+  int key_len = strlen (key);
+  struct cache_entry *entry = calloc (sizeof (*entry) + key_len + 1, 1);
+  if (! entry)
+    return NULL;
+  memcpy (entry->key, key, key_len + 1);
+
+  entry->status_code = status_code;
+  entry->status_string = strdup (status_string);
+  entry->headers = evbuffer_new ();
+  entry->body = evbuffer_new ();
+  if (vary)
+    {
+      entry->vary = strdup (vary);
+      entry->vary_signature = cache_vary_signature (vary, client_headers);
+    }
+  if (! entry->status_string || ! entry->headers || ! entry->body
+      || (vary && (! entry->vary || ! entry->vary_signature)))
+    {
+      cache_entry_free (entry);
+      return NULL;
+    }
+
+  entry->stored = now;
+  entry->age = age;
+  entry->expires = now + lifetime - age;
+
+  return entry;
+}
+
+bool
+cache_body_fits (size_t len)
+{
+  return len <= cache_max / CACHE_OBJECT_FRACTION;
+}
+
+bool
+cache_entry_add_body (struct cache_entry *entry, const void *data, size_t len)
+{
+  if (! cache_body_fits (EVBUFFER_LENGTH (entry->body) + len))
+    return false;
+
+  return evbuffer_add (entry->body, (void *) data, len) == 0;
+}
+
+void
+cache_entry_free (struct cache_entry *entry)
+{
+  free (entry->status_string);
+  if (entry->headers)
+    evbuffer_free (entry->headers);
+  if (entry->body)
+    evbuffer_free (entry->body);
+  free (entry->vary);
+  free (entry->vary_signature);
+  free (entry);
+}
+
+void
+cache_insert (struct cache_entry *entry)
+{
+  entry->size = sizeof (*entry) + strlen (entry->key) + 1
+    + EVBUFFER_LENGTH (entry->headers) + EVBUFFER_LENGTH (entry->body);
+
+  if (entry->size > cache_max / CACHE_OBJECT_FRACTION)
+    {
+      cache_entry_free (entry);
+      return;
+    }
+
+  struct cache_entry *old = RB_FIND (cache_tree, &cache_tree, entry);
+  if (old)
+    cache_remove (old);
+
+  /* Evict the least recently used entries until the new entry
+     fits.  */
+  while (cache_used + entry->size > cache_max)
+    {
+      struct cache_entry *victim = cache_lru_list_tail (&cache_lru);
+      log ("Cache: evicting %s (%zd bytes)", victim->key, victim->size);
+      cache_remove (victim);
+    }
+
+  RB_INSERT (cache_tree, &cache_tree, entry);
+  cache_lru_list_push (&cache_lru, entry);
+  cache_used += entry->size;
+
+  log ("Cache: stored %s (%zd bytes, fresh for %d seconds); %zd/%zd used",
+       entry->key, entry->size, (int) (entry->expires - entry->stored),
+       cache_used, cache_max);
+}
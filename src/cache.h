@@ -0,0 +1,116 @@
+/* cache.h - An in-memory cache of responses.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <stdbool.h>
+#include <time.h>
+#include <event.h>
+#include <evhttp.h>
+
+#include <sys/tree.h>
+
+#include "http_headers.h"
+#include "list.h"
+
+/* A cached response.  The response is stored after we transformed
+   it, but without the headers that depend on the client (the status
+   line, Connection, Content-Length and Transfer-Encoding).  */
+struct cache_entry
+{
+  /* The status.  */
+  int status_code;
+  char *status_string;
+
+  /* The headers to send, each terminated by \r\n.  */
+  struct evbuffer *headers;
+  /* The body.  */
+  struct evbuffer *body;
+
+  /* When the entry was stored and the origin's idea of its age at
+     that time.  */
+  time_t stored;
+  int age;
+
+  /* Private.  */
+  RB_ENTRY(cache_entry) tree_node;
+  struct list_node lru_node;
+  /* When the entry becomes stale.  */
+  time_t expires;
+  /* The origin's Vary header, if any, and the signature of the
+     request's values for the headers that it names.  */
+  char *vary;
+  char *vary_signature;
+  /* The number of bytes the entry occupies.  */
+  size_t size;
+  char key[0];
+};
+
+/* Initialize the cache.  It will hold at most BYTES bytes.  If BYTES
+   is 0, nothing is cached.  */
+extern void cache_init (size_t bytes);
+
+/* Whether the response to a request with the headers CLIENT_HEADERS
+   may be shared with other clients.  False if the cache is
+   disabled.  */
+extern bool cache_request_shareable (struct http_headers *client_headers);
+
+/* Whether ENTRY is a suitable response to a request with the headers
+   CLIENT_HEADERS given the response's Vary header.  */
+extern bool cache_entry_matches (struct cache_entry *entry,
+				 struct http_headers *client_headers);
+
+/* Look up a fresh response for KEY given that the request has the
+   headers CLIENT_HEADERS.  Returns NULL if there is none or the
+   request does not allow a cached response to be used.  The entry
+   remains owned by the cache and is only valid until the next call
+   into the cache.  */
+extern struct cache_entry *cache_lookup (const char *key,
+					 struct http_headers *client_headers);
+
+/* Start recording the response to the request for KEY.
+   CLIENT_HEADERS are the request's headers and RESPONSE_HEADERS the
+   origin's response headers.  Returns NULL if the response may not be
+   cached.  The caller fills in the entry's HEADERS and BODY
+   (cache_entry_add_body) and then calls cache_insert or
+   cache_entry_free.  */
+extern struct cache_entry *cache_entry_new
+  (const char *key, struct http_headers *client_headers,
+   int status_code, const char *status_string,
+   struct evkeyvalq *response_headers);
+
+/* Return whether a response whose body is LEN bytes may be cached.  */
+extern bool cache_body_fits (size_t len);
+
+/* Append the LEN bytes at DATA to ENTRY's body.  Returns false if the
+   entry becomes too large to be cached, in which case the caller
+   should free it.  */
+extern bool cache_entry_add_body (struct cache_entry *entry,
+				  const void *data, size_t len);
+
+/* Free ENTRY, which is not in the cache.  */
+extern void cache_entry_free (struct cache_entry *entry);
+
+/* Add ENTRY to the cache, replacing any entry with the same key.  The
+   cache assumes ownership of ENTRY.  */
+extern void cache_insert (struct cache_entry *entry);
+
+#endif
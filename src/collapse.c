@@ -0,0 +1,141 @@
+/* collapse.c - Collapsing identical concurrent requests.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/tree.h>
+
+#include "collapse.h"
+#include "log.h"
+
+LIST_CLASS(collapse_waiter, struct collapse_waiter, node, true)
+
+struct collapse
+{
+  RB_ENTRY(collapse) tree_node;
+
+  struct collapse_waiter_list waiters;
+
+  char key[0];
+};
+
+static int
+collapse_compare (struct collapse *a, struct collapse *b)
+{
+  return strcmp (a->key, b->key);
+}
+
+RB_HEAD(collapse_tree, collapse);
+RB_PROTOTYPE(collapse_tree, collapse, tree_node, collapse_compare)
+RB_GENERATE(collapse_tree, collapse, tree_node, collapse_compare)
+
+/* Fetches in progress.  */
+static struct collapse_tree collapses = RB_INITIALIZER (&collapses);
+
+struct collapse *
+collapse_find (const char *key)
+{
+  int key_len = strlen (key);
+  struct collapse *k = alloca (sizeof (*k) + key_len + 1);
+  memcpy (k->key, key, key_len + 1);
+
+  return RB_FIND (collapse_tree, &collapses, k);
+}
+
+struct collapse *
+collapse_begin (const char *key)
+{
+  int key_len = strlen (key);
+  struct collapse *collapse = calloc (sizeof (*collapse) + key_len + 1, 1);
+  if (! collapse)
+    return NULL;
+  memcpy (collapse->key, key, key_len + 1);
+
+  if (RB_INSERT (collapse_tree, &collapses, collapse))
+    /* Already being fetched.  */
+    {
+      free (collapse);
+      return NULL;
+    }
+
+  return collapse;
+}
+
+static void
+collapse_waiter_free (struct collapse_waiter *waiter)
+{
+  if (waiter->client_headers)
+    http_headers_free (waiter->client_headers);
+  free (waiter->host);
+  free (waiter->resource);
+  free (waiter);
+}
+
+struct collapse_waiter *
+collapse_wait (struct collapse *collapse, struct http_response *response,
+	       enum http_version client_version,
+	       struct http_headers *client_headers,
+	       const char *host, const char *resource)
+{
+  struct collapse_waiter *waiter = calloc (sizeof (*waiter), 1);
+  if (! waiter)
+    return NULL;
+
+  waiter->host = strdup (host);
+  waiter->resource = strdup (resource);
+  if (! waiter->host || ! waiter->resource)
+    {
+      collapse_waiter_free (waiter);
+      return NULL;
+    }
+
+  waiter->response = response;
+  waiter->client_version = client_version;
+  waiter->client_headers = client_headers;
+  waiter->collapse = collapse;
+  collapse_waiter_list_enqueue (&collapse->waiters, waiter);
+
+  log ("Collapsing request for %s (%d waiting)",
+       collapse->key, collapse_waiter_list_count (&collapse->waiters));
+
+  return waiter;
+}
+
+void
+collapse_cancel (struct collapse_waiter *waiter)
+{
+  collapse_waiter_list_unlink (&waiter->collapse->waiters, waiter);
+  collapse_waiter_free (waiter);
+}
+
+void
+collapse_end (struct collapse *collapse, struct cache_entry *entry)
+{
+  RB_REMOVE (collapse_tree, &collapses, collapse);
+
+  /* A callback may cancel other waiters.  Always take the head.  */
+  struct collapse_waiter *waiter;
+  while ((waiter = collapse_waiter_list_dequeue (&collapse->waiters)))
+    {
+      collapse_waiter_done_cb (waiter, entry);
+      collapse_waiter_free (waiter);
+    }
+
+  free (collapse);
+}
@@ -0,0 +1,82 @@
+/* collapse.h - Collapsing identical concurrent requests.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#ifndef COLLAPSE_H
+#define COLLAPSE_H
+
+#include "http_request.h"
+#include "http_headers.h"
+#include "list.h"
+
+/* Forward.  */
+struct http_response;
+struct cache_entry;
+
+/* A fetch of a resource that other requests for the same resource may
+   wait on.  */
+struct collapse;
+
+/* A request waiting for the response to an identical request.  */
+struct collapse_waiter
+{
+  /* The (queued but not ready) response to the waiting request.  */
+  struct http_response *response;
+
+  /* The request.  Used to fetch the resource if the response to the
+     other request can't be shared.  */
+  enum http_version client_version;
+  struct http_headers *client_headers;
+  char *host;
+  char *resource;
+
+  /* Private.  */
+  struct collapse *collapse;
+  struct list_node node;
+};
+
+/* Return the fetch of the resource with cache key KEY, if one is in
+   progress.  */
+extern struct collapse *collapse_find (const char *key);
+
+/* Note that the resource with cache key KEY is being fetched.
+   Returns NULL if memory could not be allocated.  */
+extern struct collapse *collapse_begin (const char *key);
+
+/* Wait for the fetch COLLAPSE.  RESPONSE is the response to the
+   waiting request.  Takes ownership of CLIENT_HEADERS.  Returns NULL
+   if memory could not be allocated.  */
+extern struct collapse_waiter *collapse_wait
+  (struct collapse *collapse, struct http_response *response,
+   enum http_version client_version, struct http_headers *client_headers,
+   const char *host, const char *resource);
+
+/* Stop waiting.  Frees WAITER.  */
+extern void collapse_cancel (struct collapse_waiter *waiter);
+
+/* The fetch COLLAPSE is over.  ENTRY is the complete response or NULL,
+   if it can't be shared.  Calls collapse_waiter_done_cb for each
+   waiter, frees the waiters and COLLAPSE.  */
+extern void collapse_end (struct collapse *collapse,
+			  struct cache_entry *entry);
+
+/* Called by collapse_end.  If the callee takes ownership of
+   WAITER->CLIENT_HEADERS, it must clear the field.  */
+extern void collapse_waiter_done_cb (struct collapse_waiter *waiter,
+				     struct cache_entry *entry);
+
+#endif
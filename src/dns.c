@@ -0,0 +1,276 @@
+/* dns.c - Asynchronous, caching host name resolution.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <event.h>
+#include <evdns.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <time.h>
+
+#include <sys/tree.h>
+
+#include "dns.h"
+#include "list.h"
+#include "log.h"
+
+/* Bounds on the time (in seconds) that we believe an answer.  */
+#define DNS_MIN_TTL 10
+#define DNS_MAX_TTL (60 * 60)
+/* How long we remember that a name could not be resolved.  */
+#define DNS_NEGATIVE_TTL 30
+
+/* When the cache has more than this many entries, expired entries
+   are reaped.  */
+#define DNS_CACHE_HIGH_WATER 1024
+
+struct dns_waiter
+{
+  /* The entry this waiter is waiting on.  NULL if the answer is being
+     delivered by EVENT.  */
+  struct dns_entry *entry;
+
+  dns_callback_t callback;
+  void *arg;
+
+  /* Used to deliver cached failures from the event loop.  */
+  struct event event;
+
+  struct list_node node;
+};
+LIST_CLASS(dns_entry_waiter, struct dns_waiter, node, true)
+
+struct dns_entry
+{
+  RB_ENTRY(dns_entry) tree_node;
+
+  /* When the answer expires.  */
+  time_t expires;
+
+  /* Whether a query is outstanding.  */
+  bool pending;
+  /* Whether the last query succeeded.  */
+  bool valid;
+  struct in_addr addr;
+
+  /* Lookups waiting for the outstanding query.  */
+  struct dns_entry_waiter_list waiters;
+
+  char host[0];
+};
+
+static int
+dns_entry_compare (struct dns_entry *a, struct dns_entry *b)
+{
+  return strcasecmp (a->host, b->host);
+}
+
+RB_HEAD(dns_cache, dns_entry);
+RB_PROTOTYPE(dns_cache, dns_entry, tree_node, dns_entry_compare)
+RB_GENERATE(dns_cache, dns_entry, tree_node, dns_entry_compare)
+
+static struct dns_cache dns_cache = RB_INITIALIZER (&dns_cache);
+static int dns_cache_count;
+
+void
+dns_init (void)
+{
+  if (evdns_init () != 0)
+    log ("Failed to initialize the resolver; lookups will fail.");
+}
+
+/* Drop any expired entries that are not in use.  */
+static void
+dns_cache_reap (void)
+{
+  time_t now = time (NULL);
+
+  struct dns_entry *entry;
+  struct dns_entry *next;
+  for (entry = RB_MIN (dns_cache, &dns_cache); entry; entry = next)
+    {
+      next = RB_NEXT (dns_cache, &dns_cache, entry);
+
+      if (! entry->pending && entry->expires <= now)
+	{
+	  RB_REMOVE (dns_cache, &dns_cache, entry);
+	  dns_cache_count --;
+	  free (entry);
+	}
+    }
+}
+
+static void
+dns_query_done (int result, char type, int count, int ttl,
+		void *addresses, void *arg)
+{
+  struct dns_entry *entry = arg;
+
+  assert (entry->pending);
+  entry->pending = false;
+
+  if (result == DNS_ERR_NONE && type == DNS_IPv4_A && count > 0)
+    {
+      entry->valid = true;
+      memcpy (&entry->addr, addresses, sizeof (entry->addr));
+
+      if (ttl < DNS_MIN_TTL)
+	ttl = DNS_MIN_TTL;
+      else if (ttl > DNS_MAX_TTL)
+	ttl = DNS_MAX_TTL;
+
+      log ("Resolved %s to %s (ttl: %d)",
+	   entry->host, inet_ntoa (entry->addr), ttl);
+    }
+  else
+    {
+      entry->valid = false;
+      ttl = DNS_NEGATIVE_TTL;
+
+      log ("Failed to resolve %s: %d", entry->host, result);
+    }
+  entry->expires = time (NULL) + ttl;
+
+  /* A callback may cancel other waiters on this entry.  Always take
+     the head.  */
+  struct dns_waiter *waiter;
+  while ((waiter = dns_entry_waiter_list_dequeue (&entry->waiters)))
+    {
+      waiter->entry = NULL;
+      waiter->callback (entry->valid ? &entry->addr : NULL, waiter->arg);
+      free (waiter);
+    }
+}
+
+static void
+dns_deliver_failure (int fd, short event, void *arg)
+{
+  struct dns_waiter *waiter = arg;
+
+  waiter->callback (NULL, waiter->arg);
+  free (waiter);
+}
+
+/* Arrange for WAITER's callback to be called with a failure from the
+   event loop.  */
+static void
+dns_fail_later (struct dns_waiter *waiter)
+{
+  struct timeval tv = { 0, 0 };
+
+  waiter->entry = NULL;
+  evtimer_set (&waiter->event, dns_deliver_failure, waiter);
+  evtimer_add (&waiter->event, &tv);
+}
+
+int
+dns_resolve (const char *host, struct in_addr *addr,
+	     dns_callback_t callback, void *arg,
+	     struct dns_waiter **waiterp)
+{
+  if (inet_aton (host, addr))
+    /* A numeric address.  */
+    return 0;
+
+  int host_len = strlen (host);
+  struct dns_entry *key = alloca (sizeof (*key) + host_len + 1);
+  memcpy (key->host, host, host_len + 1);
+
+  time_t now = time (NULL);
+
+  struct dns_entry *entry = RB_FIND (dns_cache, &dns_cache, key);
+  if (entry && ! entry->pending && entry->expires > now && entry->valid)
+    {
+      *addr = entry->addr;
+      return 0;
+    }
+
+  struct dns_waiter *waiter = calloc (sizeof (*waiter), 1);
+  if (! waiter)
+    return -1;
+
+  waiter->callback = callback;
+  waiter->arg = arg;
+  *waiterp = waiter;
+
+  if (entry && ! entry->pending && entry->expires > now)
+    /* A cached failure.  */
+    {
+      assert (! entry->valid);
+      dns_fail_later (waiter);
+      return 1;
+    }
+
+  if (! entry)
+    {
+      if (dns_cache_count >= DNS_CACHE_HIGH_WATER)
+	dns_cache_reap ();
+
+      entry = calloc (sizeof (*entry) + host_len + 1, 1);
+      if (! entry)
+	{
+	  free (waiter);
+	  return -1;
+	}
+      memcpy (entry->host, host, host_len + 1);
+
+      RB_INSERT (dns_cache, &dns_cache, entry);
+      dns_cache_count ++;
+    }
+
+  waiter->entry = entry;
+  dns_entry_waiter_list_enqueue (&entry->waiters, waiter);
+
+  if (! entry->pending)
+    /* Either a new entry or an expired one.  Start a query.  */
+    {
+      log ("Resolving %s", host);
+
+      entry->pending = true;
+      if (evdns_resolve_ipv4 (entry->host, 0, dns_query_done, entry) != 0)
+	{
+	  log ("Failed to start a query for %s", host);
+
+	  entry->pending = false;
+	  entry->valid = false;
+	  entry->expires = now + DNS_NEGATIVE_TTL;
+
+	  dns_entry_waiter_list_unlink (&entry->waiters, waiter);
+	  dns_fail_later (waiter);
+	}
+    }
+
+  return 1;
+}
+
+void
+dns_cancel (struct dns_waiter *waiter)
+{
+  if (waiter->entry)
+    dns_entry_waiter_list_unlink (&waiter->entry->waiters, waiter);
+  else
+    evtimer_del (&waiter->event);
+
+  free (waiter);
+}
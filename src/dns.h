@@ -0,0 +1,55 @@
+/* dns.h - Asynchronous, caching host name resolution.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#ifndef DNS_H
+#define DNS_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+/* A handle on an outstanding lookup.  */
+struct dns_waiter;
+
+/* Called when a lookup completes.  If the name could be resolved,
+   ADDR points to the address, otherwise, ADDR is NULL.  */
+typedef void (*dns_callback_t) (const struct in_addr *addr, void *arg);
+
+/* Initialize the resolver.  Must be called after the event base has
+   been initialized.  */
+extern void dns_init (void);
+
+/* Look up the address of HOST.
+
+   If HOST is a numeric address or its address is in the cache,
+   stores it in *ADDR and returns 0.
+
+   Otherwise, returns 1 and stores a handle in *WAITERP.  When the
+   lookup completes, CALLBACK is invoked with ARG.  CALLBACK is never
+   called from within dns_resolve.  Concurrent lookups for the same
+   host share a single query.  Failures are cached (briefly) as well.
+
+   Returns -1 if memory could not be allocated.  */
+extern int dns_resolve (const char *host, struct in_addr *addr,
+			dns_callback_t callback, void *arg,
+			struct dns_waiter **waiterp);
+
+/* Cancel the outstanding lookup WAITER.  Its callback will not be
+   called.  */
+extern void dns_cancel (struct dns_waiter *waiter);
+
+#endif
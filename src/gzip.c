@@ -20,91 +20,414 @@
 #include <sys/types.h>
 #include <event.h>
 #include <zlib.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
+#include "gzip.h"
+#include "list.h"
 #include "log.h"
 
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
 
-struct evbuffer *
-evbuffer_gzip (struct evbuffer *source, int min_ratio, int deflate_flag)
-{
-  struct evbuffer *target = evbuffer_new ();
+#define EVBUFFER_AVAILABLE(buf) ((buf)->totallen - (buf)->misalign)
+
+/* The amount of output space to reserve before each call to
+   deflate.  */
+#define GZIP_CHUNK (16 * 1024)
+
+/* The maximum number of freed streams of each kind to keep for
+   reuse.  */
+#define GZIP_POOL_MAX 16
+
+/* The amount of input to compress before deciding whether
+   compression is worthwhile.  */
+#define GZIP_SAMPLE (16 * 1024)
+
+/* The amount of input that is examined before any of it is
+   compressed.  If it looks incompressible, compression is abandoned
+   without running deflate at all.  */
+#define GZIP_PROBE (4 * 1024)
+
+/* gzip adds a 20 byte header.  If we don't have at least this much
+   data it's not worth even trying.  */
+#define GZIP_MIN_LENGTH 100
 
-  int ret, flush;
+struct gzip_stream
+{
   z_stream strm;
+  int min_percent;
+  int deflate_flag;
+
+  /* Whether the probe was examined (and compressed).  */
+  bool probed;
+  /* Whether we have decided to compress the input.  */
+  bool committed;
+  /* Whether we gave up on compressing the rest of the input and only
+     store it.  */
+  bool storing;
+
+  /* Until we have decided whether to compress the input, the input
+     consumed so far.  */
+  struct evbuffer *raw;
+  /* The data produced.  */
+  struct evbuffer *output;
+
+  struct list_node node;
+};
+LIST_CLASS(gzip_stream, struct gzip_stream, node, true)
+
+/* Freed streams, indexed by DEFLATE_FLAG.  deflateInit2 allocates and
+   clears some 256 KB of state, which costs more than compressing a
+   typical text response.  deflateReset is cheap.  Streams are only
+   used from the event loop.  */
+static struct gzip_stream_list gzip_stream_pool[2];
+
+struct gzip_stream *
+gzip_stream_new (int min_percent, int deflate_flag)
+{
+  deflate_flag = deflate_flag != 0;
+
+  struct gzip_stream *stream
+    = gzip_stream_list_dequeue (&gzip_stream_pool[deflate_flag]);
+  if (stream)
+    {
+      stream->min_percent = min_percent;
+      return stream;
+    }
+
+  stream = calloc (sizeof (*stream), 1);
+  if (! stream)
+    return NULL;
+
+  stream->min_percent = min_percent;
+  stream->deflate_flag = deflate_flag;
+
+  stream->raw = evbuffer_new ();
+  if (! stream->raw)
+    goto err;
+  stream->output = evbuffer_new ();
+  if (! stream->output)
+    goto err;
 
   /* allocate deflate state */
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
+  stream->strm.zalloc = Z_NULL;
+  stream->strm.zfree = Z_NULL;
+  stream->strm.opaque = Z_NULL;
   int window_size = 15 /* default.  */ + 16 /* gzip encoding */;
   if (deflate_flag)
     window_size = -15;
 
-  ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
-		     window_size,
-		     8 /* default.  */,
-		     Z_DEFAULT_STRATEGY /* default.  But Z_RLE is
-					   better for PNG data.  */);
+  int ret = deflateInit2(&stream->strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			 window_size,
+			 8 /* default.  */,
+			 Z_DEFAULT_STRATEGY /* default.  But Z_RLE is
+					       better for PNG data.  */);
   if (ret != Z_OK)
     goto err;
 
-  /* compress until end of file */
-  strm.avail_in = EVBUFFER_LENGTH (source);
-  strm.next_in = EVBUFFER_DATA (source);
-  flush = Z_FINISH;
+  return stream;
+
+ err:
+  if (stream->output)
+    evbuffer_free (stream->output);
+  if (stream->raw)
+    evbuffer_free (stream->raw);
+  free (stream);
+  return NULL;
+}
+
+void
+gzip_stream_free (struct gzip_stream *stream)
+{
+  struct gzip_stream_list *pool = &gzip_stream_pool[stream->deflate_flag];
+  if (gzip_stream_list_count (pool) < GZIP_POOL_MAX
+      && deflateReset (&stream->strm) == Z_OK
+      && (! stream->storing
+	  || deflateParams (&stream->strm, Z_DEFAULT_COMPRESSION,
+			    Z_DEFAULT_STRATEGY) == Z_OK))
+    /* Keep the stream for the next response.  */
+    {
+      stream->probed = false;
+      stream->committed = false;
+      stream->storing = false;
+      evbuffer_drain (stream->raw, EVBUFFER_LENGTH (stream->raw));
+      evbuffer_drain (stream->output, EVBUFFER_LENGTH (stream->output));
 
-  /* We keep this relatively small and on the very hot stack, which is
-     better than allocating lots of cold memory.  */
-  unsigned char buffer[4096 * 4];
+      gzip_stream_list_push (pool, stream);
+      return;
+    }
+
+  (void)deflateEnd(&stream->strm);
+  evbuffer_free (stream->raw);
+  evbuffer_free (stream->output);
+  free (stream);
+}
 
-  /* run deflate() on input until output buffer not full, finish
-     compression if all of source has been read in */
+/* Run deflate on the LEN bytes at DATA with flush mode FLUSH.  Append
+   the produced data to STREAM->OUTPUT.  Returns 0 on success, -1 on
+   failure.  */
+static int
+gzip_stream_deflate (struct gzip_stream *stream,
+		     unsigned char *data, int len, int flush)
+{
+  struct evbuffer *output = stream->output;
+
+  stream->strm.avail_in = len;
+  stream->strm.next_in = data;
+
+  /* run deflate() on input until output buffer not full */
+  int ret;
   do
     {
-      strm.avail_out = sizeof (buffer);
-      strm.next_out = buffer;
-      ret = deflate(&strm, flush);    /* no bad return value */
-      assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-
-      int produced = sizeof (buffer) - strm.avail_out;
-      int consumed = EVBUFFER_LENGTH (source) - strm.avail_in;
-      if (/* If we've consumed less than half of the data and the
-	   amount of produced data exceeds the desired threshold,
-	   abort.  */
-	  (consumed < EVBUFFER_LENGTH (source) / 2
-	   && (100 * produced) / consumed > min_ratio)
-	  /* If we've consumed more than half but not yet all data and
-	     the amount of produced data exceeds 97% of the consumed
-	     data, abort.  */
-	  || (consumed < produced
-	      && (100 * produced) / consumed > MAX (97, min_ratio))
-	  /* The amount of data produced is more than 99% of the
-	     source.  */
-	  || (100 * produced) / consumed > MAX (99, min_ratio))
+      /* Compress directly into the output buffer's free space.  */
+      if (evbuffer_expand (output, GZIP_CHUNK) < 0)
+	return -1;
+
+      unsigned char *end = EVBUFFER_DATA (output) + EVBUFFER_LENGTH (output);
+      int space = EVBUFFER_AVAILABLE (output) - EVBUFFER_LENGTH (output);
+      stream->strm.avail_out = space;
+      stream->strm.next_out = end;
+      ret = deflate(&stream->strm, flush);
+      if (ret == Z_STREAM_ERROR)
+	return -1;
+
+      /* evbuffer_expand does not adjust the length.  Do it now.  */
+      EVBUFFER_LENGTH (output) += space - stream->strm.avail_out;
+    }
+  while (stream->strm.avail_out == 0);
+  assert(stream->strm.avail_in == 0);     /* all input will be used */
+  assert(flush != Z_FINISH || ret == Z_STREAM_END);
+
+  return 0;
+}
+
+/* Signatures of formats whose data is already compressed.  */
+static const struct
+{
+  int offset;
+  int len;
+  const char *magic;
+} compressed_formats[] =
+  {
+    { 0, 2, "\x1f\x8b" },			/* gzip.  */
+    { 0, 4, "PK\x03\x04" },			/* zip, jar, docx, apk.  */
+    { 0, 3, "BZh" },				/* bzip2.  */
+    { 0, 6, "\xfd" "7zXZ\0" },		/* xz.  */
+    { 0, 6, "7z\xbc\xaf\x27\x1c" },		/* 7-zip.  */
+    { 0, 4, "Rar!" },				/* rar.  */
+    { 0, 4, "\x28\xb5\x2f\xfd" },		/* zstd.  */
+    { 0, 3, "\xff\xd8\xff" },			/* JPEG.  */
+    { 0, 4, "\x89PNG" },			/* PNG.  */
+    { 0, 4, "GIF8" },				/* GIF.  */
+    { 8, 4, "WEBP" },				/* WebP.  */
+    { 4, 4, "ftyp" },				/* MP4, QuickTime.  */
+    { 0, 4, "\x1a\x45\xdf\xa3" },		/* Matroska, WebM.  */
+    { 0, 4, "OggS" },				/* Ogg.  */
+    { 0, 3, "ID3" },				/* MP3.  */
+    { 0, 4, "fLaC" },				/* FLAC.  */
+    { 0, 4, "wOFF" },				/* WOFF.  */
+    { 0, 4, "wOF2" },				/* WOFF2.  */
+  };
+
+/* Predict whether the LEN bytes at DATA, the start of the input, are
+   worth compressing.  This is much cheaper than running deflate.  */
+static bool
+gzip_predict (const unsigned char *data, int len)
+{
+  int i;
+  for (i = 0; i < sizeof (compressed_formats) / sizeof (compressed_formats[0]);
+       i ++)
+    if (len >= compressed_formats[i].offset + compressed_formats[i].len
+	&& memcmp (data + compressed_formats[i].offset,
+		   compressed_formats[i].magic, compressed_formats[i].len) == 0)
+      {
+	log (BOLD ("Not compressing: already compressed (%d)"), i);
+	return false;
+      }
+
+  if (len < GZIP_PROBE)
+    /* Too little data for a meaningful estimate.  */
+    return true;
+  len = GZIP_PROBE;
+
+  /* Estimate the entropy of the bytes from the probability that two
+     bytes drawn at random are equal (the collision entropy, which is
+     a lower bound on the Shannon entropy).  For random data, the sum
+     of the squares of the counts is about LEN^2/256; text and markup
+     come out at least an order of magnitude higher.  */
+  int counts[256];
+  memset (counts, 0, sizeof (counts));
+  for (i = 0; i < len; i ++)
+    counts[data[i]] ++;
+
+  long long sum = 0;
+  for (i = 0; i < 256; i ++)
+    sum += (long long) counts[i] * counts[i];
+
+  /* More than 7 bits of entropy per byte: deflate won't get below
+     90%.  */
+  if (128 * sum < (long long) len * len)
+    {
+      log (BOLD ("Not compressing: high entropy"));
+      return false;
+    }
+
+  return true;
+}
+
+/* Examine the input consumed so far, which is in STREAM->RAW.  If it
+   looks compressible, compress it and return GZIP_SAMPLING.
+   Otherwise, hand back the input and return GZIP_ABANDONED.  */
+static enum gzip_status
+gzip_stream_probe (struct gzip_stream *stream)
+{
+  stream->probed = true;
+
+  if (! gzip_predict (EVBUFFER_DATA (stream->raw),
+		      EVBUFFER_LENGTH (stream->raw)))
+    {
+      if (evbuffer_add_buffer (stream->output, stream->raw) < 0)
+	return GZIP_ERROR;
+      return GZIP_ABANDONED;
+    }
+
+  if (gzip_stream_deflate (stream, EVBUFFER_DATA (stream->raw),
+			   EVBUFFER_LENGTH (stream->raw), Z_NO_FLUSH) < 0)
+    return GZIP_ERROR;
+
+  return GZIP_SAMPLING;
+}
+
+/* Decide whether compressing is worthwhile given that compressing the
+   input consumed so far yielded the data in STREAM->OUTPUT and that
+   the output may exceed THRESHOLD percent of the input.  */
+static enum gzip_status
+gzip_stream_decide (struct gzip_stream *stream, int threshold)
+{
+  int consumed = EVBUFFER_LENGTH (stream->raw);
+  int produced = EVBUFFER_LENGTH (stream->output);
+
+  if (consumed < GZIP_MIN_LENGTH
+      || (100 * produced) / consumed > threshold)
+    {
+      log (BOLD ("Aborted compression: %d/%d: %d%%"),
+	   produced, consumed,
+	   consumed ? (100 * produced) / consumed : 0);
+
+      /* Hand back the input.  */
+      evbuffer_drain (stream->output, EVBUFFER_LENGTH (stream->output));
+      if (evbuffer_add_buffer (stream->output, stream->raw) < 0)
+	return GZIP_ERROR;
+      return GZIP_ABANDONED;
+    }
+
+  stream->committed = true;
+  evbuffer_drain (stream->raw, EVBUFFER_LENGTH (stream->raw));
+  return GZIP_COMPRESSING;
+}
+
+enum gzip_status
+gzip_stream_feed (struct gzip_stream *stream, struct evbuffer *source)
+{
+  int len = EVBUFFER_LENGTH (source);
+  if (len == 0)
+    return stream->committed ? GZIP_COMPRESSING : GZIP_SAMPLING;
+
+  if (stream->probed
+      && gzip_stream_deflate (stream, EVBUFFER_DATA (source), len,
+			      Z_NO_FLUSH) < 0)
+    return GZIP_ERROR;
+
+  if (! stream->committed)
+    {
+      /* Remember the input in case we abandon compression.  This
+	 drains SOURCE.  */
+      if (evbuffer_add_buffer (stream->raw, source) < 0)
+	return GZIP_ERROR;
+
+      if (! stream->probed)
 	{
-	  log (BOLD ("Aborted compression: %d/%d: %d%%"),
-	       produced, consumed,
-	       (100 * produced) / consumed);
-	  goto err_with_stream;
+	  if (EVBUFFER_LENGTH (stream->raw) < GZIP_PROBE)
+	    return GZIP_SAMPLING;
+
+	  enum gzip_status status = gzip_stream_probe (stream);
+	  if (status != GZIP_SAMPLING)
+	    return status;
 	}
 
-      if (evbuffer_add (target, buffer, produced) < 0)
-	goto err_with_stream;
+      if (EVBUFFER_LENGTH (stream->raw) < GZIP_SAMPLE)
+	return GZIP_SAMPLING;
+
+      /* Flush so that the size of the output reflects all of the
+	 input.  */
+      if (gzip_stream_deflate (stream, NULL, 0, Z_SYNC_FLUSH) < 0)
+	return GZIP_ERROR;
+
+      return gzip_stream_decide (stream, stream->min_percent);
     }
-  while (strm.avail_out == 0);
-  assert(strm.avail_in == 0);     /* all input will be used */
-  assert(ret == Z_STREAM_END);        /* stream will be complete */
 
-  /* clean up and return */
-  (void)deflateEnd(&strm);
+  evbuffer_drain (source, len);
+
+  if (! stream->storing
+      && (100 * stream->strm.total_out) / stream->strm.total_in
+         > MAX (97, stream->min_percent))
+    /* The data is not compressing well.  We can't abandon the
+       compression: the client already knows that the data is
+       compressed.  But we can at least stop wasting cycles on it.  */
+    {
+      log (BOLD ("Storing the rest: %ld/%ld"),
+	   stream->strm.total_out, stream->strm.total_in);
 
-  return target;
+      /* Make sure that deflateParams doesn't need any output
+	 space.  */
+      if (gzip_stream_deflate (stream, NULL, 0, Z_SYNC_FLUSH) < 0)
+	return GZIP_ERROR;
 
- err_with_stream:
-  (void)deflateEnd(&strm);
- err:
-  evbuffer_free (target);
-  return NULL;
+      unsigned char buffer[64];
+      stream->strm.avail_out = sizeof (buffer);
+      stream->strm.next_out = buffer;
+      if (deflateParams (&stream->strm, Z_NO_COMPRESSION,
+			 Z_DEFAULT_STRATEGY) == Z_OK)
+	stream->storing = true;
+
+      int produced = sizeof (buffer) - stream->strm.avail_out;
+      if (produced > 0
+	  && evbuffer_add (stream->output, buffer, produced) < 0)
+	return GZIP_ERROR;
+    }
+
+  return GZIP_COMPRESSING;
+}
+
+enum gzip_status
+gzip_stream_finish (struct gzip_stream *stream)
+{
+  if (! stream->probed)
+    {
+      enum gzip_status status = gzip_stream_probe (stream);
+      if (status != GZIP_SAMPLING)
+	return status;
+    }
+
+  if (gzip_stream_deflate (stream, NULL, 0, Z_FINISH) < 0)
+    return GZIP_ERROR;
+
+  if (! stream->committed)
+    /* The complete input fit in the sample.  */
+    return gzip_stream_decide (stream, MAX (99, stream->min_percent));
+
+  return GZIP_COMPRESSING;
+}
+
+struct evbuffer *
+gzip_stream_output (struct gzip_stream *stream)
+{
+  return stream->output;
+}
+
+const char *
+gzip_stream_encoding (struct gzip_stream *stream)
+{
+  return stream->deflate_flag ? "deflate" : "gzip";
 }
@@ -24,18 +24,63 @@
 #include <event.h>
 #include <zlib.h>
 
-/* gzip SOURCE.  Result is returned or NULL, if an error occured.
+#include <stdbool.h>
 
-   If, while processing the first half of the stream, it appears that
-   the result will be larger than MIN_PERCENT of the input, then
-   compression is aborted.  After the half way point, the threshold is
-   upped to MAX (97%, MIN_PRECENT).  On completion, it is set to MAX
-   (99%, MIN_PERCENT).
+/* An incremental gzip (or deflate) encoder.  */
+struct gzip_stream;
 
-   DEFLATE_FLAG makes the buffer be compressed in deflate-style rather
+enum gzip_status
+  {
+    /* The stream is still sampling the input to decide whether
+       compressing it is worthwhile.  No output is available yet.  */
+    GZIP_SAMPLING,
+    /* The input is being compressed.  Any output is available from
+       gzip_stream_output.  */
+    GZIP_COMPRESSING,
+    /* Compressing the input is not worthwhile.  The output holds the
+       input consumed so far, uncompressed.  The stream should be
+       freed and any further input sent as is.  */
+    GZIP_ABANDONED,
+    /* An error occured.  The output is undefined.  */
+    GZIP_ERROR,
+  };
+
+/* Create a new stream.
+
+   The stream first examines the start of the input.  If it is in a
+   format that is already compressed or looks random, compression is
+   abandoned without compressing anything.  Otherwise, the stream
+   consumes a sample of the input.  If the sample does not compress
+   to at most MIN_PERCENT of its size, compression is abandoned.  If
+   the complete input fits in the sample, the threshold is MAX (99%,
+   MIN_PERCENT).  If, once compressing, the
+   output exceeds MAX (97%, MIN_PERCENT) of the input, the remaining
+   input is stored rather than compressed.
+
+   DEFLATE_FLAG makes the data be compressed in deflate-style rather
    than gzip-style when it is non-zero.
- */
-struct evbuffer *evbuffer_gzip (struct evbuffer *source,
-				int min_percent, int deflate_flag);
+
+   Returns NULL if memory could not be allocated.  */
+extern struct gzip_stream *gzip_stream_new (int min_percent,
+					    int deflate_flag);
+
+/* Release the resources associated with STREAM.  */
+extern void gzip_stream_free (struct gzip_stream *stream);
+
+/* Consume the data in SOURCE, draining it.  */
+extern enum gzip_status gzip_stream_feed (struct gzip_stream *stream,
+					  struct evbuffer *source);
+
+/* Signal that there is no more input and terminate the compressed
+   stream.  Never returns GZIP_SAMPLING.  */
+extern enum gzip_status gzip_stream_finish (struct gzip_stream *stream);
+
+/* Return the buffer holding the data that STREAM produced.  The
+   caller should drain it.  */
+extern struct evbuffer *gzip_stream_output (struct gzip_stream *stream);
+
+/* Return the content coding that STREAM produces ("gzip" or
+   "deflate").  */
+extern const char *gzip_stream_encoding (struct gzip_stream *stream);
 
 #endif
@@ -23,9 +23,23 @@ enum evhttp_connection_error {
 	EVCON_HTTP_INVALID_HEADER
 };
 
+/* A request flag (see struct evhttp_request): the request's output
+   buffer holds its serialized request line and header lines rather
+   than a body.  */
+#define EVHTTP_REQ_RAW_HEADERS	0x0100
+/* A request flag: the request has been written to the connection.  */
+#define EVHTTP_REQ_SENT		0x0200
+/* A request flag: the request was written while the response to an
+   earlier request was still outstanding.  */
+#define EVHTTP_REQ_PIPELINED	0x0400
+/* A request flag: the request's body is obtained from the connection's
+   body callback while the request is being written.  */
+#define EVHTTP_REQ_BODY_STREAM	0x0800
+
 struct evbuffer;
 struct addrinfo;
 struct evhttp_request;
+struct dns_waiter;
 
 /* A stupid connection object - maybe make this a bufferevent later */
 
@@ -42,6 +56,8 @@ struct evhttp_connection {
 	int fd;
 	struct event ev;
 	struct event close_ev;
+	struct event pipeline_ev;	/* writes pipelined requests */
+	struct dns_waiter *dns_waiter;	/* outstanding name lookup */
 	struct evbuffer *input_buffer;
 	struct evbuffer *output_buffer;
 	
@@ -52,10 +68,19 @@ struct evhttp_connection {
 #define EVHTTP_CON_INCOMING	0x0001	/* only one request on it ever */
 #define EVHTTP_CON_OUTGOING	0x0002  /* multiple requests possible */
 #define EVHTTP_CON_CLOSEDETECT  0x0004  /* detecting if persistent close */
+#define EVHTTP_CON_PAUSE	0x0008	/* don't read more of a body */
+#define EVHTTP_CON_PAUSED	0x0010	/* reading a body was deferred */
 
 	int timeout;			/* timeout in seconds for events */
 	int retry_cnt;			/* retry count */
 	int retry_max;			/* maximum number of retries */
+
+	int pipeline_max;		/* max. requests in flight; 0 or 1:
+					   no pipelining */
+	int pipeline_failed;		/* the server mishandled pipelined
+					   requests */
+	int body_pending;		/* the body of the request being
+					   written is incomplete */
 	
 	enum evhttp_connection_state state;
 
@@ -69,6 +94,8 @@ struct evhttp_connection {
 	
 	void (*closecb)(struct evhttp_connection *, void *);
 	void *closecb_arg;
+
+	int (*bodycb)(struct evhttp_request *, struct evbuffer *, void *);
 };
 
 struct evhttp_cb {
@@ -95,9 +122,38 @@ struct evhttp {
 /* resets the connection; can be reused for more requests */
 void evhttp_connection_reset(struct evhttp_connection *);
 
+/* returns whether the connection is open and has no requests queued */
+int evhttp_connection_is_idle(struct evhttp_connection *);
+
 /* connects if necessary */
 int evhttp_connection_connect(struct evhttp_connection *);
 
+/* allows up to DEPTH requests to be written to the connection before
+   their responses have arrived; 0 or 1 disables pipelining */
+void evhttp_connection_set_pipelining(struct evhttp_connection *, int depth);
+
+/* returns whether the server was seen to mishandle pipelined requests.
+   Once this happens, the connection no longer pipelines requests.  */
+int evhttp_connection_pipelining_failed(struct evhttp_connection *);
+
+/* sets the callback that supplies the bodies of requests flagged
+   EVHTTP_REQ_BODY_STREAM.  It is called with the request's callback
+   argument whenever the connection can take more data, appends what
+   is available to the buffer and returns 1 once the body is
+   complete.  */
+void evhttp_connection_set_bodycb(struct evhttp_connection *,
+    int (*)(struct evhttp_request *, struct evbuffer *, void *));
+
+/* tells the connection that more of the request's body is available */
+void evhttp_request_body_available(struct evhttp_request *);
+
+/* stops reading the body of the response being received (once the
+   data that is being read has been delivered) */
+void evhttp_connection_pause(struct evhttp_connection *);
+
+/* continues reading a body after evhttp_connection_pause */
+void evhttp_connection_resume(struct evhttp_connection *);
+
 /* notifies the current request that it failed; resets connection */
 void evhttp_connection_fail(struct evhttp_connection *,
     enum evhttp_connection_error error);
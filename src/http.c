@@ -87,6 +87,7 @@
 #include "evhttp.h"
 #include "log.h"
 #include "http-internal.h"
+#include "dns.h"
 
 #ifndef HAVE_GETADDRINFO
 struct addrinfo {
@@ -147,6 +148,7 @@ extern int debug;
 
 static int make_socket_ai(int should_bind, struct addrinfo *);
 static int make_socket(int should_bind, const char *, u_short);
+static int make_socket_addr(const struct in_addr *, u_short);
 static void name_from_addr(struct sockaddr *, socklen_t, char **, char **);
 static int evhttp_associate_new_request_with_connection(
 	struct evhttp_connection *evcon);
@@ -155,6 +157,10 @@ static void evhttp_connection_start_detectclose(
 static void evhttp_connection_stop_detectclose(
 	struct evhttp_connection *evcon);
 static void evhttp_request_dispatch(struct evhttp_connection* evcon);
+static void evhttp_connection_pipeline_failed(struct evhttp_connection *);
+static void evhttp_handle_header(struct evhttp_connection *);
+static int evhttp_connection_start(struct evhttp_connection *,
+    const struct in_addr *);
 
 void evhttp_read(int, short, void *);
 void evhttp_write(int, short, void *);
@@ -403,6 +409,21 @@ evhttp_make_header_response(struct evhttp_connection *evcon,
 	}
 }
 
+/*
+ * Appends as much of the body of the request being written as is
+ * available to the output buffer.
+ */
+
+static void
+evhttp_write_body(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+
+	assert(evcon->bodycb != NULL);
+	if ((*evcon->bodycb)(req, evcon->output_buffer, req->cb_arg))
+		evcon->body_pending = 0;
+}
+
 void
 evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
 {
@@ -412,6 +433,31 @@ evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
 	 * Depending if this is a HTTP request or response, we might need to
 	 * add some new headers or remove existing headers.
 	 */
+	if (req->flags & EVHTTP_REQ_RAW_HEADERS) {
+		/*
+		 * The caller formatted the request line and the headers.
+		 * Unless the connection pipelines requests, a request is
+		 * only dispatched once and we can just move them.  A
+		 * pipelined request may have to be sent again (see
+		 * evhttp_connection_pipeline_failed).
+		 */
+		if (evcon->pipeline_max > 1)
+			evbuffer_add(evcon->output_buffer,
+			    EVBUFFER_DATA(req->output_buffer),
+			    EVBUFFER_LENGTH(req->output_buffer));
+		else
+			evbuffer_add_buffer(evcon->output_buffer,
+			    req->output_buffer);
+		evbuffer_add(evcon->output_buffer, "\r\n", 2);
+
+		if (req->flags & EVHTTP_REQ_BODY_STREAM) {
+			/* evhttp_write pulls the rest as it drains. */
+			evcon->body_pending = 1;
+			evhttp_write_body(evcon);
+		}
+		return;
+	}
+
 	if (req->kind == EVHTTP_REQUEST) {
 		evhttp_make_header_request(evcon, req);
 	} else {
@@ -423,6 +469,7 @@ evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
 			       "%s: %s\r\n",
 			       header->key, header->value);
 	}
+
 	evbuffer_add(evcon->output_buffer, "\r\n", 2);
 
 	if (EVBUFFER_LENGTH(req->output_buffer) >= 0) {
@@ -528,6 +575,7 @@ evhttp_connection_fail(struct evhttp_connection *evcon,
 	struct evhttp_request* req = TAILQ_FIRST(&evcon->requests);
 	void (*cb)(struct evhttp_request *, void *);
 	void *cb_arg;
+	int pipelined;
 	assert(req != NULL);
 	
 	if (evcon->flags & EVHTTP_CON_INCOMING) {
@@ -544,6 +592,20 @@ evhttp_connection_fail(struct evhttp_connection *evcon,
 		return;
 	}
 
+	pipelined = (req->flags & EVHTTP_REQ_PIPELINED) ||
+	    (TAILQ_NEXT(req, next) != NULL &&
+		(TAILQ_NEXT(req, next)->flags & EVHTTP_REQ_SENT));
+	if (pipelined && req->response_code == 0) {
+		/*
+		 * None of the response arrived.  The failure may be due
+		 * to the server not coping with pipelined requests.  Send
+		 * the requests again, one at a time.
+		 */
+		evhttp_connection_pipeline_failed(evcon);
+		evhttp_connection_connect(evcon);
+		return;
+	}
+
 	/* save the callback for later; the cb might free our object */
 	cb = req->cb;
 	cb_arg = req->cb_arg;
@@ -554,7 +616,11 @@ evhttp_connection_fail(struct evhttp_connection *evcon,
 	/* xxx: maybe we should fail all requests??? */
 
 	/* reset the connection */
-	evhttp_connection_reset(evcon);
+	if (pipelined)
+		/* The requests that we pipelined must be sent again. */
+		evhttp_connection_pipeline_failed(evcon);
+	else
+		evhttp_connection_reset(evcon);
 	
 	/* We are trying the next request that was queued on us */
 	if (TAILQ_FIRST(&evcon->requests) != NULL)
@@ -576,23 +642,39 @@ evhttp_write(int fd, short what, void *arg)
 		return;
 	}
 
-	n = evbuffer_write(evcon->output_buffer, fd);
-	if (n == -1) {
-		event_debug(("%s: evbuffer_write", __func__));
-		evhttp_connection_fail(evcon, EVCON_HTTP_EOF);
-		return;
-	}
+	/* evhttp_pipeline_write may already have flushed the buffer. */
+	if (EVBUFFER_LENGTH(evcon->output_buffer) != 0) {
+		n = evbuffer_write(evcon->output_buffer, fd);
+		if (n == -1) {
+			event_debug(("%s: evbuffer_write", __func__));
+			evhttp_connection_fail(evcon, EVCON_HTTP_EOF);
+			return;
+		}
 
-	if (n == 0) {
-		event_debug(("%s: write nothing", __func__));
-		evhttp_connection_fail(evcon, EVCON_HTTP_EOF);
-		return;
+		if (n == 0) {
+			event_debug(("%s: write nothing", __func__));
+			evhttp_connection_fail(evcon, EVCON_HTTP_EOF);
+			return;
+		}
+
+		if (EVBUFFER_LENGTH(evcon->output_buffer) != 0) {
+			evhttp_add_event(&evcon->ev, 
+			    evcon->timeout, HTTP_WRITE_TIMEOUT);
+			return;
+		}
 	}
 
-	if (EVBUFFER_LENGTH(evcon->output_buffer) != 0) {
-		evhttp_add_event(&evcon->ev, 
-		    evcon->timeout, HTTP_WRITE_TIMEOUT);
-		return;
+	if (evcon->body_pending) {
+		evhttp_write_body(evcon);
+		if (EVBUFFER_LENGTH(evcon->output_buffer) != 0) {
+			evhttp_add_event(&evcon->ev,
+			    evcon->timeout, HTTP_WRITE_TIMEOUT);
+			return;
+		}
+		if (evcon->body_pending) {
+			/* Wait for evhttp_request_body_available. */
+			return;
+		}
 	}
 
 	/* Activate our call back */
@@ -612,6 +694,7 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 	 */
 	if (con_outgoing) {
 	        int need_close;
+		struct evhttp_request *next;
 		TAILQ_REMOVE(&evcon->requests, req, next);
 		req->evcon = NULL;
 
@@ -619,15 +702,25 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 		    evhttp_is_connection_close(req->flags, req->input_headers) ||
 		    evhttp_is_connection_close(req->flags, req->output_headers);
 
-		/* check if we got asked to close the connection */
-		if (need_close)
+		next = TAILQ_FIRST(&evcon->requests);
+		if (next != NULL && (next->flags & EVHTTP_REQ_SENT) &&
+		    (need_close || req->minor == 0)) {
+			/*
+			 * The server won't answer the requests that we
+			 * pipelined (or is an HTTP/1.0 server, which we
+			 * don't trust to).  Send them again, one at a
+			 * time.
+			 */
+			evhttp_connection_pipeline_failed(evcon);
+		} else if (need_close) {
+			/* check if we got asked to close the connection */
 			evhttp_connection_reset(evcon);
+		}
 
-		if (TAILQ_FIRST(&evcon->requests) != NULL) {
+		if (next != NULL) {
 			/*
 			 * We have more requests; reset the connection
-			 * and deal with the next request.  xxx: no
-			 * persistent connection right now
+			 * and deal with the next request.
 			 */
 			if (evcon->state != EVCON_CONNECTED)
 				evhttp_connection_connect(evcon);
@@ -651,6 +744,24 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 	}
 }
 
+/*
+ * Passes the body data read so far to the chunk callback, if any.  The
+ * callback may clear the chunk callback, in which case the data stays
+ * in the input buffer and the rest of the body is accumulated there.
+ */
+
+static void
+evhttp_deliver_chunk(struct evhttp_request *req)
+{
+	if (req->chunk_cb == NULL)
+		return;
+
+	(*req->chunk_cb)(req, req->cb_arg);
+	if (req->chunk_cb != NULL)
+		evbuffer_drain(req->input_buffer,
+		    EVBUFFER_LENGTH(req->input_buffer));
+}
+
 /*
  * Handles reading from a chunked request.
  * return 1: all data has been read
@@ -699,11 +810,7 @@ evhttp_handle_chunked_read(struct evhttp_request *req, struct evbuffer *buf)
 		    EVBUFFER_DATA(buf), req->ntoread);
 		evbuffer_drain(buf, req->ntoread);
 		req->ntoread = -1;
-		if (req->chunk_cb != NULL) {
-			(*req->chunk_cb)(req, req->cb_arg);
-			evbuffer_drain(req->input_buffer,
-			    EVBUFFER_LENGTH(req->input_buffer));
-		}
+		evhttp_deliver_chunk(req);
 	}
 
 	return (0);
@@ -728,18 +835,32 @@ evhttp_read_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 		}
 	} else if (req->ntoread < 0) {
 		/* Read until connection close. */
-		evbuffer_add_buffer(req->input_buffer, buf);
+		if (EVBUFFER_LENGTH(buf) > 0) {
+			evbuffer_add_buffer(req->input_buffer, buf);
+			evhttp_deliver_chunk(req);
+		}
 	} else if (EVBUFFER_LENGTH(buf) >= req->ntoread) {
 		/* Completed content length */
 		evbuffer_add(req->input_buffer, EVBUFFER_DATA(buf),
 		    req->ntoread);
 		evbuffer_drain(buf, req->ntoread);
 		req->ntoread = 0;
+		evhttp_deliver_chunk(req);
 		evhttp_connection_done(evcon);
 		return;
+	} else if (req->chunk_cb != NULL && EVBUFFER_LENGTH(buf) > 0) {
+		/* Pass on what we have of the content */
+		req->ntoread -= EVBUFFER_LENGTH(buf);
+		evbuffer_add_buffer(req->input_buffer, buf);
+		evhttp_deliver_chunk(req);
 	}
 	/* Read more! */
 	event_set(&evcon->ev, evcon->fd, EV_READ, evhttp_read, evcon);
+	if (evcon->flags & EVHTTP_CON_PAUSE) {
+		/* evhttp_connection_resume adds the event. */
+		evcon->flags |= EVHTTP_CON_PAUSED;
+		return;
+	}
 	evhttp_add_event(&evcon->ev, evcon->timeout, HTTP_READ_TIMEOUT);
 }
 
@@ -788,6 +909,19 @@ evhttp_write_connectioncb(struct evhttp_connection *evcon, void *arg)
 	/* We are done writing our header and are now expecting the response */
 	req->kind = EVHTTP_RESPONSE;
 
+	if (EVBUFFER_LENGTH(evcon->input_buffer) != 0) {
+		/*
+		 * The request was pipelined and (some of) its response
+		 * was read along with the previous response.
+		 */
+		if (event_initialized(&evcon->ev))
+			event_del(&evcon->ev);
+		event_set(&evcon->ev, evcon->fd, EV_READ, evhttp_read_header,
+		    evcon);
+		evhttp_handle_header(evcon);
+		return;
+	}
+
 	evhttp_start_read(evcon);
 }
 
@@ -822,6 +956,12 @@ evhttp_connection_free(struct evhttp_connection *evcon)
 
 	if (event_initialized(&evcon->ev))
 		event_del(&evcon->ev);
+
+	if (event_initialized(&evcon->pipeline_ev))
+		event_del(&evcon->pipeline_ev);
+
+	if (evcon->dns_waiter != NULL)
+		dns_cancel(evcon->dns_waiter);
 	
 	if (evcon->fd != -1)
 		close(evcon->fd);
@@ -838,6 +978,41 @@ evhttp_connection_free(struct evhttp_connection *evcon)
 	free(evcon);
 }
 
+/*
+ * Writes the queued requests that were not sent yet to the output
+ * buffer, as long as no more than pipeline_max requests (at least one)
+ * are then in flight.  Only GET requests are pipelined.  Returns the
+ * number of requests written.
+ */
+
+static int
+evhttp_make_requests(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req;
+	int in_flight = 0;
+	int made = 0;
+
+	TAILQ_FOREACH(req, &evcon->requests, next) {
+		if (in_flight > 0 &&
+		    (in_flight >= evcon->pipeline_max ||
+			req->type != EVHTTP_REQ_GET ||
+			TAILQ_FIRST(&evcon->requests)->type != EVHTTP_REQ_GET))
+			break;
+		in_flight++;
+
+		if (req->flags & EVHTTP_REQ_SENT)
+			continue;
+
+		evhttp_make_header(evcon, req);
+		req->flags |= EVHTTP_REQ_SENT;
+		if (in_flight > 1)
+			req->flags |= EVHTTP_REQ_PIPELINED;
+		made++;
+	}
+
+	return (made);
+}
+
 static void
 evhttp_request_dispatch(struct evhttp_connection* evcon)
 {
@@ -854,11 +1029,106 @@ evhttp_request_dispatch(struct evhttp_connection* evcon)
 	assert(evcon->state == EVCON_CONNECTED);
 
 	/* Create the header from the store arguments */
-	evhttp_make_header(evcon, req);
+	if (evhttp_make_requests(evcon) == 0) {
+		/* The request was pipelined.  Wait for its response. */
+		evhttp_write_connectioncb(evcon, NULL);
+		return;
+	}
 
 	evhttp_write_buffer(evcon, evhttp_write_connectioncb, NULL);
 }
 
+/*
+ * Gives up on pipelining requests on the connection: forgets that the
+ * outstanding requests were sent and resets the connection so that
+ * they are sent again, one at a time.
+ */
+
+static void
+evhttp_connection_pipeline_failed(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req;
+
+	event_debug(("%s: \"%s:%d\" mishandled pipelined requests",
+		__func__, evcon->address, evcon->port));
+
+	evcon->pipeline_max = 0;
+	evcon->pipeline_failed = 1;
+
+	TAILQ_FOREACH(req, &evcon->requests, next) {
+		req->flags &= ~(EVHTTP_REQ_SENT | EVHTTP_REQ_PIPELINED);
+		req->kind = EVHTTP_REQUEST;
+	}
+
+	evhttp_connection_reset(evcon);
+
+	/* Drop any partial responses and unsent requests. */
+	evbuffer_drain(evcon->input_buffer,
+	    EVBUFFER_LENGTH(evcon->input_buffer));
+	evbuffer_drain(evcon->output_buffer,
+	    EVBUFFER_LENGTH(evcon->output_buffer));
+}
+
+static void
+evhttp_pipeline_write(int fd, short what, void *arg)
+{
+	struct evhttp_connection *evcon = arg;
+	int n;
+
+	if (what == EV_TIMEOUT) {
+		evhttp_connection_fail(evcon, EVCON_HTTP_TIMEOUT);
+		return;
+	}
+
+	/* evhttp_write may already have flushed the buffer. */
+	if (EVBUFFER_LENGTH(evcon->output_buffer) == 0)
+		return;
+
+	n = evbuffer_write(evcon->output_buffer, fd);
+	if (n <= 0) {
+		event_debug(("%s: evbuffer_write", __func__));
+		evhttp_connection_fail(evcon, EVCON_HTTP_EOF);
+		return;
+	}
+
+	if (EVBUFFER_LENGTH(evcon->output_buffer) != 0)
+		evhttp_add_event(&evcon->pipeline_ev,
+		    evcon->timeout, HTTP_WRITE_TIMEOUT);
+}
+
+/*
+ * Writes requests queued behind the one whose response is being
+ * read, if the connection pipelines requests.
+ */
+
+static void
+evhttp_pipeline_requests(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+
+	/* If the first request wasn't sent yet, it will take the others
+	 * along when it is dispatched. */
+	if (evcon->state != EVCON_CONNECTED || req == NULL ||
+	    !(req->flags & EVHTTP_REQ_SENT))
+		return;
+
+	if (evhttp_make_requests(evcon) == 0)
+		return;
+
+	/* If the first request is still being written, the others are
+	 * written along with it. */
+	if (req->kind == EVHTTP_REQUEST)
+		return;
+
+	/* We're reading the response.  Write concurrently. */
+	if (!event_pending(&evcon->pipeline_ev, EV_WRITE|EV_TIMEOUT, NULL)) {
+		event_set(&evcon->pipeline_ev, evcon->fd, EV_WRITE,
+		    evhttp_pipeline_write, evcon);
+		evhttp_add_event(&evcon->pipeline_ev,
+		    evcon->timeout, HTTP_WRITE_TIMEOUT);
+	}
+}
+
 /* Reset our connection state */
 void
 evhttp_connection_reset(struct evhttp_connection *evcon)
@@ -866,6 +1136,14 @@ evhttp_connection_reset(struct evhttp_connection *evcon)
 	if (event_initialized(&evcon->ev))
 		event_del(&evcon->ev);
 
+	if (event_initialized(&evcon->pipeline_ev))
+		event_del(&evcon->pipeline_ev);
+
+	if (evcon->dns_waiter != NULL) {
+		dns_cancel(evcon->dns_waiter);
+		evcon->dns_waiter = NULL;
+	}
+
 	if (evcon->fd != -1) {
 		/* inform interested parties about connection close */
 		if (evcon->state == EVCON_CONNECTED && evcon->closecb != NULL)
@@ -876,8 +1154,23 @@ evhttp_connection_reset(struct evhttp_connection *evcon)
 	}
 	evcon->state = EVCON_DISCONNECTED;
 
+	/*
+	 * Whatever was not written yet, e.g., part of a streamed body,
+	 * can't be continued on another connection.
+	 */
+	evcon->body_pending = 0;
+	evbuffer_drain(evcon->output_buffer,
+	    EVBUFFER_LENGTH(evcon->output_buffer));
+
 	/* remove unneeded flags */
-	evcon->flags &= ~EVHTTP_CON_CLOSEDETECT;
+	evcon->flags &= ~(EVHTTP_CON_CLOSEDETECT | EVHTTP_CON_PAUSED);
+}
+
+int
+evhttp_connection_is_idle(struct evhttp_connection *evcon)
+{
+	return (evcon->state == EVCON_CONNECTED &&
+	    TAILQ_FIRST(&evcon->requests) == NULL);
 }
 
 static void
@@ -915,6 +1208,35 @@ evhttp_connection_retry(int fd, short what, void *arg)
 	evhttp_connection_connect(evcon);
 }
 
+/*
+ * Either schedules another connection attempt or, if we have run out of
+ * retries, fails all requests queued on the connection.
+ */
+
+static void
+evhttp_connection_connect_failed(struct evhttp_connection *evcon)
+{
+	if (evcon->retry_max < 0 || evcon->retry_cnt < evcon->retry_max) {
+		evtimer_set(&evcon->ev, evhttp_connection_retry, evcon);
+		evhttp_add_event(&evcon->ev, MIN(3600, 2 << evcon->retry_cnt),
+		    HTTP_CONNECT_TIMEOUT);
+		evcon->retry_cnt++;
+		return;
+	}
+	evhttp_connection_reset(evcon);
+
+	/* for now, we just signal all requests by executing their callbacks */
+	while (TAILQ_FIRST(&evcon->requests) != NULL) {
+		struct evhttp_request *request = TAILQ_FIRST(&evcon->requests);
+		TAILQ_REMOVE(&evcon->requests, request, next);
+		request->evcon = NULL;
+
+		/* we might want to set an error here */
+		request->cb(request, request->cb_arg);
+		evhttp_request_free(request);
+	}
+}
+
 /*
  * Call back for asynchronous connection attempt.
  */
@@ -960,25 +1282,29 @@ evhttp_connectioncb(int fd, short what, void *arg)
 	return;
 
  cleanup:
-	if (evcon->retry_max < 0 || evcon->retry_cnt < evcon->retry_max) {
-		evtimer_set(&evcon->ev, evhttp_connection_retry, evcon);
-		evhttp_add_event(&evcon->ev, MIN(3600, 2 << evcon->retry_cnt),
-		    HTTP_CONNECT_TIMEOUT);
-		evcon->retry_cnt++;
-		return;
-	}
-	evhttp_connection_reset(evcon);
+	evhttp_connection_connect_failed(evcon);
+}
 
-	/* for now, we just signal all requests by executing their callbacks */
-	while (TAILQ_FIRST(&evcon->requests) != NULL) {
-		struct evhttp_request *request = TAILQ_FIRST(&evcon->requests);
-		TAILQ_REMOVE(&evcon->requests, request, next);
-		request->evcon = NULL;
+/*
+ * Call back for asynchronous name resolution.
+ */
 
-		/* we might want to set an error here */
-		request->cb(request, request->cb_arg);
-		evhttp_request_free(request);
+static void
+evhttp_connection_resolved(const struct in_addr *addr, void *arg)
+{
+	struct evhttp_connection *evcon = arg;
+
+	evcon->dns_waiter = NULL;
+
+	if (addr == NULL) {
+		event_debug(("%s: failed to resolve \"%s\"",
+			__func__, evcon->address));
+		evhttp_connection_connect_failed(evcon);
+		return;
 	}
+
+	if (evhttp_connection_start(evcon, addr) == -1)
+		evhttp_connection_connect_failed(evcon);
 }
 
 /*
@@ -1320,6 +1646,11 @@ evhttp_get_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 			return;
 		}
 	}
+	/*
+	 * Tell a streaming reader that the headers are complete, before
+	 * any of the body has been delivered.
+	 */
+	evhttp_deliver_chunk(req);
 	evhttp_read_body(evcon, req);
 }
 
@@ -1327,8 +1658,7 @@ void
 evhttp_read_header(int fd, short what, void *arg)
 {
 	struct evhttp_connection *evcon = arg;
-	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
-	int n, res;
+	int n;
 
 	if (what == EV_TIMEOUT) {
 		event_debug(("%s: timeout on %d\n", __func__, fd));
@@ -1348,6 +1678,21 @@ evhttp_read_header(int fd, short what, void *arg)
 		return;
 	}
 
+	evhttp_handle_header(evcon);
+}
+
+/*
+ * Parses the header lines in the input buffer and, once they are
+ * complete, starts reading the body.
+ */
+
+static void
+evhttp_handle_header(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+	int fd = evcon->fd;
+	int res;
+
 	res = evhttp_parse_lines(req, evcon->input_buffer);
 	if (res == -1) {
 		/* Error while reading, terminate */
@@ -1395,9 +1740,8 @@ evhttp_read_header(int fd, short what, void *arg)
  * when finished.  Failure or sucess is indicate by the passed connection
  * object.
  *
- * Although this interface accepts a hostname, it is intended to take
- * only numeric hostnames so that non-blocking DNS resolution can
- * happen elsewhere.
+ * The address is resolved asynchronously (see dns.h) when the
+ * connection is first established.
  */
 
 struct evhttp_connection *
@@ -1458,6 +1802,19 @@ evhttp_connection_set_retries(struct evhttp_connection *evcon,
 	evcon->retry_max = retry_max;
 }
 
+void
+evhttp_connection_set_pipelining(struct evhttp_connection *evcon, int depth)
+{
+	if (!evcon->pipeline_failed)
+		evcon->pipeline_max = depth;
+}
+
+int
+evhttp_connection_pipelining_failed(struct evhttp_connection *evcon)
+{
+	return (evcon->pipeline_failed);
+}
+
 void
 evhttp_connection_set_closecb(struct evhttp_connection *evcon,
     void (*cb)(struct evhttp_connection *, void *), void *cbarg)
@@ -1466,6 +1823,48 @@ evhttp_connection_set_closecb(struct evhttp_connection *evcon,
 	evcon->closecb_arg = cbarg;
 }
 
+void
+evhttp_connection_set_bodycb(struct evhttp_connection *evcon,
+    int (*cb)(struct evhttp_request *, struct evbuffer *, void *))
+{
+	evcon->bodycb = cb;
+}
+
+void
+evhttp_request_body_available(struct evhttp_request *req)
+{
+	struct evhttp_connection *evcon = req->evcon;
+
+	/* Nothing to do unless the body is being written. */
+	if (evcon == NULL || !evcon->body_pending ||
+	    TAILQ_FIRST(&evcon->requests) != req)
+		return;
+
+	/* If a write is pending, evhttp_write pulls the data. */
+	if (event_pending(&evcon->ev, EV_WRITE|EV_TIMEOUT, NULL))
+		return;
+
+	event_set(&evcon->ev, evcon->fd, EV_WRITE, evhttp_write, evcon);
+	evhttp_add_event(&evcon->ev, evcon->timeout, HTTP_WRITE_TIMEOUT);
+}
+
+void
+evhttp_connection_pause(struct evhttp_connection *evcon)
+{
+	evcon->flags |= EVHTTP_CON_PAUSE;
+}
+
+void
+evhttp_connection_resume(struct evhttp_connection *evcon)
+{
+	int paused = evcon->flags & EVHTTP_CON_PAUSED;
+
+	evcon->flags &= ~(EVHTTP_CON_PAUSE | EVHTTP_CON_PAUSED);
+	if (paused)
+		evhttp_add_event(&evcon->ev, evcon->timeout,
+		    HTTP_READ_TIMEOUT);
+}
+
 void
 evhttp_connection_get_peer(struct evhttp_connection *evcon,
     char **address, u_short *port)
@@ -1474,20 +1873,16 @@ evhttp_connection_get_peer(struct evhttp_connection *evcon,
 	*port = evcon->port;
 }
 
-int
-evhttp_connection_connect(struct evhttp_connection *evcon)
-{
-	if (evcon->state == EVCON_CONNECTING)
-		return (0);
-	
-	evhttp_connection_reset(evcon);
+/*
+ * Starts an asynchronous connection to ADDR.
+ */
 
-	assert(!(evcon->flags & EVHTTP_CON_INCOMING));
-	evcon->flags |= EVHTTP_CON_OUTGOING;
-	
+static int
+evhttp_connection_start(struct evhttp_connection *evcon,
+    const struct in_addr *addr)
+{
 	/* Do async connection to HTTP server */
-	if ((evcon->fd = make_socket(
-		     0, evcon->address, evcon->port)) == -1) {
+	if ((evcon->fd = make_socket_addr(addr, evcon->port)) == -1) {
 		event_debug(("%s: failed to connect to \"%s:%d\"",
 			__func__, evcon->address, evcon->port));
 		return (-1);
@@ -1502,6 +1897,33 @@ evhttp_connection_connect(struct evhttp_connection *evcon)
 	return (0);
 }
 
+int
+evhttp_connection_connect(struct evhttp_connection *evcon)
+{
+	struct in_addr addr;
+
+	if (evcon->state == EVCON_CONNECTING)
+		return (0);
+	
+	evhttp_connection_reset(evcon);
+
+	assert(!(evcon->flags & EVHTTP_CON_INCOMING));
+	evcon->flags |= EVHTTP_CON_OUTGOING;
+
+	/* Resolve the address without blocking the event loop */
+	switch (dns_resolve(evcon->address, &addr,
+		    evhttp_connection_resolved, evcon, &evcon->dns_waiter)) {
+	case 0:
+		return (evhttp_connection_start(evcon, &addr));
+	case 1:
+		/* evhttp_connection_resolved continues */
+		evcon->state = EVCON_CONNECTING;
+		return (0);
+	default:
+		return (-1);
+	}
+}
+
 /*
  * Starts an HTTP request on the provided evhttp_connection object.
  * If the connection object is not connected to the web server already,
@@ -1544,6 +1966,8 @@ evhttp_make_request(struct evhttp_connection *evcon,
 	 */
 	if (TAILQ_FIRST(&evcon->requests) == req)
 		evhttp_request_dispatch(evcon);
+	else if (evcon->pipeline_max > 1)
+		evhttp_pipeline_requests(evcon);
 
 	return (0);
 }
@@ -2387,3 +2811,23 @@ make_socket(int should_bind, const char *address, u_short port)
 
 	return (fd);
 }
+
+static int
+make_socket_addr(const struct in_addr *addr, u_short port)
+{
+	struct sockaddr_in sin;
+	struct addrinfo ai;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr = *addr;
+	sin.sin_port = htons(port);
+
+	memset(&ai, 0, sizeof(ai));
+	ai.ai_family = AF_INET;
+	ai.ai_socktype = SOCK_STREAM;
+	ai.ai_addrlen = sizeof(sin);
+	ai.ai_addr = (struct sockaddr *)&sin;
+
+	return (make_socket_ai(0, &ai));
+}
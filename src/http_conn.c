@@ -23,11 +23,340 @@
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <time.h>
+
+#include <sys/tree.h>
 
 #include "http_conn.h"
 #include "user_conn.h"
+#include "http_response.h"
+#include "http-internal.h"
 #include "log.h"
 
+/* The pool of idle connections to origin servers.  When an http
+   connection is released and its evhttp connection is still open, the
+   evhttp connection is kept here so that the next http_conn_new for
+   the same host (by any user connection) can reuse it.  */
+
+/* The maximum number of idle connections to keep per host.  */
+#define POOL_PER_HOST_MAX 8
+/* The maximum number of idle connections to keep in total.  */
+#define POOL_MAX 256
+/* The number of seconds an idle connection is kept.  */
+#define POOL_IDLE_TIMEOUT 30
+/* How often to look for idle connections that have timed out.  */
+#define POOL_SWEEP_INTERVAL 5
+
+struct pool_conn
+{
+  struct evhttp_connection *evhttp_conn;
+  struct pool_host *host;
+
+  /* When the connection was released.  */
+  time_t idle_since;
+
+  /* Node on HOST->CONNS.  Most recently released first.  */
+  struct list_node host_node;
+  /* Node on POOL_LRU.  Least recently released first.  */
+  struct list_node lru_node;
+};
+LIST_CLASS(pool_host_conn, struct pool_conn, host_node, true)
+LIST_CLASS(pool_lru, struct pool_conn, lru_node, true)
+
+struct pool_host
+{
+  RB_ENTRY(pool_host) tree_node;
+
+  struct pool_host_conn_list conns;
+  int count;
+
+  char host[0];
+};
+
+static int
+pool_host_compare (struct pool_host *a, struct pool_host *b)
+{
+  return strcasecmp (a->host, b->host);
+}
+
+RB_HEAD(pool_hosts, pool_host);
+RB_PROTOTYPE(pool_hosts, pool_host, tree_node, pool_host_compare)
+RB_GENERATE(pool_hosts, pool_host, tree_node, pool_host_compare)
+
+static struct pool_hosts pool_hosts = RB_INITIALIZER (&pool_hosts);
+static struct pool_lru_list pool_lru;
+static int pool_count;
+
+static struct event pool_sweep_event;
+
+/* Remove CONN from the pool and free it.  If FREE_EVHTTP_CONN is true,
+   also closes the evhttp connection.  */
+static void
+pool_conn_release (struct pool_conn *conn, bool free_evhttp_conn)
+{
+  struct pool_host *host = conn->host;
+
+  pool_host_conn_list_unlink (&host->conns, conn);
+  host->count --;
+  pool_lru_list_unlink (&pool_lru, conn);
+  pool_count --;
+
+  if (free_evhttp_conn)
+    evhttp_connection_free (conn->evhttp_conn);
+  free (conn);
+
+  if (host->count == 0)
+    {
+      RB_REMOVE (pool_hosts, &pool_hosts, host);
+      free (host);
+    }
+}
+
+static void
+pool_sweep (int fd, short event, void *arg)
+{
+  time_t now = time (NULL);
+
+  /* The LRU list is ordered by release time.  */
+  struct pool_conn *conn;
+  while ((conn = pool_lru_list_head (&pool_lru))
+	 && (conn->idle_since + POOL_IDLE_TIMEOUT <= now
+	     || ! evhttp_connection_is_idle (conn->evhttp_conn)))
+    {
+      log ("Dropping idle connection to %s", conn->host->host);
+      pool_conn_release (conn, true);
+    }
+
+  if (pool_count > 0)
+    {
+      struct timeval tv = { POOL_SWEEP_INTERVAL, 0 };
+      evtimer_add (&pool_sweep_event, &tv);
+    }
+}
+
+/* Return an idle connection to HOST or NULL if there is none.  */
+static struct evhttp_connection *
+pool_get (const char *host)
+{
+  int host_len = strlen (host);
+  struct pool_host *key = alloca (sizeof (*key) + host_len + 1);
+  memcpy (key->host, host, host_len + 1);
+
+  struct pool_host *h = RB_FIND (pool_hosts, &pool_hosts, key);
+  if (! h)
+    return NULL;
+
+  struct pool_conn *conn;
+  while (h->count > 0)
+    {
+      conn = pool_host_conn_list_head (&h->conns);
+      struct evhttp_connection *evhttp_conn = conn->evhttp_conn;
+      bool last = h->count == 1;
+
+      if (evhttp_connection_is_idle (evhttp_conn))
+	{
+	  pool_conn_release (conn, false);
+	  return evhttp_conn;
+	}
+
+      /* The server closed the connection.  */
+      pool_conn_release (conn, true);
+      if (last)
+	/* H was freed.  */
+	break;
+    }
+
+  return NULL;
+}
+
+/* Add EVHTTP_CONN, an idle connection to HOST, to the pool.  */
+static void
+pool_put (const char *host, struct evhttp_connection *evhttp_conn)
+{
+  struct pool_conn *conn = calloc (sizeof (*conn), 1);
+  if (! conn)
+    {
+      evhttp_connection_free (evhttp_conn);
+      return;
+    }
+
+  if (pool_count >= POOL_MAX)
+    /* Evict the least recently used connection.  */
+    pool_conn_release (pool_lru_list_head (&pool_lru), true);
+
+  int host_len = strlen (host);
+  struct pool_host *key = alloca (sizeof (*key) + host_len + 1);
+  memcpy (key->host, host, host_len + 1);
+
+  struct pool_host *h = RB_FIND (pool_hosts, &pool_hosts, key);
+  if (! h)
+    {
+      h = calloc (sizeof (*h) + host_len + 1, 1);
+      if (! h)
+	{
+	  free (conn);
+	  evhttp_connection_free (evhttp_conn);
+	  return;
+	}
+      memcpy (h->host, host, host_len + 1);
+      RB_INSERT (pool_hosts, &pool_hosts, h);
+    }
+  else if (h->count >= POOL_PER_HOST_MAX)
+    /* Make room by dropping this host's oldest connection.  (H is not
+       freed: it still has other connections.)  */
+    pool_conn_release (pool_host_conn_list_tail (&h->conns), true);
+
+  conn->evhttp_conn = evhttp_conn;
+  conn->host = h;
+  conn->idle_since = time (NULL);
+
+  pool_host_conn_list_push (&h->conns, conn);
+  h->count ++;
+  pool_lru_list_enqueue (&pool_lru, conn);
+  pool_count ++;
+
+  if (! evtimer_pending (&pool_sweep_event, NULL))
+    {
+      struct timeval tv = { POOL_SWEEP_INTERVAL, 0 };
+      evtimer_set (&pool_sweep_event, pool_sweep, NULL);
+      evtimer_add (&pool_sweep_event, &tv);
+    }
+}
+
+/* Pipelining.  */
+
+/* The number of requests that may be in flight on a connection.  */
+#define PIPELINE_DEPTH 4
+/* The number of seconds for which we remember that a host mishandled
+   pipelined requests.  */
+#define PIPELINE_BROKEN_TIMEOUT (60 * 60)
+/* The maximum number of such hosts that we remember.  */
+#define PIPELINE_BROKEN_MAX 1024
+
+/* The hosts the user allowed us to pipeline requests to.  */
+static char **pipeline_hosts;
+static int pipeline_host_count;
+/* Whether to pipeline requests to all hosts.  */
+static bool pipeline_all;
+
+/* A host that mishandled pipelined requests.  */
+struct broken_host
+{
+  RB_ENTRY(broken_host) tree_node;
+
+  /* When to try pipelining again.  */
+  time_t until;
+
+  char host[0];
+};
+
+static int
+broken_host_compare (struct broken_host *a, struct broken_host *b)
+{
+  return strcasecmp (a->host, b->host);
+}
+
+RB_HEAD(broken_hosts, broken_host);
+RB_PROTOTYPE(broken_hosts, broken_host, tree_node, broken_host_compare)
+RB_GENERATE(broken_hosts, broken_host, tree_node, broken_host_compare)
+
+static struct broken_hosts broken_hosts = RB_INITIALIZER (&broken_hosts);
+static int broken_host_count;
+
+void
+http_conn_pipeline_init (const char *hosts)
+{
+  if (strcmp (hosts, "*") == 0)
+    {
+      pipeline_all = true;
+      return;
+    }
+
+  char *copy = strdup (hosts);
+  if (! copy)
+    return;
+
+  char *saveptr = NULL;
+  char *host;
+  for (host = strtok_r (copy, ",", &saveptr); host;
+       host = strtok_r (NULL, ",", &saveptr))
+    {
+      char **h = realloc (pipeline_hosts,
+			  (pipeline_host_count + 1) * sizeof (*h));
+      if (! h)
+	break;
+
+      pipeline_hosts = h;
+      pipeline_hosts[pipeline_host_count ++] = host;
+    }
+}
+
+/* Return the broken_host record for HOST, or NULL if HOST is not
+   known to mishandle pipelining.  Forgets about HOST if its record
+   expired.  */
+static struct broken_host *
+pipeline_broken_find (const char *host)
+{
+  if (broken_host_count == 0)
+    return NULL;
+
+  int host_len = strlen (host);
+  struct broken_host *key = alloca (sizeof (*key) + host_len + 1);
+  memcpy (key->host, host, host_len + 1);
+
+  struct broken_host *b = RB_FIND (broken_hosts, &broken_hosts, key);
+  if (b && b->until <= time (NULL))
+    {
+      RB_REMOVE (broken_hosts, &broken_hosts, b);
+      broken_host_count --;
+      free (b);
+      return NULL;
+    }
+
+  return b;
+}
+
+/* Return whether requests to HOST may be pipelined.  */
+static bool
+pipeline_host_ok (const char *host)
+{
+  if (! pipeline_all)
+    {
+      int i;
+      for (i = 0; i < pipeline_host_count; i ++)
+	if (strcasecmp (pipeline_hosts[i], host) == 0)
+	  break;
+      if (i == pipeline_host_count)
+	return false;
+    }
+
+  return ! pipeline_broken_find (host);
+}
+
+/* Note that HOST mishandled pipelined requests.  */
+static void
+pipeline_host_broken (const char *host)
+{
+  struct broken_host *b = pipeline_broken_find (host);
+  if (! b)
+    {
+      if (broken_host_count >= PIPELINE_BROKEN_MAX)
+	return;
+
+      int host_len = strlen (host);
+      b = calloc (sizeof (*b) + host_len + 1, 1);
+      if (! b)
+	return;
+      memcpy (b->host, host, host_len + 1);
+
+      RB_INSERT (broken_hosts, &broken_hosts, b);
+      broken_host_count ++;
+    }
+
+  log ("%s mishandles pipelined requests", host);
+  b->until = time (NULL) + PIPELINE_BROKEN_TIMEOUT;
+}
+
 struct http_conn *
 http_conn_new (const char *host,
 	       struct user_conn *user_conn)
@@ -62,13 +391,20 @@ http_conn_new (const char *host,
 	}
     }
 
-  conn->evhttp_conn = evhttp_connection_new (h, p);
+  conn->evhttp_conn = pool_get (host);
+  if (conn->evhttp_conn)
+    log ("Reusing idle connection to %s", host);
+  else
+    conn->evhttp_conn = evhttp_connection_new (h, p);
   if (! conn->evhttp_conn)
     {
       log ("Cannot establish connection to %s:%d\n", h, p);
       goto evhttp_connection_new_fail;
     }
 
+  evhttp_connection_set_pipelining (conn->evhttp_conn,
+				   pipeline_host_ok (host) ? PIPELINE_DEPTH : 0);
+
   user_conn_http_conn_list_enqueue (&user_conn->http_conns, conn);
 
   return conn;
@@ -78,16 +414,45 @@ http_conn_new (const char *host,
   return NULL;
 }
 
+void
+http_conn_pause (struct http_conn *http_conn, bool pause)
+{
+  if (http_conn->paused == pause)
+    return;
+
+  log ("%s reading from %s", pause ? "Pausing" : "Resuming", http_conn->host);
+
+  http_conn->paused = pause;
+  if (pause)
+    evhttp_connection_pause (http_conn->evhttp_conn);
+  else
+    evhttp_connection_resume (http_conn->evhttp_conn);
+}
+
 void
 http_conn_free (struct http_conn *http_conn)
 {
   log ("Closing http connection to %s.  %d requests.",
        http_conn->host, http_conn->request_count);
 
-  /* First, we close the http connection.  This aborts any outstanding
-     requests (but without signalling an error).  Thus, we next go
-     through and free the outstanding requests.  */
-  evhttp_connection_free (http_conn->evhttp_conn);
+  if (evhttp_connection_pipelining_failed (http_conn->evhttp_conn))
+    pipeline_host_broken (http_conn->host);
+
+  if (http_conn->paused)
+    /* Resume the connection so that, if it goes back to the pool,
+       whoever takes it next doesn't find it paused.  */
+    evhttp_connection_resume (http_conn->evhttp_conn);
+
+  if (! http_conn->close
+      && ! http_conn_http_request_list_head (&http_conn->requests)
+      && evhttp_connection_is_idle (http_conn->evhttp_conn))
+    /* The connection is still good.  Let someone else use it.  */
+    pool_put (http_conn->host, http_conn->evhttp_conn);
+  else
+    /* We close the http connection.  This aborts any outstanding
+       requests (but without signalling an error).  Thus, we next go
+       through and free the outstanding requests.  */
+    evhttp_connection_free (http_conn->evhttp_conn);
 
   struct http_request *request;
   struct http_request *next;
@@ -99,6 +464,20 @@ http_conn_free (struct http_conn *http_conn)
       /* The request was aborted by evhttp_connection_free.  */
       request->evhttp_request = NULL;
 
+      if (request->response)
+	/* The response is being streamed; part of it may already have
+	   been sent.  It is too late to send an error.  Terminate the
+	   response and close the user connection so that the client
+	   notices that it was truncated.  */
+	{
+	  request->response->partial = false;
+	  request->response->ready_to_go = true;
+	  if (! http_conn->user_conn->dead)
+	    bufferevent_disable (http_conn->user_conn->event_source, EV_READ);
+	  http_request_free (request);
+	  continue;
+	}
+
       http_response_new_error (http_conn->user_conn, request,
 			       503, "Server reset connection",
 			       false, request->url);
@@ -42,6 +42,10 @@ struct http_conn
 
   int close;
 
+  /* Whether reading responses is paused because the user connection
+     has too much data buffered.  */
+  bool paused;
+
   /* Number of requests served.  */
   int request_count;
 
@@ -51,15 +55,29 @@ struct http_conn
 LIST_CLASS(user_conn_http_conn, struct http_conn, user_conn_node, true)
 
 
+/* Allow requests to be pipelined to the origin servers named in HOSTS,
+   a comma separated list of host names (with an optional port).  If
+   HOSTS is "*", requests are pipelined to all origin servers.  Servers
+   that are seen to mishandle pipelined requests are excluded for a
+   while.  */
+extern void http_conn_pipeline_init (const char *hosts);
+
 /* Creates a new http connection to HOST on behalf of the user
    connection USER_CONN.  Attaches the new HTTP connection to
-   USER_CONN->HTTP_CONNS.  */
+   USER_CONN->HTTP_CONNS.  If an idle connection to HOST is available
+   in the connection pool, it is reused.  */
 extern struct http_conn *http_conn_new (const char *host,
 					struct user_conn *user_conn);
 
+/* Stop (PAUSE is true) or continue (PAUSE is false) reading the body
+   of the response that CONN is receiving.  */
+extern void http_conn_pause (struct http_conn *conn, bool pause);
+
 /* Frees CONN aborting any outstanding requests.  This disconnects
    CONN from the CONN->USER_CONN->HTTP_CONNS list and frees any
-   requests.  */
+   requests.  If CONN is idle and the server did not ask us to close
+   the connection, the underlying evhttp connection is kept in a
+   process-wide pool from which http_conn_new draws.  */
 extern void http_conn_free (struct http_conn *conn);
 
 #endif
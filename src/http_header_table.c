@@ -0,0 +1,143 @@
+/* http_header_table.c - Classifying well-known HTTP headers.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#include <string.h>
+#include <strings.h>
+
+#include "http_header_table.h"
+
+static const struct
+{
+  const char *name;
+  int len;
+  int flags;
+} headers[HEADER_COUNT] =
+  {
+#define H(name, flags) { name, sizeof (name) - 1, flags }
+    [HEADER_OTHER] = H ("", 0),
+    [HEADER_ACCEPT_ENCODING] = H ("Accept-Encoding", HEADER_REQUEST_STRIP),
+    [HEADER_AGE] = H ("Age", 0),
+    [HEADER_AUTHORIZATION] = H ("Authorization", 0),
+    [HEADER_CACHE_CONTROL] = H ("Cache-Control", 0),
+    [HEADER_CONNECTION] = H ("Connection", HEADER_HOP_BY_HOP),
+    [HEADER_CONTENT_ENCODING] = H ("Content-Encoding", 0),
+    [HEADER_CONTENT_LENGTH] = H ("Content-Length", HEADER_RESPONSE_STRIP),
+    [HEADER_CONTENT_TYPE] = H ("Content-Type", 0),
+    [HEADER_DATE] = H ("Date", 0),
+    [HEADER_EXPIRES] = H ("Expires", 0),
+    [HEADER_HOST] = H ("Host", 0),
+    [HEADER_KEEP_ALIVE] = H ("Keep-Alive", HEADER_HOP_BY_HOP),
+    [HEADER_LAST_MODIFIED] = H ("Last-Modified", 0),
+    [HEADER_PRAGMA] = H ("Pragma", 0),
+    [HEADER_PROXY_AUTHENTICATE] = H ("Proxy-Authenticate", HEADER_HOP_BY_HOP),
+    [HEADER_PROXY_AUTHORIZATION] =
+      H ("Proxy-Authorization", HEADER_HOP_BY_HOP),
+    [HEADER_PROXY_CONNECTION] = H ("Proxy-Connection", HEADER_HOP_BY_HOP),
+    [HEADER_PUBLIC] = H ("Public", HEADER_HOP_BY_HOP),
+    [HEADER_RANGE] = H ("Range", HEADER_REQUEST_STRIP),
+    [HEADER_SERVER] = H ("Server", HEADER_RESPONSE_STRIP),
+    [HEADER_SET_COOKIE] = H ("Set-Cookie", 0),
+    [HEADER_TE] = H ("TE", HEADER_HOP_BY_HOP),
+    [HEADER_TRAILER] = H ("Trailer", HEADER_HOP_BY_HOP),
+    [HEADER_TRANSFER_ENCODING] = H ("Transfer-Encoding", HEADER_HOP_BY_HOP),
+    [HEADER_UPGRADE] = H ("Upgrade", HEADER_HOP_BY_HOP),
+    [HEADER_VARY] = H ("Vary", 0),
+    [HEADER_X_CNECTION] = H ("X-Cnection", HEADER_RESPONSE_STRIP),
+    [HEADER_X_POWERED_BY] = H ("X-Powered-By", HEADER_RESPONSE_STRIP),
+#undef H
+  };
+
+/* A perfect hash of the names of the headers in HEADERS.  The hash of a
+   name of length LEN is the sum of LEN, 14 times its first character,
+   21 times its last character and its middle character (all in lower
+   case) modulo 64.  The multipliers were found by trying small values
+   until all known names hashed to different slots.  If you add a
+   header, you'll need to find new ones.  */
+#define HASH_SIZE 64
+
+static inline unsigned int
+hash (const char *key, int len)
+{
+  /* Setting the 0x20 bit lower cases letters and leaves '-' alone.  */
+  return (len
+	  + 14 * (key[0] | 0x20)
+	  + 21 * (key[len - 1] | 0x20)
+	  + (key[len / 2] | 0x20)) % HASH_SIZE;
+}
+
+static const unsigned char slots[HASH_SIZE] =
+  {
+    HEADER_OTHER, HEADER_AGE,
+    HEADER_PRAGMA, HEADER_X_CNECTION,
+    HEADER_OTHER, HEADER_OTHER,
+    HEADER_OTHER, HEADER_OTHER,
+    HEADER_TE, HEADER_TRANSFER_ENCODING,
+    HEADER_AUTHORIZATION, HEADER_OTHER,
+    HEADER_SET_COOKIE, HEADER_OTHER,
+    HEADER_KEEP_ALIVE, HEADER_OTHER,
+    HEADER_OTHER, HEADER_OTHER,
+    HEADER_CONTENT_ENCODING, HEADER_OTHER,
+    HEADER_OTHER, HEADER_OTHER,
+    HEADER_OTHER, HEADER_VARY,
+    HEADER_LAST_MODIFIED, HEADER_OTHER,
+    HEADER_OTHER, HEADER_OTHER,
+    HEADER_OTHER, HEADER_CONNECTION,
+    HEADER_OTHER, HEADER_OTHER,
+    HEADER_SERVER, HEADER_PROXY_AUTHORIZATION,
+    HEADER_TRAILER, HEADER_PROXY_AUTHENTICATE,
+    HEADER_PROXY_CONNECTION, HEADER_EXPIRES,
+    HEADER_OTHER, HEADER_OTHER,
+    HEADER_UPGRADE, HEADER_OTHER,
+    HEADER_OTHER, HEADER_HOST,
+    HEADER_OTHER, HEADER_CONTENT_LENGTH,
+    HEADER_OTHER, HEADER_OTHER,
+    HEADER_OTHER, HEADER_PUBLIC,
+    HEADER_OTHER, HEADER_CONTENT_TYPE,
+    HEADER_OTHER, HEADER_ACCEPT_ENCODING,
+    HEADER_CACHE_CONTROL, HEADER_OTHER,
+    HEADER_RANGE, HEADER_DATE,
+    HEADER_OTHER, HEADER_X_POWERED_BY,
+    HEADER_OTHER, HEADER_OTHER,
+    HEADER_OTHER, HEADER_OTHER,
+  };
+
+enum http_header_id
+http_header_classify (const char *key, int len)
+{
+  if (len == 0)
+    return HEADER_OTHER;
+
+  enum http_header_id id = slots[hash (key, len)];
+  if (id != HEADER_OTHER
+      && headers[id].len == len
+      && strncasecmp (headers[id].name, key, len) == 0)
+    return id;
+  return HEADER_OTHER;
+}
+
+int
+http_header_flags (enum http_header_id id)
+{
+  return headers[id].flags;
+}
+
+const char *
+http_header_name (enum http_header_id id)
+{
+  return headers[id].name;
+}
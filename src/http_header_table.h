@@ -0,0 +1,79 @@
+/* http_header_table.h - Classifying well-known HTTP headers.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#ifndef HTTP_HEADER_TABLE_H
+#define HTTP_HEADER_TABLE_H
+
+/* The headers that we know about.  */
+enum http_header_id
+  {
+    /* Any other header.  */
+    HEADER_OTHER = 0,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_AGE,
+    HEADER_AUTHORIZATION,
+    HEADER_CACHE_CONTROL,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_ENCODING,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_DATE,
+    HEADER_EXPIRES,
+    HEADER_HOST,
+    HEADER_KEEP_ALIVE,
+    HEADER_LAST_MODIFIED,
+    HEADER_PRAGMA,
+    HEADER_PROXY_AUTHENTICATE,
+    HEADER_PROXY_AUTHORIZATION,
+    HEADER_PROXY_CONNECTION,
+    HEADER_PUBLIC,
+    HEADER_RANGE,
+    HEADER_SERVER,
+    HEADER_SET_COOKIE,
+    HEADER_TE,
+    HEADER_TRAILER,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_UPGRADE,
+    HEADER_VARY,
+    HEADER_X_CNECTION,
+    HEADER_X_POWERED_BY,
+
+    HEADER_COUNT
+  };
+
+/* The header is hop-by-hop: it describes the connection over which it
+   was received and must not be forwarded.  */
+#define HEADER_HOP_BY_HOP 0x1
+/* The header is not forwarded to the origin server (we fetch the
+   entity ourselves).  */
+#define HEADER_REQUEST_STRIP 0x2
+/* The header is not forwarded to the client (we either replace it or
+   consider it junk).  */
+#define HEADER_RESPONSE_STRIP 0x4
+
+/* Return the id of the header whose name is the LEN bytes at KEY.
+   The comparison is case insensitive.  */
+extern enum http_header_id http_header_classify (const char *key, int len);
+
+/* The HEADER_* flags of the header ID.  */
+extern int http_header_flags (enum http_header_id id);
+
+/* The canonical name of the header ID.  */
+extern const char *http_header_name (enum http_header_id id);
+
+#endif
@@ -16,31 +16,32 @@
    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
    02110-1301, USA.  */
 
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <event.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <strings.h>
 
 #include "http_headers.h"
 #include "log.h"
 
-void
-http_headers_add (struct http_headers *headers,
-		  const char *key, const char *value)
+static void
+http_headers_link (struct http_headers *h, struct http_header *header)
 {
-  struct http_header *header
-    = obstack_alloc (&headers->data, sizeof (struct http_header));
-
-  header->key_len = strlen (key);
-  header->key = obstack_copy0 (&headers->data, key, header->key_len);
-  header->value = obstack_copy0 (&headers->data, value, strlen (value));
+  header->id = http_header_classify (header->key, header->key_len);
+  if (header->id != HEADER_OTHER && ! h->known[header->id])
+    h->known[header->id] = header;
 
   header->next = NULL;
-
-  *headers->tailp = header;
-  headers->tailp = &header->next;
+  *h->tailp = header;
+  h->tailp = &header->next;
 }
 
 struct http_headers *
-http_headers_new (const char *headers)
+http_headers_new (const char *block, int len,
+		  const struct http_header_span *spans, int count)
 {
   struct http_headers *h = calloc (sizeof (*h), 1);
 
@@ -48,56 +49,46 @@ http_headers_new (const char *headers)
 
   h->tailp = &h->head;
 
-  if (headers)
+  if (count == 0)
+    return h;
+
+  char *copy = obstack_copy (&h->data, block, len);
+
+  int i;
+  for (i = 0; i < count; i ++)
     {
-      char *colon;
-      while (headers && (colon = strchr (headers, ':')))
-	{
-	  const char *key = headers;
-
-	  struct http_header *header
-	    = obstack_alloc (&h->data, sizeof (struct http_header));
-
-	  int len = (intptr_t) colon - (intptr_t) key;
-	  header->key = obstack_copy0 (&h->data, key, len);
-	  header->key_len = len;
-
-	  headers = colon + 1;
-	  if (*headers == ' ')
-	    headers ++;
-
-	  const char *value = headers;
-
-	  const char *end = strchr (headers, '\n');
-	  len = 0;
-	  if (end)
-	    {
-	      if (end[-1] == '\r')
-		len = -1;
-	      len += (intptr_t) end - (intptr_t) value;
-
-	      headers = end + 1;
-	    }
-	  else
-	    {
-	      headers = NULL;
-	      len = strlen (value);
-	    }
-
-	  header->value = obstack_copy0 (&h->data, value, len);
-
-	  log ("Adding %s: %s", header->key, header->value);
-
-	  /* Link it in.  */
-	  header->next = NULL;
-	  *h->tailp = header;
-	  h->tailp = &header->next;
-	}
+      struct http_header *header
+	= obstack_alloc (&h->data, sizeof (struct http_header));
+
+      header->key = copy + spans[i].key;
+      header->key_len = spans[i].key_len;
+      header->key[header->key_len] = 0;
+
+      header->value = copy + spans[i].value;
+      header->value_len = spans[i].value_len;
+      header->value[header->value_len] = 0;
+
+      http_headers_link (h, header);
     }
 
   return h;
 }
 
+void
+http_headers_add (struct http_headers *headers,
+		  const char *key, const char *value)
+{
+  struct http_header *header
+    = obstack_alloc (&headers->data, sizeof (struct http_header));
+
+  header->key_len = strlen (key);
+  header->key = obstack_copy0 (&headers->data, key, header->key_len);
+  header->value_len = strlen (value);
+  header->value = obstack_copy0 (&headers->data, value, header->value_len);
+
+  http_headers_link (headers, header);
+}
+
 void
 http_headers_free (struct http_headers *h)
 {
@@ -110,6 +101,10 @@ http_headers_find (struct http_headers *h, const char *key)
 {
   int len = strlen (key);
 
+  enum http_header_id id = http_header_classify (key, len);
+  if (id != HEADER_OTHER)
+    return http_headers_get (h, id);
+
   struct http_header *header;
   for (header = h->head; header; header = header->next)
     if (len == header->key_len
@@ -118,3 +113,11 @@ http_headers_find (struct http_headers *h, const char *key)
   return NULL;
 }
 
+void
+http_header_write (struct evbuffer *buffer, const struct http_header *header)
+{
+  evbuffer_add (buffer, header->key, header->key_len);
+  evbuffer_add (buffer, ": ", 2);
+  evbuffer_add (buffer, header->value, header->value_len);
+  evbuffer_add (buffer, "\r\n", 2);
+}
@@ -23,9 +23,15 @@
 #define obstack_chunk_free free
 #include <obstack.h>
 
+#include "http_header_table.h"
+
+struct evbuffer;
+
 struct http_header
 {
-  short key_len;
+  enum http_header_id id;
+  int key_len;
+  int value_len;
   char *key;
   char *value;
 
@@ -37,17 +43,30 @@ struct http_headers
   struct http_header *head;
   /* The last element.  */
   struct http_header **tailp;
+  /* The first header with each known id.  */
+  struct http_header *known[HEADER_COUNT];
   struct obstack data;
 };
 
-/* HEADERS is either NULL or a string consisting of a series of
-
-     key: value\r\n
-     key: value
+/* The location of a header's key and value in a block of text.  The
+   offsets are relative to the start of the block.  */
+struct http_header_span
+{
+  int key;
+  int key_len;
+  int value;
+  int value_len;
+};
 
-   Note that the last value does not have a \r\n.
-*/
-extern struct http_headers *http_headers_new (const char *headers);
+/* Create a set of headers from the LEN bytes at BLOCK, which contain
+   the COUNT headers described by SPANS.  BLOCK is copied once and the
+   keys and values refer to the copy: the character following each key
+   and value in BLOCK (the colon or the end of line) is replaced with a
+   NUL.  */
+extern struct http_headers *http_headers_new (const char *block, int len,
+					      const struct http_header_span
+					      *spans,
+					      int count);
 
 extern void http_headers_free (struct http_headers *headers);
 
@@ -59,4 +78,17 @@ extern void http_headers_add (struct http_headers *headers,
    is no such header.  */
 const char *http_headers_find (struct http_headers *h, const char *key);
 
+/* Return the value of the (first) header with the id ID.  Returns NULL
+   if there is no such header.  */
+static inline const char *
+http_headers_get (struct http_headers *h, enum http_header_id id)
+{
+  return h->known[id] ? h->known[id]->value : NULL;
+}
+
+/* Append HEADER to BUFFER as it appears in a message, i.e., as
+   "key: value\r\n".  */
+extern void http_header_write (struct evbuffer *buffer,
+			       const struct http_header *header);
+
 #endif
@@ -41,7 +41,9 @@ http_message_init (struct http_message *message,
 void
 http_message_destroy (struct http_message *message)
 {
-  user_conn_http_message_list_unlink (&message->user_conn->messages, message);
+  if (list_node_attached (&message->node))
+    user_conn_http_message_list_unlink (&message->user_conn->messages,
+					message);
 }
 
 void
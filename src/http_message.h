@@ -56,7 +56,7 @@ void http_message_init (struct http_message *message,
 			struct http_message *insert_after);
 
 /* Dual to http_message_init.  In particular, unlinks MESSAGE from its
-   USER_CONN's message list.  */
+   USER_CONN's message list (if it is still on it).  */
 extern void http_message_destroy (struct http_message *message);
 
 
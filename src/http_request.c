@@ -24,9 +24,12 @@
 #include <assert.h>
 #include <ctype.h>
 
+#include "http-internal.h"
 #include "http_request.h"
 #include "http_conn.h"
 #include "user_conn.h"
+#include "gzip.h"
+#include "collapse.h"
 #include "log.h"
 
 static void
@@ -51,6 +54,23 @@ http_request_complete (struct evhttp_request *evrequest, void *arg)
 
   assert (request->evhttp_request == evrequest);
 
+  if (evrequest->response_code == 0)
+    /* We never got a response: the connection could not be
+       established, e.g., because the host name could not be
+       resolved.  evhttp is still walking the connection's request
+       queue so don't free the connection.  */
+    {
+      log ("%s: Failed to connect to %s.",
+	   request->url, request->http_conn->host);
+
+      http_response_new_error (request->http_conn->user_conn,
+			       request,
+			       502, "Failed to connect to origin server.",
+			       false,
+			       request->url);
+      return;
+    }
+
   {
     unsigned char *buffer = EVBUFFER_DATA (evrequest->input_buffer);
     char preview[41];
@@ -76,10 +96,63 @@ http_request_complete (struct evhttp_request *evrequest, void *arg)
   http_request_processed_cb (request);
 }
 
+static void
+http_request_chunk (struct evhttp_request *evrequest, void *arg)
+{
+  struct http_request *request = arg;
+
+  assert (request->evhttp_request == evrequest);
+
+  http_request_data_cb (request);
+}
+
+/* Called by evhttp when the connection can take more of REQUEST's
+   body.  */
+static int
+http_request_body (struct evhttp_request *evrequest,
+		   struct evbuffer *buffer, void *arg)
+{
+  struct http_request *request = arg;
+
+  assert (request->evhttp_request == evrequest);
+
+  return http_request_body_cb (request, buffer);
+}
+
+void
+http_request_body_available (struct http_request *request)
+{
+  evhttp_request_body_available (request->evhttp_request);
+}
+
+static const char *
+http_method_name (enum http_method method)
+{
+  switch (method)
+    {
+    case HTTP_OPTIONS:
+      return "OPTIONS";
+    case HTTP_GET:
+      return "GET";
+    case HTTP_HEAD:
+      return "HEAD";
+    case HTTP_POST:
+      return "POST";
+    case HTTP_PUT:
+      return "PUT";
+    case HTTP_DELETE:
+      return "DELETE";
+    case HTTP_TRACE:
+      return "TRACE";
+    }
+
+  abort ();
+}
+
 struct http_request *
 http_request_new (struct user_conn *user_conn, struct http_conn *http_conn,
 		  const char *url, enum http_method method,
-		  struct http_headers *request_headers, struct evbuffer *body,
+		  struct evbuffer *request_headers,
 		  enum http_version client_version,
 		  struct http_headers *client_headers)
 {
@@ -90,6 +163,7 @@ http_request_new (struct user_conn *user_conn, struct http_conn *http_conn,
   memcpy (request->url, url, url_len + 1);
 
   request->http_conn = http_conn;
+  request->method = method;
 
   log ("Request for %s (request: %p; http conn: %p)",
        url, request, http_conn);
@@ -102,30 +176,39 @@ http_request_new (struct user_conn *user_conn, struct http_conn *http_conn,
       goto evhttp_request_new_fail;
     }
 
+  evhttp_request_set_chunked_cb (request->evhttp_request, http_request_chunk);
+
   request->client_headers = client_headers;
 
-  /* Add the appropriate headers.  */
-  struct http_header *h;
-  for (h = request_headers->head; h; h = h->next)
+  /* Add the request line and the headers.  They are sent verbatim
+     from the request's output buffer.  evhttp only knows about GET,
+     HEAD and POST.  It only needs to know whether a request may be
+     pipelined and whether its response has a body.  */
+  struct evhttp_request *evrequest = request->evhttp_request;
+  evbuffer_add_printf (evrequest->output_buffer, "%s %s HTTP/1.1\r\n",
+		       http_method_name (method), url);
+  evbuffer_add_buffer (evrequest->output_buffer, request_headers);
+  evbuffer_free (request_headers);
+  evrequest->flags |= EVHTTP_REQ_RAW_HEADERS;
+
+  enum evhttp_cmd_type type = EVHTTP_REQ_POST;
+  if (method == HTTP_GET)
+    type = EVHTTP_REQ_GET;
+  else if (method == HTTP_HEAD)
+    type = EVHTTP_REQ_HEAD;
+
+  if (method == HTTP_POST || method == HTTP_PUT)
+    /* The body is streamed from the user connection.  */
     {
-      evhttp_add_header (request->evhttp_request->output_headers,
-			 h->key, h->value);
-      log ("Sending: %s: %s", h->key, h->value);
+      evrequest->flags |= EVHTTP_REQ_BODY_STREAM;
+      evhttp_connection_set_bodycb (http_conn->evhttp_conn,
+				    http_request_body);
     }
 
-  http_headers_free (request_headers);
-
   http_conn_http_request_list_enqueue (&http_conn->requests,
 				       request);
 
-  evhttp_make_request (http_conn->evhttp_conn, request->evhttp_request,
-		       EVHTTP_REQ_GET, url);
-
-  if (body)
-    {
-      evbuffer_add_buffer (request->evhttp_request->output_buffer, body);
-      evbuffer_free (body);
-    }
+  evhttp_make_request (http_conn->evhttp_conn, evrequest, type, url);
 
   http_conn->request_count ++;
 
@@ -134,6 +217,7 @@ http_request_new (struct user_conn *user_conn, struct http_conn *http_conn,
   return request;
 
  evhttp_request_new_fail:
+  evbuffer_free (request_headers);
   free (request);
   return NULL;
 }
@@ -144,10 +228,24 @@ http_request_free (struct http_request *request)
   /* REQUEST->HTTP_CONN owns REQUEST->EVHTTP_REQUEST.  It will free
      it.  */
 
+  struct user_conn *user_conn = request->http_conn->user_conn;
+  if (user_conn->body_request == request)
+    /* The rest of the body has nowhere to go.  */
+    user_conn_drop_body (user_conn);
+
   http_message_destroy (&request->message);
 
   http_headers_free (request->client_headers);
 
+  if (request->gzip)
+    gzip_stream_free (request->gzip);
+
+  if (request->recompress)
+    http_request_drop_recompress (request);
+
+  if (request->collapse)
+    collapse_end (request->collapse, NULL);
+
   /* Unlink.  */
   http_conn_http_request_list_unlink (&request->http_conn->requests, request);
 
@@ -50,6 +50,8 @@ struct http_request
 
   struct evhttp_request *evhttp_request;
 
+  enum http_method method;
+
   /* The client's version.  */
   enum http_version client_version;
   /* The client's HTTP headers.  */
@@ -58,6 +60,20 @@ struct http_request
   /* The http connection.  */
   struct http_conn *http_conn;
 
+  /* If the response is being streamed to the client as it arrives,
+     the response.  */
+  struct http_response *response;
+  /* If the streamed response is being compressed, the compressor.  */
+  struct gzip_stream *gzip;
+  /* If the image in the response's body is decoded as it arrives, the
+     job that decodes it.  */
+  struct recompress_job *recompress;
+  /* Whether the rest of the response's body should be discarded.  */
+  bool discard;
+  /* If identical requests wait for this request's response, the
+     fetch they are waiting on.  */
+  struct collapse *collapse;
+
   struct list_node http_conn_node;
 
   char url[0];
@@ -65,18 +81,26 @@ struct http_request
 LIST_CLASS(http_conn_http_request, struct http_request, http_conn_node, true)
 
 /* Issue a request over the connection HTTP_CONN for the resource URL.
-   This function assumes ownership of HEADERS, BODY and
+   HEADERS holds the request's headers, already formatted as they are
+   to be sent.  This function assumes ownership of HEADERS and
    CLIENT_HEADERS!
 
    CLIENT_VERSION and CLIENT_HEADERS are uninterpreted.
 
-   When the request completes, calls http_request_processed_cb.  */
+   If METHOD is HTTP_POST or HTTP_PUT, the body is obtained by calling
+   http_request_body_cb whenever the connection can take more data.
+
+   As the response arrives, calls http_request_data_cb.  When the
+   request completes, calls http_request_processed_cb.  */
 extern struct http_request *http_request_new
   (struct user_conn *user_conn, struct http_conn *http_conn,
    const char *url, enum http_method method,
-   struct http_headers *headers, struct evbuffer *body,
+   struct evbuffer *headers,
    enum http_version client_version, struct http_headers *client_headers);
 
+/* More of REQUEST's body is available.  */
+extern void http_request_body_available (struct http_request *request);
+
 /* Frees REQUEST.  The request must not be outstanding.  (If so,
    you'll have to abort the http connection.)  */
 extern void http_request_free (struct http_request *request);
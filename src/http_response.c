@@ -24,6 +24,10 @@
 #include "http_response.h"
 #include "http_request.h"
 #include "user_conn.h"
+#include "thread_pool.h"
+#include "cache.h"
+#include "collapse.h"
+#include "spill.h"
 #include "log.h"
 
 static struct http_response *
@@ -98,7 +102,7 @@ http_response_new_error (struct user_conn *user_conn,
     }
 
   
-  evbuffer_add_printf (response->buffer, "Content-Length: %d\r\n",
+  evbuffer_add_printf (response->buffer, "Content-Length: %zu\r\n",
 		       strlen (status_string));
 
   evbuffer_add_printf (response->buffer, "\r\n");
@@ -118,9 +122,26 @@ http_response_free (struct http_response *response)
 {
   log ("Destroying response %s", response->origin);
 
+  if (response->job)
+    /* The job notices that the response is gone.  */
+    thread_pool_cancel (response->job);
+
+  if (response->cache_entry)
+    /* The response was not completed.  */
+    cache_entry_free (response->cache_entry);
+
+  if (response->collapse)
+    /* Let the waiters fetch the resource themselves.  */
+    collapse_end (response->collapse, NULL);
+
+  if (response->waiter)
+    collapse_cancel (response->waiter);
+
   http_message_destroy (&response->message);
   
   evbuffer_free (response->buffer);
+  if (response->spill)
+    spill_free (response->spill);
 
   free (response);
 }
@@ -27,6 +27,11 @@
 
 /* Forward.  */
 struct http_request;
+struct thread_job;
+struct cache_entry;
+struct collapse;
+struct collapse_waiter;
+struct spill;
 
 struct http_response
 {
@@ -34,9 +39,29 @@ struct http_response
 
   /* Whether the response is ready to be sent.  */
   bool ready_to_go;
+  /* Whether the response is being streamed, i.e., more data will be
+     appended to BUFFER.  */
+  bool partial;
+  /* Whether the body is sent using the chunked transfer coding.  */
+  bool chunked;
 
   /* The response.  */
   struct evbuffer *buffer;
+  /* If the response grew too large to keep in memory, the file that
+     holds the data that precedes BUFFER.  */
+  struct spill *spill;
+
+  /* If the body is being transformed by a worker thread, the job.  */
+  struct thread_job *job;
+
+  /* If the response is to be cached, the entry being filled in.  */
+  struct cache_entry *cache_entry;
+  /* If identical requests wait for this response, the fetch they are
+     waiting on.  */
+  struct collapse *collapse;
+  /* If this response waits for another request's response, the
+     handle.  */
+  struct collapse_waiter *waiter;
 
   char origin[0];
 };
@@ -20,53 +20,58 @@
 #include <sys/types.h>
 #include <event.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <math.h>
 #include <jpeglib.h>
-#include <alloca.h>
+#include <jerror.h>
 #include <setjmp.h>
 
+#include "jpeg.h"
 #include "log.h"
 
-static void
-init_source (j_decompress_ptr cinfo)
-{
-}
-
-static boolean
-fill_input_buffer (j_decompress_ptr cinfo)
-{
-  /* Hmm.  In practice, this should never be called.  The fact that
-     the decompressor is looking for more data suggests that this is a
-     bad image.  Insert a fake end of input marker.  */
-  static JOCTET eoi[2];
-  eoi[0] = (JOCTET) 0xFF;
-  eoi[1] = (JOCTET) JPEG_EOI;
-
-  cinfo->src->next_input_byte = &eoi[0];
-  cinfo->src->bytes_in_buffer = sizeof (eoi);
-
-  return TRUE;
-}
-
-static void
-skip_input_data (j_decompress_ptr cinfo, long num_bytes)
-{
-  if (num_bytes <= 0)
-    return;
-
-  if (num_bytes <= cinfo->src->bytes_in_buffer)
-    {
-      cinfo->src->next_input_byte += (size_t) num_bytes;
-      cinfo->src->bytes_in_buffer -= num_bytes;
-    }
-  else
-    cinfo->src->bytes_in_buffer = 0;
-}
-
-static void
-term_source (j_decompress_ptr cinfo)
+int jpeg_max_size;
+int jpeg_min_ssim;
+
+/* The quality below which we never go.  */
+#define JPEG_MIN_QUALITY 10
+/* Recompressing an image whose quality is not at least this much
+   higher than the target quality hardly makes it smaller.  */
+#define JPEG_QUALITY_MARGIN 10
+/* The number of luminance blocks that the SSIM search examines.  */
+#define JPEG_SSIM_BLOCKS 256
+
+/* libjpeg's standard luminance quantization table, which it scales
+   according to the quality.  */
+static const unsigned int std_luminance_quant_tbl[DCTSIZE2] =
+  {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+  };
+
+/* The basis functions of the inverse DCT.  IDCT_BASIS[X][U] is the
+   contribution of frequency U to sample X.  */
+static float idct_basis[DCTSIZE][DCTSIZE];
+
+void
+jpeg_init (int max_size, int min_ssim)
 {
+  jpeg_max_size = max_size;
+  jpeg_min_ssim = min_ssim;
+
+  int x, u;
+  for (x = 0; x < DCTSIZE; x ++)
+    for (u = 0; u < DCTSIZE; u ++)
+      idct_basis[x][u] = (u == 0 ? M_SQRT1_2 : 1) / 2
+	* cos ((2 * x + 1) * u * M_PI / (2 * DCTSIZE));
 }
 
 struct my_destination_msg
@@ -79,6 +84,10 @@ struct my_destination_msg
 
 #define CHUNK (4096 * 16)
 
+/* The most that is initially reserved for the output, whatever size
+   the source claims to have.  */
+#define SOURCE_SIZE_MAX (16 * 1024 * 1024)
+
 #define EVBUFFER_AVAILABLE(buf) ((buf)->totallen - (buf)->misalign)
 
 static void
@@ -94,7 +103,8 @@ init_destination (j_compress_ptr cinfo)
      like to avoid a memcpy, which would be required if we have to
      grow the buffer.  Any used bits shouldn't really hurt us.  */
   /* NB: Expand doesn't actually update the length.  */
-  evbuffer_expand (dest->buffer, dest->source_size);
+  if (evbuffer_expand (dest->buffer, dest->source_size) == -1)
+    ERREXIT1 (cinfo, JERR_OUT_OF_MEMORY, 0);
 
   dest->pub.next_output_byte = dest->pos = EVBUFFER_DATA (dest->buffer);
   dest->pub.free_in_buffer = EVBUFFER_AVAILABLE (dest->buffer);
@@ -116,7 +126,9 @@ empty_output_buffer (j_compress_ptr cinfo)
   /* evbuffer_expand does not adjust the length.  Do it now.  */
   EVBUFFER_LENGTH (dest->buffer) += written;
 
-  evbuffer_expand (dest->buffer, EVBUFFER_LENGTH (dest->buffer) + CHUNK);
+  if (evbuffer_expand (dest->buffer,
+		       EVBUFFER_LENGTH (dest->buffer) + CHUNK) == -1)
+    ERREXIT1 (cinfo, JERR_OUT_OF_MEMORY, 0);
 
   dest->pub.next_output_byte
     = dest->pos
@@ -160,151 +172,915 @@ error_exit (j_common_ptr cinfo)
 }
 
 
-struct evbuffer *
-jpeg_recompress (struct evbuffer *source, int quality)
+/* A JPEG being recompressed as it arrives.  */
+struct jpeg_stream
 {
-  struct jpeg_decompress_struct *decompressp = NULL;
-  struct jpeg_compress_struct *compressp = NULL;
+  /* The source manager.  Must come first: libjpeg's callbacks cast
+     the source manager to the stream.  */
+  struct jpeg_source_mgr src;
 
+  int quality;
+  int max_size;
+  /* The estimated quality of the source.  */
+  int source_quality;
+  /* The source's EXIF orientation, or 0 if it records none.  */
+  int orientation;
+
+  enum
+    {
+      /* Reading the header.  */
+      JS_HEADER,
+      /* Reading the coefficients (to requantize them).  */
+      JS_COEFFICIENTS,
+      /* Starting a full decode.  */
+      JS_START,
+      /* Decoding and encoding pixels.  */
+      JS_SCANLINES,
+      /* The new image is complete.  Consuming the rest of the old
+	 one.  */
+      JS_FINISH,
+      JS_DONE,
+      JS_FAILED,
+    } state;
+
+  /* The input that the decompressor has not yet consumed.  */
+  struct evbuffer *input;
+  /* The number of bytes at the start of INPUT that were consumed
+     during the last run.  */
+  size_t consumed;
+  /* The number of bytes that the decompressor wants to skip, but that
+     did not arrive yet.  */
+  long skip;
+  /* Whether all of the input has been fed.  */
+  bool eof;
+
+  bool created;
   struct jpeg_decompress_struct decompress;
+  struct jpeg_compress_struct compress;
   struct my_error_mgr error_mgr;
-  jpeg_std_error (&error_mgr.jpeg_error_mgr);
+  struct my_destination_msg dest;
 
-  jmp_buf jmp_buf;
-  error_mgr.jmp_bufp = &jmp_buf;
-  error_mgr.jpeg_error_mgr.error_exit = error_exit;
+  /* When decoding pixels, the scanlines that are being copied.  */
+  JSAMPARRAY rows;
+};
 
-  if (setjmp (jmp_buf))
+static void
+init_source (j_decompress_ptr cinfo)
+{
+}
+
+static boolean
+fill_input_buffer (j_decompress_ptr cinfo)
+{
+  struct jpeg_stream *stream = (struct jpeg_stream *) cinfo->src;
+
+  if (! stream->eof)
+    /* Suspend until more data arrives.  */
+    return FALSE;
+
+  /* Hmm.  The whole image has arrived and the decompressor is still
+     looking for more data.  This suggests that this is a bad image.
+     Insert a fake end of input marker.  */
+  static const JOCTET eoi[2] = { (JOCTET) 0xFF, (JOCTET) JPEG_EOI };
+
+  cinfo->src->next_input_byte = &eoi[0];
+  cinfo->src->bytes_in_buffer = sizeof (eoi);
+
+  return TRUE;
+}
+
+static void
+skip_input_data (j_decompress_ptr cinfo, long num_bytes)
+{
+  struct jpeg_stream *stream = (struct jpeg_stream *) cinfo->src;
+
+  if (num_bytes <= 0)
+    return;
+
+  if (num_bytes <= cinfo->src->bytes_in_buffer)
+    {
+      cinfo->src->next_input_byte += (size_t) num_bytes;
+      cinfo->src->bytes_in_buffer -= num_bytes;
+    }
+  else
+    /* Skip the rest once it arrives.  */
+    {
+      stream->skip = num_bytes - cinfo->src->bytes_in_buffer;
+      cinfo->src->next_input_byte += cinfo->src->bytes_in_buffer;
+      cinfo->src->bytes_in_buffer = 0;
+    }
+}
+
+static void
+term_source (j_decompress_ptr cinfo)
+{
+}
+
+/* Return the 16-bit value at P, which is big endian if BIG is true.  */
+static unsigned int
+jpeg_get16 (const unsigned char *p, bool big)
+{
+  return big ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
+
+static unsigned long
+jpeg_get32 (const unsigned char *p, bool big)
+{
+  return big
+    ? ((unsigned long) jpeg_get16 (p, big) << 16) | jpeg_get16 (p + 2, big)
+    : ((unsigned long) jpeg_get16 (p + 2, big) << 16) | jpeg_get16 (p, big);
+}
+
+/* Return the orientation recorded in the LEN bytes of EXIF data at
+   EXIF (the contents of an APP1 segment) or 0 if there is none.  */
+static int
+jpeg_exif_orientation (const unsigned char *exif, size_t len)
+{
+  if (len < 14 || memcmp (exif, "Exif\0\0", 6) != 0)
+    return 0;
+
+  /* A TIFF header follows.  */
+  const unsigned char *tiff = exif + 6;
+  len -= 6;
+
+  bool big;
+  if (tiff[0] == 'M' && tiff[1] == 'M')
+    big = true;
+  else if (tiff[0] == 'I' && tiff[1] == 'I')
+    big = false;
+  else
+    return 0;
+
+  unsigned long ifd = jpeg_get32 (tiff + 4, big);
+  if (ifd + 2 > len)
+    return 0;
+
+  unsigned int count = jpeg_get16 (tiff + ifd, big);
+  unsigned int i;
+  for (i = 0; i < count && ifd + 2 + 12 * (i + 1) <= len; i ++)
+    {
+      const unsigned char *entry = tiff + ifd + 2 + 12 * i;
+      /* The orientation tag.  Its value is a short.  */
+      if (jpeg_get16 (entry, big) == 0x0112)
+	return jpeg_get16 (entry + 8, big);
+    }
+
+  return 0;
+}
+
+/* An APP1 segment with EXIF data containing just an orientation
+   (which is filled in at offset 29).  */
+static const unsigned char exif_orientation[] =
+  {
+    0xFF, JPEG_APP0 + 1, 0, 34,
+    'E', 'x', 'i', 'f', 0, 0,
+    /* A big endian TIFF header.  The first IFD is at offset 8.  */
+    'M', 'M', 0, 42, 0, 0, 0, 8,
+    /* One entry: the orientation, 1 short.  */
+    0, 1,
+    0x01, 0x12, 0, 3, 0, 0, 0, 1, 0, 0, 0, 0,
+    /* No further IFDs.  */
+    0, 0, 0, 0
+  };
+
+/* If ORIENTATION is one that viewers act on, write an APP1 segment
+   recording it.  COMPRESS must have started and not yet written any
+   image data.  */
+static void
+jpeg_write_orientation (struct jpeg_compress_struct *compress,
+			int orientation)
+{
+  if (orientation <= 1 || orientation > 8)
+    return;
+
+  /* jpeg_write_marker adds the marker and the length.  */
+  JOCTET exif[sizeof (exif_orientation) - 4];
+  memcpy (exif, exif_orientation + 4, sizeof (exif));
+  exif[29 - 4] = orientation;
+  jpeg_write_marker (compress, JPEG_APP0 + 1, exif, sizeof (exif));
+}
+
+/* Return the coefficient that best approximates V (a dequantized
+   coefficient) with step TO.  */
+static inline int
+requantize (int v, int to)
+{
+  /* Round to the nearest step.  */
+  if (v >= 0)
+    return (v + to / 2) / to;
+  else
+    return - ((- v + to / 2) / to);
+}
+
+/* Estimate the quality setting with which the image that DECOMPRESS
+   is reading was encoded by comparing its luminance quantization
+   table with libjpeg's.  The header must have been read.  */
+static int
+jpeg_estimate_quality (struct jpeg_decompress_struct *decompress)
+{
+  JQUANT_TBL *table
+    = decompress->quant_tbl_ptrs[decompress->comp_info[0].quant_tbl_no];
+  if (! table)
+    return 100;
+
+  long sum = 0;
+  long std = 0;
+  int k;
+  for (k = 0; k < DCTSIZE2; k ++)
+    {
+      sum += table->quantval[k];
+      std += std_luminance_quant_tbl[k];
+    }
+
+  /* Invert jpeg_quality_scaling.  */
+  long scale = (sum * 100 + std / 2) / std;
+  int quality;
+  if (scale <= 100)
+    quality = (200 - scale) / 2;
+  else
+    quality = 5000 / scale;
+
+  if (quality < 1)
+    quality = 1;
+  if (quality > 100)
+    quality = 100;
+  return quality;
+}
+
+/* Decode the DCT coefficients in BLOCK, dequantized with the steps
+   in QUANT, and store the samples in PIXELS.  */
+static void
+jpeg_idct (const JCOEF *block, const UINT16 *quant, float *pixels)
+{
+  float tmp[DCTSIZE][DCTSIZE];
+  int v, u, x, y;
+
+  for (v = 0; v < DCTSIZE; v ++)
+    for (x = 0; x < DCTSIZE; x ++)
+      {
+	float sum = 0;
+	for (u = 0; u < DCTSIZE; u ++)
+	  sum += idct_basis[x][u]
+	    * block[v * DCTSIZE + u] * quant[v * DCTSIZE + u];
+	tmp[v][x] = sum;
+      }
+
+  for (y = 0; y < DCTSIZE; y ++)
+    for (x = 0; x < DCTSIZE; x ++)
+      {
+	float sum = CENTERJSAMPLE;
+	for (v = 0; v < DCTSIZE; v ++)
+	  sum += idct_basis[y][v] * tmp[v][x];
+	pixels[y * DCTSIZE + x] = sum;
+      }
+}
+
+/* The structural similarity of the 8x8 blocks of samples A and B.  */
+static float
+jpeg_block_ssim (const float *a, const float *b)
+{
+  const float c1 = (0.01 * MAXJSAMPLE) * (0.01 * MAXJSAMPLE);
+  const float c2 = (0.03 * MAXJSAMPLE) * (0.03 * MAXJSAMPLE);
+
+  float mean_a = 0, mean_b = 0;
+  int k;
+  for (k = 0; k < DCTSIZE2; k ++)
+    {
+      mean_a += a[k];
+      mean_b += b[k];
+    }
+  mean_a /= DCTSIZE2;
+  mean_b /= DCTSIZE2;
+
+  float var_a = 0, var_b = 0, covar = 0;
+  for (k = 0; k < DCTSIZE2; k ++)
+    {
+      var_a += (a[k] - mean_a) * (a[k] - mean_a);
+      var_b += (b[k] - mean_b) * (b[k] - mean_b);
+      covar += (a[k] - mean_a) * (b[k] - mean_b);
+    }
+  var_a /= DCTSIZE2 - 1;
+  var_b /= DCTSIZE2 - 1;
+  covar /= DCTSIZE2 - 1;
+
+  return ((2 * mean_a * mean_b + c1) * (2 * covar + c2))
+    / ((mean_a * mean_a + mean_b * mean_b + c1) * (var_a + var_b + c2));
+}
+
+/* Find the lowest quality between JPEG_MIN_QUALITY and SOURCE_QUALITY
+   at which requantizing the image whose coefficients DECOMPRESS read
+   keeps its SSIM at or above JPEG_MIN_SSIM percent.  Rather than
+   encoding and decoding the whole image at each candidate quality,
+   requantizes and decodes a sample of the luminance blocks, which is
+   all that the encoder would change.  */
+static int
+jpeg_ssim_search (struct jpeg_decompress_struct *decompress,
+		  jvirt_barray_ptr *coefficients, int source_quality)
+{
+  jpeg_component_info *comp = &decompress->comp_info[0];
+  const UINT16 *from = comp->quant_table->quantval;
+
+  /* Sample every STEP-th block in both directions.  */
+  JDIMENSION step = 1;
+  while (((comp->width_in_blocks + step - 1) / step)
+	 * ((comp->height_in_blocks + step - 1) / step) > JPEG_SSIM_BLOCKS)
+    step ++;
+
+  JBLOCK *blocks = (*decompress->mem->alloc_large)
+    ((j_common_ptr) decompress, JPOOL_IMAGE,
+     JPEG_SSIM_BLOCKS * sizeof (JBLOCK));
+  float *reference = (*decompress->mem->alloc_large)
+    ((j_common_ptr) decompress, JPOOL_IMAGE,
+     JPEG_SSIM_BLOCKS * DCTSIZE2 * sizeof (float));
+
+  int count = 0;
+  JDIMENSION row, col;
+  for (row = 0; row < comp->height_in_blocks; row += step)
     {
-      if (decompressp)
-	jpeg_destroy_decompress (decompressp);
+      JBLOCKARRAY rows = (*decompress->mem->access_virt_barray)
+	((j_common_ptr) decompress, coefficients[0], row, 1, FALSE);
 
-      if (compressp)
+      for (col = 0; col < comp->width_in_blocks; col += step)
 	{
-	  if (compressp->dest)
-	    {
-	      struct my_destination_msg *dest
-		= (struct my_destination_msg *) compressp->dest;
-	      evbuffer_free (dest->buffer);
-	    }
+	  memcpy (blocks[count], rows[0][col], sizeof (JBLOCK));
+	  jpeg_idct (blocks[count], from, &reference[count * DCTSIZE2]);
+	  count ++;
+	}
+    }
+
+  int low = JPEG_MIN_QUALITY;
+  int high = source_quality;
+  while (low < high)
+    {
+      int quality = (low + high) / 2;
 
-	  jpeg_destroy_compress (compressp);
+      /* The steps that jpeg_requantize would use.  */
+      UINT16 to[DCTSIZE2];
+      int scale = jpeg_quality_scaling (quality);
+      int k;
+      for (k = 0; k < DCTSIZE2; k ++)
+	{
+	  long q = (std_luminance_quant_tbl[k] * scale + 50L) / 100;
+	  if (q < 1)
+	    q = 1;
+	  if (q > 255)
+	    q = 255;
+	  to[k] = q < from[k] ? from[k] : q;
 	}
 
-      return NULL;
+      float ssim = 0;
+      int i;
+      for (i = 0; i < count; i ++)
+	{
+	  JBLOCK block;
+	  for (k = 0; k < DCTSIZE2; k ++)
+	    block[k] = requantize (blocks[i][k] * from[k], to[k]);
+
+	  float pixels[DCTSIZE2];
+	  jpeg_idct (block, to, pixels);
+	  ssim += jpeg_block_ssim (&reference[i * DCTSIZE2], pixels);
+	}
+      ssim /= count;
+
+      if (ssim * 100 >= jpeg_min_ssim)
+	high = quality;
+      else
+	low = quality + 1;
+    }
+
+  log ("SSIM search: quality %d (source ~%d)", high, source_quality);
+  return high;
+}
+
+/* Recompress the image by requantizing its COEFFICIENTS: DECOMPRESS
+   has read them, COMPRESS is set up with a destination.  The output
+   records ORIENTATION, if any.  Each
+   coefficient is divided by the step of the coarser of the source's
+   table and the table for QUALITY.  This avoids the inverse and
+   forward DCTs of a full decode and re-encode, and any generational
+   loss that they would add.  */
+static void
+jpeg_requantize (struct jpeg_decompress_struct *decompress,
+		 struct jpeg_compress_struct *compress,
+		 jvirt_barray_ptr *coefficients, int quality, int orientation)
+{
+  jpeg_copy_critical_parameters (decompress, compress);
+
+  /* Replace the source's tables with the standard tables for QUALITY,
+     but never make a step finer than the source's: that would only
+     enlarge the image.  */
+  jpeg_set_quality (compress, quality, TRUE);
+
+  int ci;
+  for (ci = 0; ci < compress->num_components; ci ++)
+    {
+      JQUANT_TBL *from = decompress->comp_info[ci].quant_table;
+      JQUANT_TBL *to
+	= compress->quant_tbl_ptrs[compress->comp_info[ci].quant_tbl_no];
+
+      int k;
+      for (k = 0; k < DCTSIZE2; k ++)
+	if (to->quantval[k] < from->quantval[k])
+	  to->quantval[k] = from->quantval[k];
     }
-  
 
-  /* Set up the decompresser.  */
-  decompress.err = &error_mgr.jpeg_error_mgr;
-  jpeg_create_decompress (&decompress);
-  decompressp = &decompress;
+  for (ci = 0; ci < decompress->num_components; ci ++)
+    {
+      jpeg_component_info *comp = &decompress->comp_info[ci];
+      UINT16 *from = comp->quant_table->quantval;
+      UINT16 *to
+	= compress->quant_tbl_ptrs[compress->comp_info[ci].quant_tbl_no]
+	->quantval;
+
+      JDIMENSION row;
+      for (row = 0; row < comp->height_in_blocks; row ++)
+	{
+	  JBLOCKARRAY rows = (*decompress->mem->access_virt_barray)
+	    ((j_common_ptr) decompress, coefficients[ci], row, 1, TRUE);
 
-  /* Options for fast (quick 'n dirty) decompression.  */
-  decompress.two_pass_quantize = FALSE;
-  decompress.dither_mode = JDITHER_ORDERED;
-  decompress.desired_number_of_colors = 216;
-  decompress.dct_method = JDCT_FASTEST;
-  decompress.do_fancy_upsampling = FALSE;
+	  JDIMENSION col;
+	  for (col = 0; col < comp->width_in_blocks; col ++)
+	    {
+	      JCOEF *block = rows[0][col];
 
-  struct jpeg_source_mgr src;
-  decompress.src = &src;
-
-  src.next_input_byte = EVBUFFER_DATA (source);
-  src.bytes_in_buffer = EVBUFFER_LENGTH (source);
-
-  src.init_source = init_source;
-  src.fill_input_buffer = fill_input_buffer;
-  src.skip_input_data = skip_input_data;
-  src.resync_to_restart = jpeg_resync_to_restart; /* use default method */
-  src.term_source = term_source;
-
-  /* This determines the image width, height, components and color
-     space.  */
-  jpeg_read_header (&decompress, true);
-  /* This computes the output width, height, compnents, etc. based on
-     the parameters.  We require this information to set up the
-     compressor.  */
-  jpeg_start_decompress (&decompress);
-
-  log ("Image: %d x %d @ %d, %d bytes",
-       decompress.image_width, decompress.image_height,
-       decompress.num_components,
-       src.bytes_in_buffer);
-
-  if (decompress.image_width > 6000 || decompress.image_height > 6000)
+	      int k;
+	      for (k = 0; k < DCTSIZE2; k ++)
+		if (block[k] && from[k] != to[k])
+		  block[k] = requantize (block[k] * from[k], to[k]);
+	    }
+	}
+    }
+
+  /* Use progressive encoding.  */
+  jpeg_simple_progression (compress);
+
+  jpeg_write_coefficients (compress, coefficients);
+  jpeg_write_orientation (compress, orientation);
+
+  /* The coefficients belong to the decompressor.  Finish before it
+     releases them.  */
+  jpeg_finish_compress (compress);
+}
+
+/* Prepare to recompress the image by encoding its pixels again at
+   QUALITY.  DECOMPRESS has started decompressing (possibly at a
+   reduced scale), COMPRESS is set up with a destination.  The output
+   records ORIENTATION, if any.  Unlike
+   requantization, this can subsample the chroma and change the
+   image's size.  */
+static void
+jpeg_reencode_start (struct jpeg_decompress_struct *decompress,
+		     struct jpeg_compress_struct *compress, int quality,
+		     int orientation)
+{
+  /* IN_COLOR_SPACE must be set prior to calling jpeg_set_defaults.  */
+  compress->in_color_space = decompress->out_color_space;
+  jpeg_set_defaults (compress);
+
+  compress->image_width = decompress->output_width;
+  compress->image_height = decompress->output_height;
+  compress->input_components = decompress->output_components;
+
+  /* Use fast integer encoding--the least accurate.  */
+  compress->dct_method = JDCT_IFAST;
+  /* Set the quality appropriately.  */
+  jpeg_set_quality (compress, quality, TRUE);
+  /* Use progressive encoding.  */
+  jpeg_simple_progression (compress);
+
+  jpeg_start_compress (compress, TRUE);
+  jpeg_write_orientation (compress, orientation);
+}
+
+/* The header was read.  Decide how to recompress the image.  Returns
+   false if the image should not be recompressed.  */
+static bool
+jpeg_stream_plan (struct jpeg_stream *stream)
+{
+  struct jpeg_decompress_struct *decompress = &stream->decompress;
+
+  stream->source_quality = jpeg_estimate_quality (decompress);
+
+  /* The recompressed image carries no other markers.  Keep the
+     orientation, or viewers would show the image sideways.  */
+  jpeg_saved_marker_ptr marker;
+  for (marker = decompress->marker_list; marker; marker = marker->next)
+    if (marker->marker == JPEG_APP0 + 1)
+      {
+	stream->orientation = jpeg_exif_orientation (marker->data,
+						     marker->data_length);
+	if (stream->orientation)
+	  break;
+      }
+
+  log ("Image: %d x %d @ %d, quality ~%d",
+       decompress->image_width, decompress->image_height,
+       decompress->num_components, stream->source_quality);
+
+  if (decompress->image_width > 6000 || decompress->image_height > 6000)
     /* The image is unusually (and perhaps suspiciously?) large.  Even
        if it is legitimate, it will take a long time to recompress.
        Don't even try.  */
     {
       log ("Image suspiciously large, not recompressing.");
-      jpeg_destroy_decompress (&decompress);
+      return false;
+    }
+
+  /* libjpeg can decode directly at a reduced size, which is much
+     cheaper than a full decode.  */
+  int scale = 1;
+  if (stream->max_size > 0)
+    {
+      JDIMENSION size = decompress->image_width > decompress->image_height
+	? decompress->image_width : decompress->image_height;
+      while (scale < 8 && size / scale > stream->max_size)
+	scale *= 2;
+    }
+  if (scale > 1)
+    {
+      log ("Scaling image by 1/%d", scale);
+      decompress->scale_num = 1;
+      decompress->scale_denom = scale;
+    }
+
+  /* Requantizing keeps the source's chroma sampling.  If the chroma
+     is stored at full resolution, halving it saves more than a
+     coarser quantization does; that requires a full re-encode.  */
+  bool full_chroma = decompress->jpeg_color_space == JCS_YCbCr
+    && decompress->num_components == 3
+    && decompress->comp_info[0].h_samp_factor == 1
+    && decompress->comp_info[0].v_samp_factor == 1;
+
+  /* The quality that the image is recompressed to at most.  */
+  int target = jpeg_min_ssim ? JPEG_MIN_QUALITY : stream->quality;
+  if (scale == 1 && ! full_chroma
+      && stream->source_quality < target + JPEG_QUALITY_MARGIN)
+    /* Requantizing only coarsens the steps that are finer than the
+       target's.  The source's are about as coarse.  Save the work of
+       producing an image that we would throw away.  */
+    {
+      log ("Image quality already low, not recompressing.");
+      return false;
+    }
+
+  if (scale > 1 || full_chroma)
+    {
+      /* Options for fast (quick 'n dirty) decompression.  */
+      decompress->two_pass_quantize = FALSE;
+      decompress->dither_mode = JDITHER_ORDERED;
+      decompress->desired_number_of_colors = 216;
+      decompress->dct_method = JDCT_FASTEST;
+      decompress->do_fancy_upsampling = FALSE;
+
+      /* Encoding the pixels at a higher quality than the source's
+	 only preserves the source's artifacts more faithfully.  */
+      if (stream->quality > stream->source_quality)
+	stream->quality = stream->source_quality;
+
+      stream->state = JS_START;
+    }
+  else
+    stream->state = JS_COEFFICIENTS;
+
+  return true;
+}
+
+struct jpeg_stream *
+jpeg_stream_new (int quality, int max_size, size_t size_hint)
+{
+  struct jpeg_stream *stream = calloc (sizeof (*stream), 1);
+  if (! stream)
+    return NULL;
+
+  stream->input = evbuffer_new ();
+  stream->dest.buffer = evbuffer_new ();
+  if (! stream->input || ! stream->dest.buffer)
+    {
+      jpeg_stream_free (stream);
       return NULL;
     }
 
+  stream->quality = quality;
+  stream->max_size = max_size;
+  stream->state = JS_HEADER;
+
+  jpeg_std_error (&stream->error_mgr.jpeg_error_mgr);
+  stream->error_mgr.jpeg_error_mgr.error_exit = error_exit;
+
+  stream->src.init_source = init_source;
+  stream->src.fill_input_buffer = fill_input_buffer;
+  stream->src.skip_input_data = skip_input_data;
+  /* Use the default method.  */
+  stream->src.resync_to_restart = jpeg_resync_to_restart;
+  stream->src.term_source = term_source;
+
+  stream->dest.pub.init_destination = init_destination;
+  stream->dest.pub.empty_output_buffer = empty_output_buffer;
+  stream->dest.pub.term_destination = term_destination;
+  stream->dest.pub.free_in_buffer = 0;
+  /* The output is usually smaller than the source.  SIZE_HINT may
+     come from the origin server: don't trust it.  */
+  if (size_hint > SOURCE_SIZE_MAX)
+    size_hint = SOURCE_SIZE_MAX;
+  stream->dest.source_size = size_hint > CHUNK ? size_hint : CHUNK;
+
+  return stream;
+}
 
-  /* Set up the compressor.  */
-  struct jpeg_compress_struct compress;
-  /* Set COMPRESS.DEST to NULL.  Then, in case we error out in
-     jpeg_create_compress, we know in the error handler that
-     DEST.BUFFER has not yet been initialized.  */
-  compress.dest = NULL;
-  compress.err = &error_mgr.jpeg_error_mgr;
-  jpeg_create_compress (&compress);
-  compressp = &compress;
+int
+jpeg_stream_feed (struct jpeg_stream *stream, const void *data, size_t len)
+{
+  assert (! stream->eof);
+  return evbuffer_add (stream->input, (void *) data, len);
+}
 
-  struct my_destination_msg dest;
-  compress.dest = &dest.pub;
-  dest.pub.init_destination = init_destination;
-  dest.pub.empty_output_buffer = empty_output_buffer;
-  dest.pub.term_destination = term_destination;
-  dest.pub.free_in_buffer = 0;
+void
+jpeg_stream_finish (struct jpeg_stream *stream)
+{
+  stream->eof = true;
+}
 
-  dest.buffer = evbuffer_new ();
-  dest.source_size = EVBUFFER_LENGTH (source);
+bool
+jpeg_stream_run (struct jpeg_stream *stream)
+{
+  if (stream->state == JS_FAILED)
+    return false;
+  if (stream->state == JS_DONE)
+    return true;
 
-  /* IN_COLOR_SPACE must be set prior to calling jpeg_set_defaults.  */
-  compress.in_color_space = decompress.out_color_space;
-  jpeg_set_defaults (&compress);
+  struct jpeg_decompress_struct *decompress = &stream->decompress;
+  struct jpeg_compress_struct *compress = &stream->compress;
 
-  compress.image_width = decompress.output_width;
-  compress.image_height = decompress.output_height;
-  compress.input_components = decompress.output_components;
+  jmp_buf jmp_buf;
+  stream->error_mgr.jmp_bufp = &jmp_buf;
 
-  /* Use fast integer encoding--the least accurate.  */
-  compress.dct_method = JDCT_IFAST;
-  /* Set the quality appropriately.  */
-  jpeg_set_quality (&compress, quality, TRUE);
-  /* Use progressive encoding.  */
-  jpeg_simple_progression (&compress);
+  if (setjmp (jmp_buf))
+    {
+      stream->state = JS_FAILED;
+      return false;
+    }
+
+  if (! stream->created)
+    {
+      decompress->err = &stream->error_mgr.jpeg_error_mgr;
+      compress->err = &stream->error_mgr.jpeg_error_mgr;
+      /* Set CREATED first.  Then, in case we error out in
+	 jpeg_create_decompress or jpeg_create_compress, jpeg_stream_free
+	 destroys whatever was set up.  */
+      stream->created = true;
+      jpeg_create_decompress (decompress);
+      jpeg_create_compress (compress);
+
+      decompress->src = &stream->src;
+      compress->dest = &stream->dest.pub;
+
+      /* Save the APP1 segments for their EXIF orientation.  */
+      jpeg_save_markers (decompress, JPEG_APP0 + 1, 0xFFFF);
+    }
+
+  /* Drop what the decompressor consumed during the last run.  It is
+     presented with the rest and whatever arrived since.  */
+  evbuffer_drain (stream->input, stream->consumed);
+  stream->consumed = 0;
+  if (stream->skip)
+    {
+      size_t skip = EVBUFFER_LENGTH (stream->input);
+      if (skip > stream->skip)
+	skip = stream->skip;
+      evbuffer_drain (stream->input, skip);
+      stream->skip -= skip;
+    }
+  stream->src.next_input_byte = EVBUFFER_DATA (stream->input);
+  stream->src.bytes_in_buffer = EVBUFFER_LENGTH (stream->input);
+
+  for (;;)
+    switch (stream->state)
+      {
+      case JS_HEADER:
+	/* This determines the image width, height, components and
+	   color space.  */
+	if (jpeg_read_header (decompress, TRUE) == JPEG_SUSPENDED)
+	  goto suspend;
+
+	if (! jpeg_stream_plan (stream))
+	  {
+	    stream->state = JS_FAILED;
+	    return false;
+	  }
+	break;
+
+      case JS_COEFFICIENTS:
+	{
+	  jvirt_barray_ptr *coefficients = jpeg_read_coefficients (decompress);
+	  if (! coefficients)
+	    goto suspend;
+
+	  if (jpeg_min_ssim)
+	    {
+	      stream->quality = jpeg_ssim_search (decompress, coefficients,
+						  stream->source_quality);
+	      if (stream->source_quality
+		  < stream->quality + JPEG_QUALITY_MARGIN)
+		{
+		  log ("Image quality already low, not recompressing.");
+		  stream->state = JS_FAILED;
+		  return false;
+		}
+	    }
 
-  jpeg_start_compress(&compress, TRUE);
+	  jpeg_requantize (decompress, compress, coefficients,
+			   stream->quality, stream->orientation);
+	  stream->state = JS_FINISH;
+	}
+	break;
+
+      case JS_START:
+	/* This computes the output width, height, compnents, etc. based
+	   on the parameters (including the scale).  We require this
+	   information to set up the compressor.  */
+	if (! jpeg_start_decompress (decompress))
+	  goto suspend;
+
+	jpeg_reencode_start (decompress, compress, stream->quality,
+			     stream->orientation);
+
+	stream->rows = (*decompress->mem->alloc_sarray)
+	  ((j_common_ptr) decompress, JPOOL_IMAGE,
+	   decompress->output_width * decompress->output_components,
+	   decompress->rec_outbuf_height);
+
+	stream->state = JS_SCANLINES;
+	break;
+
+      case JS_SCANLINES:
+	while (decompress->output_scanline < decompress->output_height)
+	  {
+	    int scanlines = jpeg_read_scanlines (decompress, stream->rows,
+						 decompress->rec_outbuf_height);
+	    if (scanlines == 0)
+	      goto suspend;
+	    jpeg_write_scanlines (compress, stream->rows, scanlines);
+	  }
+
+	jpeg_finish_compress (compress);
+	stream->state = JS_FINISH;
+	break;
+
+      case JS_FINISH:
+	if (! jpeg_finish_decompress (decompress))
+	  goto suspend;
+
+	stream->state = JS_DONE;
+	return true;
+
+      case JS_DONE:
+      case JS_FAILED:
+	assert (! "reached");
+	return false;
+      }
+
+ suspend:
+  /* The decompressor needs more input.  Remember how much of the
+     input it consumed.  */
+  assert (! stream->eof);
+  stream->consumed
+    = EVBUFFER_LENGTH (stream->input) - stream->src.bytes_in_buffer;
+  return true;
+}
+
+struct evbuffer *
+jpeg_stream_result (struct jpeg_stream *stream)
+{
+  if (stream->state != JS_DONE)
+    return NULL;
 
+  struct evbuffer *result = stream->dest.buffer;
+  stream->dest.buffer = NULL;
+  return result;
+}
 
-  /* Begin recompression.  */
-  int w = decompress.output_width;
-  int d = decompress.output_components;
-  int scanlines = decompress.rec_outbuf_height;
+void
+jpeg_stream_free (struct jpeg_stream *stream)
+{
+  if (stream->created)
+    {
+      jpeg_destroy_decompress (&stream->decompress);
+      jpeg_destroy_compress (&stream->compress);
+    }
 
-  unsigned char *buf = alloca (w * d * sizeof (JSAMPLE) * scanlines);
-  unsigned char *ibuf[scanlines];
-  int i;
-  for (i = 0; i < scanlines; i ++)
-    ibuf[i] = buf + w * d * i;
+  if (stream->dest.buffer)
+    evbuffer_free (stream->dest.buffer);
+  if (stream->input)
+    evbuffer_free (stream->input);
+  free (stream);
+}
 
-  while (decompress.output_scanline < decompress.output_height)
+struct evbuffer *
+jpeg_recompress (struct evbuffer *source, int quality, int max_size)
+{
+  struct jpeg_stream *stream
+    = jpeg_stream_new (quality, max_size, EVBUFFER_LENGTH (source));
+  if (! stream)
+    return NULL;
+
+  struct evbuffer *result = NULL;
+  if (jpeg_stream_feed (stream, EVBUFFER_DATA (source),
+			EVBUFFER_LENGTH (source)) == 0)
     {
-      int scanlines = decompress.rec_outbuf_height;
-      scanlines = jpeg_read_scanlines (&decompress,
-				       (JSAMPARRAY) &ibuf, scanlines);
-      jpeg_write_scanlines (&compress, (JSAMPARRAY) &ibuf, scanlines);
+      jpeg_stream_finish (stream);
+      if (jpeg_stream_run (stream))
+	result = jpeg_stream_result (stream);
+    }
+
+  jpeg_stream_free (stream);
+  return result;
+}
+
+/* Whether to keep the segment with marker MARKER whose LEN bytes of
+   data are at DATA.  */
+static bool
+jpeg_strip_keep (int marker, const unsigned char *data, size_t len)
+{
+  if (marker == JPEG_APP0)
+    /* The JFIF header is small and tells the decoder the color space.
+       Its extensions are thumbnails.  */
+    return len >= 5 && memcmp (data, "JFIF\0", 5) == 0;
+
+  if (marker == JPEG_APP0 + 14)
+    /* Adobe's segment tells the decoder whether the colors are
+       transformed.  */
+    return len >= 5 && memcmp (data, "Adobe", 5) == 0;
+
+  /* Drop the other application segments (EXIF, XMP, ICC profiles,
+     etc.) and comments.  Keep the tables and the frame header.  */
+  return ! ((marker >= JPEG_APP0 && marker <= JPEG_APP0 + 15)
+	    || marker == JPEG_COM);
+}
+
+size_t
+jpeg_strip (struct evbuffer *image)
+{
+  unsigned char *data = EVBUFFER_DATA (image);
+  size_t len = EVBUFFER_LENGTH (image);
+
+  if (len < 4 || data[0] != 0xFF || data[1] != 0xD8)
+    /* Not a JPEG.  */
+    return 0;
+
+  /* Copy the segments that are kept from R to W.  */
+  size_t r = 2;
+  size_t w = 2;
+  bool oriented = false;
+
+  /* The segments before the first scan have a length.  Stop at
+     anything else: the rest is copied verbatim.  */
+  while (r + 4 <= len && data[r] == 0xFF)
+    {
+      int marker = data[r + 1];
+      if (/* The start of a scan.  */
+	  marker == 0xDA
+	  /* A fill byte, or a marker without a length (TEM, RSTn, SOI,
+	     EOI).  */
+	  || marker == 0xFF || marker == 0x01
+	  || (marker >= 0xD0 && marker <= 0xD9))
+	break;
+
+      size_t segment = 2 + ((data[r + 2] << 8) | data[r + 3]);
+      if (segment < 4 || r + segment > len)
+	break;
+
+      if (jpeg_strip_keep (marker, &data[r + 4], segment - 4))
+	{
+	  memmove (&data[w], &data[r], segment);
+	  w += segment;
+	}
+      else if (marker == JPEG_APP0 + 1 && ! oriented)
+	/* Viewers rotate the image according to the EXIF orientation.
+	   Keep that much.  W is at most R, so as long as the segment is
+	   at least as large as the one we write, this doesn't overwrite
+	   anything that is yet to be read.  */
+	{
+	  int orientation = jpeg_exif_orientation (&data[r + 4],
+						   segment - 4);
+	  if (orientation > 1 && orientation <= 8
+	      && segment >= sizeof (exif_orientation))
+	    {
+	      memcpy (&data[w], exif_orientation, sizeof (exif_orientation));
+	      data[w + 29] = orientation;
+	      w += sizeof (exif_orientation);
+	      oriented = true;
+	    }
+	}
+
+      r += segment;
     }
 
-  jpeg_finish_decompress(&decompress);
-  jpeg_destroy_decompress(&decompress);
+  if (r == w)
+    return 0;
 
-  jpeg_finish_compress(&compress);
-  jpeg_destroy_compress(&compress);
+  memmove (&data[w], &data[r], len - r);
+  EVBUFFER_LENGTH (image) = w + len - r;
 
-  return dest.buffer;
+  log ("Stripped %zu bytes of metadata", r - w);
+  return r - w;
 }
@@ -19,9 +19,70 @@
 #include <sys/queue.h>
 #include <sys/types.h>
 #include <event.h>
+#include <stdbool.h>
+
+/* Images whose width or height exceeds this many pixels are
+   downscaled.  0 means no limit.  */
+extern int jpeg_max_size;
+
+/* If not 0, images that are requantized are recompressed at the
+   lowest quality (instead of the requested quality) whose SSIM
+   relative to the source is at least JPEG_MIN_SSIM percent.  Images
+   whose pixels are re-encoded (because they are scaled or their
+   chroma is stored at full resolution) keep the requested quality.  */
+extern int jpeg_min_ssim;
+
+/* Set JPEG_MAX_SIZE to MAX_SIZE and JPEG_MIN_SSIM to MIN_SSIM.  */
+extern void jpeg_init (int max_size, int min_ssim);
+
+/* A JPEG that is recompressed as it arrives.  */
+struct jpeg_stream;
+
+/* Create a stream that recompresses a JPEG like jpeg_recompress.
+   SIZE_HINT is the expected size of the image in bytes (0 if not
+   known).  Returns NULL if memory is exhausted.
+
+   A stream is not thread safe, but it may be passed between threads:
+   the data can be fed on one thread and processed on another, as long
+   as the calls don't overlap.  */
+extern struct jpeg_stream *jpeg_stream_new (int quality, int max_size,
+					    size_t size_hint);
+
+/* Append the LEN bytes at DATA to STREAM's input.  Returns 0 on
+   success, -1 if memory is exhausted.  */
+extern int jpeg_stream_feed (struct jpeg_stream *stream,
+			     const void *data, size_t len);
+
+/* Signal that all of the input has been fed.  */
+extern void jpeg_stream_finish (struct jpeg_stream *stream);
+
+/* Decode as much of the input fed so far as possible and encode the
+   result.  Once the input is finished, runs to completion.  Returns
+   false if the image can't be recompressed, in which case further
+   input is pointless.  */
+extern bool jpeg_stream_run (struct jpeg_stream *stream);
+
+/* Return the recompressed image.  NULL if the stream is not complete
+   or failed.  The caller owns the buffer.  */
+extern struct evbuffer *jpeg_stream_result (struct jpeg_stream *stream);
+
+/* Release STREAM.  */
+extern void jpeg_stream_free (struct jpeg_stream *stream);
 
 /* Recompress the JPEG stored in SOURCE.  QUALITY is the desired
-   quality.  It should be between 0 and 100.  Returns NULL on failure,
-   otherwise a buffer containing the image data.  */
+   quality.  It should be between 0 and 100.  If MAX_SIZE is not 0 and
+   the image's width or height exceeds MAX_SIZE pixels, the image is
+   scaled down by 1/2, 1/4 or 1/8 (the least that makes it fit, if
+   any).  The source's quality is estimated from its quantization
+   tables: the result's is never higher, and if that would hardly
+   make the image smaller, the image is not recompressed.  Returns
+   NULL on failure, otherwise a buffer containing the image data.  */
 extern struct evbuffer *jpeg_recompress (struct evbuffer *source,
-					 int quality);
+					 int quality, int max_size);
+
+/* Remove the metadata (EXIF data except for the orientation, ICC
+   profiles, thumbnails, comments, etc.) from the JPEG stored in IMAGE
+   in place.  Only the segments before the first scan are examined;
+   the compressed data is not decoded.  Returns the number of bytes
+   removed.  */
+extern size_t jpeg_strip (struct evbuffer *image);
@@ -28,8 +28,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <sys/wait.h>
+#include <time.h>
 
 #include "user_conn.h"
+#include "http_conn.h"
+#include "dns.h"
+#include "thread_pool.h"
+#include "cache.h"
+#include "spill.h"
+#include "jpeg.h"
 #include "log.h"
 #include "opts.h"
 
@@ -60,30 +69,17 @@ socket_event (int fd, short event, void *arg)
     }
 }
 
+/* The event base of this process's reactor.  */
 struct event_base *event_base;
 
-
+/* Create a socket listening on PORT.  If REUSEPORT is true, other
+   processes may listen on the same port; the kernel then distributes
+   incoming connections among them.  */
 static int
-pack_proxy (struct arguments_t *arguments)
+listen_socket (int port, bool reuseport)
 {
   int ret;
 
-  /* We block SIGPIPE.  If a client closes the socket and we write to
-     it, the write returns EPIPE and delivers a SIGPIPE.  The default
-     action is to abort.  This is not what we want.  Blocking SIGPIPE
-     is enough as the right thing will happen: the write will fail and
-     we will notice that the socket has been closed.  */
-  sigset_t sigset;
-  sigemptyset (&sigset);
-  sigaddset (&sigset, SIGPIPE);
-  ret = sigprocmask (SIG_BLOCK, &sigset, NULL);
-  if (ret < 0)
-    error (errno, 1, "sigprocmask (SIG_BLOCK, SIGPIPE)");
-
-  event_base = event_init ();
-  if (! event_base)
-    error (0, 1, "Failed to initialize libevent.");
-
   /* Bind to the server socket.  */
   int server_socket = socket (AF_INET, SOCK_STREAM, 0);
   if (server_socket == -1)
@@ -104,10 +100,22 @@ pack_proxy (struct arguments_t *arguments)
   if (ret < 0)
     error (errno, 0, "warning: setsockopt (SO_REUSEADDR)");
 
+  if (reuseport)
+    {
+#ifdef SO_REUSEPORT
+      ret = setsockopt (server_socket, SOL_SOCKET, SO_REUSEPORT,
+			(void *) &reuse, (socklen_t) sizeof (reuse));
+      if (ret < 0)
+	error (1, errno, "setsockopt (SO_REUSEPORT)");
+#else
+      error (1, 0, "--workers requires SO_REUSEPORT.");
+#endif
+    }
+
   struct sockaddr_in addr;
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = INADDR_ANY;
-  addr.sin_port = htons (arguments->ziproxy_ng.port);
+  addr.sin_port = htons (port);
   ret = bind (server_socket, (struct sockaddr *) &addr, sizeof (addr));
   if (ret < 0)
     error (errno, 1, "bind()");
@@ -116,6 +124,39 @@ pack_proxy (struct arguments_t *arguments)
   if (ret < 0)
     error (errno, 1, "listen");
 
+  return server_socket;
+}
+
+/* Run a reactor: an event loop accepting connections on its own
+   listening socket.  THREADS is the number of threads to use for
+   recompressing images (0 means one per processor).  Never
+   returns.  */
+static void
+reactor (struct arguments_t *arguments, bool reuseport, int threads)
+{
+  int ret;
+
+  event_base = event_init ();
+  if (! event_base)
+    error (0, 1, "Failed to initialize libevent.");
+
+  /* Upstream host names are resolved asynchronously.  */
+  dns_init ();
+
+  /* Images are recompressed on worker threads.  */
+  thread_pool_init (threads);
+
+  cache_init ((size_t) arguments->ziproxy_ng.cache_size * 1024 * 1024);
+
+  spill_init ((size_t) arguments->ziproxy_ng.spill_threshold * 1024);
+  jpeg_init (arguments->ziproxy_ng.max_image_size,
+	     arguments->ziproxy_ng.image_ssim);
+
+  if (arguments->ziproxy_ng.pipeline)
+    http_conn_pipeline_init (arguments->ziproxy_ng.pipeline);
+
+  int server_socket = listen_socket (arguments->ziproxy_ng.port, reuseport);
+
   /* Set up an event source to handle incoming connections.  */
   struct event socket_event_source;
   event_set (&socket_event_source, server_socket, EV_READ|EV_WRITE|EV_PERSIST,
@@ -127,7 +168,174 @@ pack_proxy (struct arguments_t *arguments)
   /* Event the event loop.  Never returns.  */
   event_dispatch ();
 
-  return 0;
+  exit (0);
+}
+
+/* A reactor that exits within this many seconds of being started
+   is assumed to fail to start (e.g., because it can't bind to the
+   port).  Restarting it would be futile.  */
+#define REACTOR_MIN_LIFETIME 5
+
+/* The signals that the parent of the reactors handles: the
+   termination signals, which it forwards to the reactors, and
+   SIGCHLD.  */
+static const int parent_signals[] = { SIGTERM, SIGINT, SIGHUP, SIGCHLD };
+#define PARENT_SIGNALS (sizeof (parent_signals) / sizeof (parent_signals[0]))
+
+/* The termination signal that the parent received, or 0.  */
+static volatile sig_atomic_t terminate_signal;
+
+static void
+parent_signal (int sig)
+{
+  if (sig != SIGCHLD)
+    terminate_signal = sig;
+}
+
+/* Fork a process running a reactor.  Returns its pid.  */
+static pid_t
+reactor_spawn (struct arguments_t *arguments, int threads)
+{
+  /* Don't let the child inherit (and repeat) buffered output.  */
+  fflush (stdout);
+
+  pid_t pid = fork ();
+  if (pid < 0)
+    error (1, errno, "fork");
+  if (pid == 0)
+    {
+      /* Undo the parent's signal handling.  */
+      sigset_t sigset;
+      sigemptyset (&sigset);
+      int i;
+      for (i = 0; i < PARENT_SIGNALS; i ++)
+	{
+	  signal (parent_signals[i], SIG_DFL);
+	  sigaddset (&sigset, parent_signals[i]);
+	}
+      sigprocmask (SIG_UNBLOCK, &sigset, NULL);
+
+      reactor (arguments, true, threads);
+    }
+
+  return pid;
+}
+
+/* Send SIG to the reactors in PIDS (a pid of 0 means none) and wait
+   for them to exit.  */
+static void
+reactors_stop (pid_t *pids, int workers, int sig)
+{
+  int i;
+  for (i = 0; i < workers; i ++)
+    if (pids[i])
+      kill (pids[i], sig);
+
+  for (i = 0; i < workers; i ++)
+    if (pids[i])
+      {
+	while (waitpid (pids[i], NULL, 0) < 0 && errno == EINTR)
+	  ;
+	pids[i] = 0;
+      }
+}
+
+static int
+pack_proxy (struct arguments_t *arguments)
+{
+  int ret;
+
+  /* We block SIGPIPE.  If a client closes the socket and we write to
+     it, the write returns EPIPE and delivers a SIGPIPE.  The default
+     action is to abort.  This is not what we want.  Blocking SIGPIPE
+     is enough as the right thing will happen: the write will fail and
+     we will notice that the socket has been closed.  */
+  sigset_t sigset;
+  sigemptyset (&sigset);
+  sigaddset (&sigset, SIGPIPE);
+  ret = sigprocmask (SIG_BLOCK, &sigset, NULL);
+  if (ret < 0)
+    error (errno, 1, "sigprocmask (SIG_BLOCK, SIGPIPE)");
+
+  int workers = arguments->ziproxy_ng.workers;
+  if (workers <= 1)
+    /* Use a single reactor in this process.  */
+    reactor (arguments, false, 0);
+
+  /* Each reactor runs in its own process with its own event base,
+     listening socket and connection state: libevent's default event
+     base, and our resolver cache, connection pool and thread pool are
+     process-wide.  The kernel balances incoming connections across
+     the listening sockets.  The processors are shared among the
+     reactors' thread pools.  */
+  int threads = sysconf (_SC_NPROCESSORS_ONLN) / workers;
+  if (threads < 1)
+    threads = 1;
+
+  /* Catch the signals that we handle.  They are blocked except while
+     waiting, so that none arrives between checking for it and going
+     to sleep.  */
+  struct sigaction action;
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = parent_signal;
+  sigemptyset (&action.sa_mask);
+  sigemptyset (&sigset);
+  int i;
+  for (i = 0; i < PARENT_SIGNALS; i ++)
+    {
+      sigaction (parent_signals[i], &action, NULL);
+      sigaddset (&sigset, parent_signals[i]);
+    }
+  sigset_t wait_sigset;
+  ret = sigprocmask (SIG_BLOCK, &sigset, &wait_sigset);
+  if (ret < 0)
+    error (errno, 1, "sigprocmask (SIG_BLOCK)");
+
+  pid_t pids[workers];
+  time_t started[workers];
+  for (i = 0; i < workers; i ++)
+    {
+      pids[i] = reactor_spawn (arguments, threads);
+      started[i] = time (NULL);
+    }
+
+  log ("Started %d reactors.", workers);
+
+  for (;;)
+    {
+      /* Restart any reactor that dies.  */
+      int status;
+      pid_t pid;
+      while ((pid = waitpid (-1, &status, WNOHANG)) > 0)
+	for (i = 0; i < workers; i ++)
+	  if (pids[i] == pid)
+	    {
+	      pids[i] = 0;
+
+	      if (time (NULL) - started[i] < REACTOR_MIN_LIFETIME)
+		{
+		  reactors_stop (pids, workers, SIGTERM);
+		  error (1, 0, "Reactor %d (pid %d) exited (status: %x) "
+			 "right after starting, giving up.", i, pid, status);
+		}
+
+	      log ("Reactor %d (pid %d) exited (status: %x), restarting.",
+		   i, pid, status);
+	      pids[i] = reactor_spawn (arguments, threads);
+	      started[i] = time (NULL);
+	      break;
+	    }
+
+      if (terminate_signal)
+	{
+	  log ("Received signal %d, stopping the reactors.",
+	       terminate_signal);
+	  reactors_stop (pids, workers, terminate_signal);
+	  return 0;
+	}
+
+      sigsuspend (&wait_sigset);
+    }
 }
 
 int
@@ -45,6 +45,28 @@ static struct argp_option options[] =
     { "port", OPT_PORT, "VALUE", 0, 
       "Listen for connections on this internet port (Default " 
 	DEFAULT_PORT_VALUE ")", 1 },
+    { "workers", OPT_WORKERS, "NUM", 0, 
+      "Run this many event loops, each in its own process (Default " 
+	DEFAULT_WORKERS_VALUE ")", 1 },
+    { "cache-size", OPT_CACHE_SIZE, "MB", 0, 
+      "Cache up to this many megabytes of responses per worker, 0 "
+      "disables the cache (Default " DEFAULT_CACHE_SIZE_VALUE ")", 1 },
+    { "pipeline", OPT_PIPELINE, "HOSTS", 0, 
+      "Pipeline requests to these origin servers (a comma separated list, "
+      "or * for all) (Default none)", 1 },
+    { "spill-threshold", OPT_SPILL_THRESHOLD, "KB", 0, 
+      "Move responses that queue more than this many kilobytes to "
+      "temporary files, 0 disables spilling (Default "
+	DEFAULT_SPILL_THRESHOLD_VALUE ")", 1 },
+    { "max-image-size", OPT_MAX_IMAGE_SIZE, "PIXELS", 0, 
+      "Scale down JPEG images that are wider or taller than this, 0 "
+      "disables scaling (Default " DEFAULT_MAX_IMAGE_SIZE_VALUE ")", 1 },
+    { "image-ssim", OPT_IMAGE_SSIM, "PERCENT", 0, 
+      "Requantize JPEG images to the lowest quality whose SSIM is at "
+      "least PERCENT/100 (images that are scaled or have full "
+      "resolution chroma are re-encoded at a fixed quality), 0 uses a "
+      "fixed quality (Default "
+	DEFAULT_IMAGE_SSIM_VALUE ")", 1 },
     { 0 }
 };
 
@@ -54,6 +76,12 @@ init_options (struct ziproxy_ng_options_t *ziproxy_ng)
   ziproxy_ng->verbose = -1;
   ziproxy_ng->debug = -1;
   ziproxy_ng->port = -1;
+  ziproxy_ng->workers = -1;
+  ziproxy_ng->cache_size = -1;
+  ziproxy_ng->pipeline = NULL;
+  ziproxy_ng->spill_threshold = -1;
+  ziproxy_ng->max_image_size = -1;
+  ziproxy_ng->image_ssim = -1;
   return;
 }
 
@@ -80,6 +108,62 @@ parse_opt (int key, char *arg, struct argp_state *state)
 	  return EINVAL;
 	}
       break;
+    case OPT_WORKERS:
+      arguments->ziproxy_ng.workers = strtoul (arg, &end, 0);
+      if ((end == NULL) || (end == arg))
+	{
+	  argp_error (state, 
+		      "the argument to --workers isn't a number.");
+	  return EINVAL;
+	}
+      if (arguments->ziproxy_ng.workers <= 0
+	  || arguments->ziproxy_ng.workers > 256)
+	{
+	  argp_error (state, 
+		      "the argument to --workers isn't between 1 and 256.");
+	  return EINVAL;
+	}
+      break;
+    case OPT_CACHE_SIZE:
+      arguments->ziproxy_ng.cache_size = strtoul (arg, &end, 0);
+      if ((end == NULL) || (end == arg))
+	{
+	  argp_error (state, 
+		      "the argument to --cache-size isn't a number.");
+	  return EINVAL;
+	}
+      break;
+    case OPT_PIPELINE:
+      arguments->ziproxy_ng.pipeline = arg;
+      break;
+    case OPT_SPILL_THRESHOLD:
+      arguments->ziproxy_ng.spill_threshold = strtoul (arg, &end, 0);
+      if ((end == NULL) || (end == arg))
+	{
+	  argp_error (state, 
+		      "the argument to --spill-threshold isn't a number.");
+	  return EINVAL;
+	}
+      break;
+    case OPT_MAX_IMAGE_SIZE:
+      arguments->ziproxy_ng.max_image_size = strtoul (arg, &end, 0);
+      if ((end == NULL) || (end == arg))
+	{
+	  argp_error (state, 
+		      "the argument to --max-image-size isn't a number.");
+	  return EINVAL;
+	}
+      break;
+    case OPT_IMAGE_SSIM:
+      arguments->ziproxy_ng.image_ssim = strtoul (arg, &end, 0);
+      if ((end == NULL) || (end == arg)
+	  || arguments->ziproxy_ng.image_ssim > 100)
+	{
+	  argp_error (state, 
+		      "the argument to --image-ssim isn't a percentage.");
+	  return EINVAL;
+	}
+      break;
     case OPT_DEBUG:
       if (arg)
 	{
@@ -142,6 +226,16 @@ set_default_options (struct ziproxy_ng_options_t *ziproxy_ng)
     ziproxy_ng->debug = atoi (DEFAULT_DEBUG_VALUE);
   if (ziproxy_ng->port == -1)
     ziproxy_ng->port = atoi (DEFAULT_PORT_VALUE);
+  if (ziproxy_ng->workers == -1)
+    ziproxy_ng->workers = atoi (DEFAULT_WORKERS_VALUE);
+  if (ziproxy_ng->cache_size == -1)
+    ziproxy_ng->cache_size = atoi (DEFAULT_CACHE_SIZE_VALUE);
+  if (ziproxy_ng->spill_threshold == -1)
+    ziproxy_ng->spill_threshold = atoi (DEFAULT_SPILL_THRESHOLD_VALUE);
+  if (ziproxy_ng->max_image_size == -1)
+    ziproxy_ng->max_image_size = atoi (DEFAULT_MAX_IMAGE_SIZE_VALUE);
+  if (ziproxy_ng->image_ssim == -1)
+    ziproxy_ng->image_ssim = atoi (DEFAULT_IMAGE_SSIM_VALUE);
   return;
 }
 
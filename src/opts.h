@@ -24,6 +24,12 @@ enum ziproxy_ng_command_line_options_t
   OPT_DEBUG = -123,
   OPT_VERBOSE = 'v',
   OPT_PORT = 'p',
+  OPT_WORKERS = 'w',
+  OPT_CACHE_SIZE = 'c',
+  OPT_PIPELINE = -124,
+  OPT_SPILL_THRESHOLD = -125,
+  OPT_MAX_IMAGE_SIZE = -126,
+  OPT_IMAGE_SSIM = -127,
 };
 
 // types
@@ -32,6 +38,12 @@ struct ziproxy_ng_options_t
   int verbose;
   int debug;
   int port;
+  int workers;
+  int cache_size;
+  char *pipeline;
+  int spill_threshold;
+  int max_image_size;
+  int image_ssim;
 };
 
 struct arguments_t 
@@ -45,5 +57,10 @@ void parse_opts (int argc, char **argv, struct arguments_t *arguments);
 #define DEFAULT_VERBOSE_VALUE "0"
 #define DEFAULT_DEBUG_VALUE "0"
 #define DEFAULT_PORT_VALUE "7001"
+#define DEFAULT_WORKERS_VALUE "1"
+#define DEFAULT_CACHE_SIZE_VALUE "64"
+#define DEFAULT_SPILL_THRESHOLD_VALUE "1024"
+#define DEFAULT_MAX_IMAGE_SIZE_VALUE "0"
+#define DEFAULT_IMAGE_SSIM_VALUE "0"
 
 #endif
@@ -0,0 +1,419 @@
+/* request_parser.c - Incremental HTTP request parser.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#include "request_parser.h"
+
+enum
+  {
+    /* Skipping any empty lines before the request line.  */
+    RP_START = 0,
+    RP_METHOD,
+    RP_URI_START,
+    RP_URI,
+    RP_VERSION_START,
+    RP_VERSION,
+    /* Skipping the rest of the request line.  */
+    RP_REQUEST_LINE_END,
+    /* At the start of a header line.  */
+    RP_LINE_START,
+    RP_KEY,
+    RP_VALUE_START,
+    RP_VALUE,
+    /* Skipping a line that we don't understand.  */
+    RP_SKIP_LINE,
+    /* Saw a \r at the start of a line.  */
+    RP_END_CR,
+    /* The request is malformed.  Looking for its end.  */
+    RP_BAD,
+    RP_BAD_LINE_START,
+  };
+
+/* Record the location of the header whose key was just scanned and
+   whose value is VALUE_LEN bytes at VALUE.  Returns false if memory is
+   exhausted.  */
+static bool
+request_parser_add_header (struct request_parser *parser,
+			   int value, int value_len)
+{
+  if (parser->span_count == parser->span_alloc)
+    {
+      int alloc = parser->span_alloc ? 2 * parser->span_alloc : 16;
+      struct http_header_span *spans
+	= realloc (parser->spans, alloc * sizeof (*spans));
+      if (! spans)
+	return false;
+
+      parser->spans = spans;
+      parser->span_alloc = alloc;
+    }
+
+  struct http_header_span *span = &parser->spans[parser->span_count ++];
+  span->key = parser->key.offset;
+  span->key_len = parser->key.len;
+  span->value = value;
+  span->value_len = value_len;
+
+  return true;
+}
+
+enum request_parser_status
+request_parser_parse (struct request_parser *parser,
+		      const char *data, int len)
+{
+  /* Don't look past the most that a request may occupy.  */
+  if (len > REQUEST_MAX)
+    len = REQUEST_MAX;
+
+  int pos;
+  for (pos = parser->pos; pos < len; pos ++)
+    {
+      char c = data[pos];
+
+      switch (parser->state)
+	{
+	case RP_START:
+	  /* Some clients send gratuitous \r\n's after a request.  Don't
+	     be confused.  */
+	  if (c == '\r' || c == '\n' || c == ' ')
+	    break;
+
+	  parser->token = pos;
+	  parser->state = RP_METHOD;
+	  break;
+
+	case RP_METHOD:
+	  if (c == ' ')
+	    {
+	      parser->method.offset = parser->token;
+	      parser->method.len = pos - parser->token;
+	      parser->state = RP_URI_START;
+	    }
+	  else if (c == '\n')
+	    parser->state = RP_BAD_LINE_START;
+	  else if (c == '\r')
+	    parser->state = RP_BAD;
+	  break;
+
+	case RP_URI_START:
+	case RP_VERSION_START:
+	  if (c == ' ')
+	    break;
+	  if (c == '\n')
+	    parser->state = RP_BAD_LINE_START;
+	  else if (c == '\r')
+	    parser->state = RP_BAD;
+	  else
+	    {
+	      parser->token = pos;
+	      parser->state
+		= parser->state == RP_URI_START ? RP_URI : RP_VERSION;
+	    }
+	  break;
+
+	case RP_URI:
+	  if (c == ' ')
+	    {
+	      parser->uri.offset = parser->token;
+	      parser->uri.len = pos - parser->token;
+	      parser->state = RP_VERSION_START;
+	    }
+	  else if (c == '\n')
+	    /* No version.  */
+	    parser->state = RP_BAD_LINE_START;
+	  else if (c == '\r')
+	    parser->state = RP_BAD;
+	  break;
+
+	case RP_VERSION:
+	  if (c == ' ' || c == '\r' || c == '\n')
+	    {
+	      parser->version.offset = parser->token;
+	      parser->version.len = pos - parser->token;
+	      parser->state
+		= c == '\n' ? RP_LINE_START : RP_REQUEST_LINE_END;
+	    }
+	  break;
+
+	case RP_REQUEST_LINE_END:
+	case RP_SKIP_LINE:
+	  if (c == '\n')
+	    parser->state = RP_LINE_START;
+	  break;
+
+	case RP_LINE_START:
+	  if (c == '\n')
+	    goto done;
+	  else if (c == '\r')
+	    parser->state = RP_END_CR;
+	  else if (c == ' ' || c == '\t' || c == ':')
+	    /* We don't support continuation lines.  */
+	    parser->state = RP_SKIP_LINE;
+	  else
+	    {
+	      parser->token = pos;
+	      parser->state = RP_KEY;
+	    }
+	  break;
+
+	case RP_END_CR:
+	  if (c == '\n')
+	    goto done;
+	  parser->state = RP_BAD;
+	  break;
+
+	case RP_KEY:
+	  if (c == ':')
+	    {
+	      parser->key.offset = parser->token;
+	      parser->key.len = pos - parser->token;
+	      parser->state = RP_VALUE_START;
+	    }
+	  else if (c == '\n')
+	    /* Ignore lines without a colon.  */
+	    parser->state = RP_LINE_START;
+	  break;
+
+	case RP_VALUE_START:
+	  if (c == ' ' || c == '\t')
+	    break;
+	  if (c == '\n')
+	    {
+	      if (request_parser_add_header (parser, pos, 0))
+		parser->state = RP_LINE_START;
+	      else
+		parser->state = RP_BAD_LINE_START;
+	      break;
+	    }
+
+	  parser->token = pos;
+	  parser->token_end = c == '\r' ? pos : pos + 1;
+	  parser->state = RP_VALUE;
+	  break;
+
+	case RP_VALUE:
+	  if (c == '\n')
+	    {
+	      /* Trailing white space (including the \r) is not part of
+		 the value.  */
+	      if (request_parser_add_header (parser, parser->token,
+					     parser->token_end
+					     - parser->token))
+		parser->state = RP_LINE_START;
+	      else
+		parser->state = RP_BAD_LINE_START;
+	    }
+	  else if (c != ' ' && c != '\t' && c != '\r')
+	    parser->token_end = pos + 1;
+	  break;
+
+	case RP_BAD:
+	  if (c == '\n')
+	    parser->state = RP_BAD_LINE_START;
+	  break;
+
+	case RP_BAD_LINE_START:
+	  if (c == '\n')
+	    {
+	      parser->pos = parser->length = pos + 1;
+	      return REQUEST_BAD;
+	    }
+	  if (c != '\r')
+	    parser->state = RP_BAD;
+	  break;
+	}
+    }
+
+  parser->pos = pos;
+  if (pos == REQUEST_MAX)
+    return REQUEST_TOO_LARGE;
+  return REQUEST_INCOMPLETE;
+
+ done:
+  parser->pos = parser->length = pos + 1;
+  parser->headers = http_headers_new (data, parser->length,
+				      parser->spans, parser->span_count);
+  return REQUEST_COMPLETE;
+}
+
+void
+request_parser_reset (struct request_parser *parser)
+{
+  if (parser->headers)
+    http_headers_free (parser->headers);
+
+  struct http_header_span *spans = parser->spans;
+  int span_alloc = parser->span_alloc;
+
+  memset (parser, 0, sizeof (*parser));
+
+  parser->spans = spans;
+  parser->span_alloc = span_alloc;
+}
+
+void
+request_parser_destroy (struct request_parser *parser)
+{
+  request_parser_reset (parser);
+  free (parser->spans);
+}
+
+enum
+  {
+    /* At the start of a chunk's size.  */
+    RB_SIZE_START = 0,
+    RB_SIZE,
+    /* Skipping a chunk extension.  */
+    RB_EXT,
+    RB_DATA,
+    /* Expecting the line end that follows a chunk's data.  */
+    RB_DATA_END,
+    RB_DATA_LF,
+    /* At the start of a trailer line (after the last chunk).  */
+    RB_TRAILER_START,
+    RB_TRAILER,
+    /* Saw a \r at the start of a trailer line.  */
+    RB_END_CR,
+  };
+
+void
+request_body_init (struct request_body *body, bool chunked, long long length)
+{
+  memset (body, 0, sizeof (*body));
+  body->chunked = chunked;
+  body->remaining = chunked ? 0 : length;
+  body->active = chunked || length > 0;
+}
+
+/* The size line of a chunk was scanned.  */
+static void
+request_body_size_done (struct request_body *body)
+{
+  /* The last chunk has size 0 and is followed by the trailer.  */
+  body->state = body->remaining ? RB_DATA : RB_TRAILER_START;
+}
+
+int
+request_body_scan (struct request_body *body, const char *data, int len)
+{
+  if (! body->chunked)
+    {
+      if (len > body->remaining)
+	len = body->remaining;
+      body->remaining -= len;
+      if (body->remaining == 0)
+	body->active = false;
+      return len;
+    }
+
+  int pos = 0;
+  while (pos < len && body->active)
+    {
+      char c = data[pos];
+
+      switch (body->state)
+	{
+	case RB_SIZE_START:
+	case RB_SIZE:
+	  {
+	    int digit = -1;
+	    if (c >= '0' && c <= '9')
+	      digit = c - '0';
+	    else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+	      digit = (c | 0x20) - 'a' + 10;
+
+	    if (digit != -1)
+	      {
+		if (body->remaining > (LLONG_MAX >> 4))
+		  return -1;
+		body->remaining = body->remaining * 16 + digit;
+		body->state = RB_SIZE;
+	      }
+	    else if (body->state == RB_SIZE_START)
+	      return -1;
+	    else if (c == '\n')
+	      request_body_size_done (body);
+	    else
+	      /* A chunk extension or the \r.  */
+	      body->state = RB_EXT;
+	  }
+	  break;
+
+	case RB_EXT:
+	  if (c == '\n')
+	    request_body_size_done (body);
+	  break;
+
+	case RB_DATA:
+	  {
+	    /* Skip the data in one go.  */
+	    int n = len - pos;
+	    if (n > body->remaining)
+	      n = body->remaining;
+	    pos += n;
+	    body->remaining -= n;
+	    if (body->remaining == 0)
+	      body->state = RB_DATA_END;
+	  }
+	  continue;
+
+	case RB_DATA_END:
+	  if (c == '\r')
+	    body->state = RB_DATA_LF;
+	  else if (c == '\n')
+	    body->state = RB_SIZE_START;
+	  else
+	    return -1;
+	  break;
+
+	case RB_DATA_LF:
+	  if (c != '\n')
+	    return -1;
+	  body->state = RB_SIZE_START;
+	  break;
+
+	case RB_TRAILER_START:
+	  if (c == '\n')
+	    body->active = false;
+	  else if (c == '\r')
+	    body->state = RB_END_CR;
+	  else
+	    body->state = RB_TRAILER;
+	  break;
+
+	case RB_TRAILER:
+	  if (c == '\n')
+	    body->state = RB_TRAILER_START;
+	  break;
+
+	case RB_END_CR:
+	  if (c != '\n')
+	    return -1;
+	  body->active = false;
+	  break;
+	}
+
+      pos ++;
+    }
+
+  return pos;
+}
@@ -0,0 +1,126 @@
+/* request_parser.h - Incremental HTTP request parser.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#ifndef REQUEST_PARSER_H
+#define REQUEST_PARSER_H
+
+#include <stdbool.h>
+
+#include "http_headers.h"
+
+/* The most bytes that a request's line and headers may occupy.  */
+#define REQUEST_MAX (64 * 1024)
+
+/* A range of bytes relative to the start of the request.  */
+struct request_span
+{
+  int offset;
+  int len;
+};
+
+enum request_parser_status
+  {
+    /* More data is needed.  */
+    REQUEST_INCOMPLETE,
+    /* A complete request was parsed.  */
+    REQUEST_COMPLETE,
+    /* A complete, but malformed, request was seen.  */
+    REQUEST_BAD,
+    /* The request did not end within REQUEST_MAX bytes.  */
+    REQUEST_TOO_LARGE,
+  };
+
+/* The parser scans a request as it arrives.  It remembers where it
+   stopped so that each byte is only examined once, no matter how many
+   pieces the request arrives in.  A zero-initialized parser is ready
+   to use.  */
+struct request_parser
+{
+  /* The state of the scanner (private).  */
+  int state;
+  /* Where to resume scanning.  */
+  int pos;
+  /* The start of the token being scanned.  */
+  int token;
+  /* The end of the last non-white space character of the token being
+     scanned.  */
+  int token_end;
+  /* The name of the header being scanned.  */
+  struct request_span key;
+
+  /* The request line.  */
+  struct request_span method;
+  struct request_span uri;
+  struct request_span version;
+
+  /* The headers seen so far.  The array is kept between requests.  */
+  struct http_header_span *spans;
+  int span_count;
+  int span_alloc;
+
+  /* Once the request is complete, its headers.  They refer to a copy
+     of the request.  */
+  struct http_headers *headers;
+
+  /* Once the request is complete, the number of bytes it occupies,
+     including the terminating empty line.  */
+  int length;
+};
+
+/* Continue parsing the request in the LEN bytes at DATA.  DATA must
+   start with the same bytes that were passed to the previous call (if
+   any); it may have been moved.  */
+extern enum request_parser_status
+request_parser_parse (struct request_parser *parser,
+		      const char *data, int len);
+
+/* Prepare PARSER for the next request.  Frees any headers that the
+   caller did not take.  */
+extern void request_parser_reset (struct request_parser *parser);
+
+/* Release the resources held by PARSER.  */
+extern void request_parser_destroy (struct request_parser *parser);
+
+/* The framing of a request's body.  Like the request parser, the
+   scanner can be fed the body in pieces.  */
+struct request_body
+{
+  /* Whether (more of) the body is expected.  */
+  bool active;
+  /* Whether the body uses the chunked transfer coding.  */
+  bool chunked;
+  /* The number of bytes that remain of the body or, if it is
+     chunked, of the current chunk.  */
+  long long remaining;
+  /* The state of the chunk scanner (private).  */
+  int state;
+};
+
+/* Prepare BODY for a body of LENGTH bytes or, if CHUNKED is true, for
+   a chunked body.  */
+extern void request_body_init (struct request_body *body,
+			       bool chunked, long long length);
+
+/* Return how many of the LEN bytes at DATA belong to BODY.  The bytes
+   are not copied; the chunked coding is not removed.  When the end of
+   the body is seen, clears BODY->ACTIVE.  Returns -1 if the chunked
+   coding is malformed.  */
+extern int request_body_scan (struct request_body *body,
+			      const char *data, int len);
+
+#endif
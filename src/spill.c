@@ -0,0 +1,160 @@
+/* spill.c - Spilling response bodies to temporary files.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#include <sys/types.h>
+#include <event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
+
+#include "spill.h"
+#include "log.h"
+
+/* The most data to send in one go.  */
+#define SPILL_CHUNK (256 * 1024)
+
+/* The most data that all spills together may hold.  (A spill's file
+   only shrinks when it is closed.)  */
+#define SPILL_BUDGET (1024LL * 1024 * 1024)
+
+struct spill
+{
+  int fd;
+
+  /* The number of bytes written to FD.  */
+  off_t written;
+  /* The number of those sent.  */
+  off_t sent;
+};
+
+size_t spill_threshold;
+
+/* The sum of the spills' WRITTEN.  */
+static long long spill_total;
+
+void
+spill_init (size_t threshold)
+{
+  spill_threshold = threshold;
+}
+
+struct spill *
+spill_new (void)
+{
+  const char *dir = getenv ("TMPDIR");
+  if (! dir || ! *dir)
+    dir = P_tmpdir;
+
+  char template[strlen (dir) + sizeof ("/packproxy-XXXXXX")];
+  sprintf (template, "%s/packproxy-XXXXXX", dir);
+
+  int fd = mkstemp (template);
+  if (fd == -1)
+    {
+      log ("Failed to create %s: %s", template, strerror (errno));
+      return NULL;
+    }
+  /* The file disappears when it is closed.  */
+  unlink (template);
+
+  struct spill *spill = calloc (sizeof (*spill), 1);
+  if (! spill)
+    {
+      close (fd);
+      return NULL;
+    }
+
+  spill->fd = fd;
+  return spill;
+}
+
+int
+spill_write (struct spill *spill, struct evbuffer *buffer)
+{
+  while (EVBUFFER_LENGTH (buffer) > 0)
+    {
+      /* evbuffer_write drains what it writes.  */
+      int n = evbuffer_write (buffer, spill->fd);
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  log ("Writing to spill: %s", strerror (errno));
+	  return -1;
+	}
+
+      spill->written += n;
+      spill_total += n;
+    }
+
+  return 0;
+}
+
+off_t
+spill_pending (struct spill *spill)
+{
+  return spill->written - spill->sent;
+}
+
+ssize_t
+spill_send (struct spill *spill, int fd)
+{
+  size_t count = spill->written - spill->sent;
+  if (count > SPILL_CHUNK)
+    count = SPILL_CHUNK;
+
+#ifdef HAVE_SYS_SENDFILE_H
+  /* The data goes straight from the page cache to the socket.  */
+  off_t offset = spill->sent;
+  ssize_t n = sendfile (fd, spill->fd, &offset, count);
+#else
+  char buffer[16 * 1024];
+  if (count > sizeof (buffer))
+    count = sizeof (buffer);
+
+  ssize_t n = pread (spill->fd, buffer, count, spill->sent);
+  if (n > 0)
+    n = write (fd, buffer, n);
+#endif
+
+  if (n > 0)
+    spill->sent += n;
+
+  return n;
+}
+
+bool
+spill_over_budget (void)
+{
+  return spill_total >= SPILL_BUDGET;
+}
+
+void
+spill_free (struct spill *spill)
+{
+  spill_total -= spill->written;
+  close (spill->fd);
+  free (spill);
+}
@@ -0,0 +1,61 @@
+/* spill.h - Spilling response bodies to temporary files.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <sys/types.h>
+#include <event.h>
+#include <stdbool.h>
+
+/* A spill is an unlinked temporary file to which data is appended and
+   from which it is sent (in order) to a socket.  */
+struct spill;
+
+/* Responses whose buffered data reaches this many bytes are spilled.
+   0 disables spilling.  */
+extern size_t spill_threshold;
+
+/* Set the spill threshold to THRESHOLD bytes.  */
+extern void spill_init (size_t threshold);
+
+/* Create a spill.  Returns NULL on failure.  */
+extern struct spill *spill_new (void);
+
+/* Append the contents of BUFFER to SPILL and drain BUFFER.  Returns 0
+   on success and -1 on failure, in which case BUFFER holds the data
+   that could not be written.  */
+extern int spill_write (struct spill *spill, struct evbuffer *buffer);
+
+/* Whether the spills together hold so much data that no more should
+   be spilled.  */
+extern bool spill_over_budget (void);
+
+/* The number of bytes that were written to SPILL but not yet sent.  */
+extern off_t spill_pending (struct spill *spill);
+
+/* Send some of the pending data to the socket FD (without blocking).
+   Returns the number of bytes sent, 0 if the spill file ends before
+   the data that was written to it, or -1 on error (including
+   EAGAIN).  */
+extern ssize_t spill_send (struct spill *spill, int fd);
+
+/* Close SPILL, discarding any data that was not sent.  */
+extern void spill_free (struct spill *spill);
+
+#endif
@@ -0,0 +1,200 @@
+/* thread_pool.c - Running CPU-intensive jobs off the event loop.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <event.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "thread_pool.h"
+#include "log.h"
+
+/* The maximum number of threads.  */
+#define THREAD_POOL_MAX_THREADS 64
+/* The maximum number of jobs waiting for a thread.  If more are
+   submitted, they are refused: a client is better served by an
+   untransformed response than by one that arrives much later.  */
+#define THREAD_POOL_MAX_PENDING 64
+
+LIST_CLASS(thread_job, struct thread_job, node, true)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/* Jobs waiting for a thread.  Protected by LOCK.  */
+static struct thread_job_list pending;
+static int pending_count;
+/* Jobs that have run (or have been cancelled) and whose done
+   callback has to be called.  Protected by LOCK.  */
+static struct thread_job_list completed;
+
+static int thread_count;
+
+/* Worker threads write a byte to WAKEUP[1] when they complete a job.
+   The event loop listens on WAKEUP[0].  */
+static int wakeup[2] = { -1, -1 };
+static struct event wakeup_event;
+
+/* Add JOB to the list of completed jobs and wake up the event loop.
+   LOCK must be held.  */
+static void
+thread_pool_complete (struct thread_job *job)
+{
+  bool was_empty = ! thread_job_list_head (&completed);
+  thread_job_list_enqueue (&completed, job);
+  if (was_empty)
+    /* The event loop drains the pipe and the whole list when it wakes
+       up.  One byte is enough.  */
+    {
+      char c = 0;
+      while (write (wakeup[1], &c, 1) < 0 && errno == EINTR)
+	;
+    }
+}
+
+static void *
+thread_pool_worker (void *arg)
+{
+  pthread_mutex_lock (&lock);
+  for (;;)
+    {
+      struct thread_job *job = thread_job_list_dequeue (&pending);
+      if (! job)
+	{
+	  pthread_cond_wait (&cond, &lock);
+	  continue;
+	}
+      pending_count --;
+      job->queued = false;
+
+      pthread_mutex_unlock (&lock);
+      job->run (job);
+      pthread_mutex_lock (&lock);
+
+      thread_pool_complete (job);
+    }
+
+  return NULL;
+}
+
+/* Called from the event loop when a worker thread completed a
+   job.  */
+static void
+thread_pool_wakeup (int fd, short event, void *arg)
+{
+  char buffer[64];
+  while (read (fd, buffer, sizeof (buffer)) > 0)
+    ;
+
+  /* The done callbacks may submit or cancel other jobs.  Don't hold
+     the lock while calling them.  */
+  for (;;)
+    {
+      pthread_mutex_lock (&lock);
+      struct thread_job *job = thread_job_list_dequeue (&completed);
+      pthread_mutex_unlock (&lock);
+
+      if (! job)
+	break;
+      job->done (job);
+    }
+}
+
+void
+thread_pool_init (int threads)
+{
+  if (threads == 0)
+    threads = sysconf (_SC_NPROCESSORS_ONLN);
+  if (threads < 1)
+    threads = 1;
+  if (threads > THREAD_POOL_MAX_THREADS)
+    threads = THREAD_POOL_MAX_THREADS;
+
+  thread_job_list_init (&pending, "pending jobs");
+  thread_job_list_init (&completed, "completed jobs");
+
+  if (pipe (wakeup) < 0)
+    {
+      log ("Failed to create the thread pool's pipe; "
+	   "images will not be recompressed.");
+      return;
+    }
+  fcntl (wakeup[0], F_SETFL, O_NONBLOCK);
+  fcntl (wakeup[1], F_SETFL, O_NONBLOCK);
+
+  event_set (&wakeup_event, wakeup[0], EV_READ|EV_PERSIST,
+	     thread_pool_wakeup, NULL);
+  event_add (&wakeup_event, NULL);
+
+  for (thread_count = 0; thread_count < threads; thread_count ++)
+    {
+      pthread_t thread;
+      if (pthread_create (&thread, NULL, thread_pool_worker, NULL) != 0)
+	break;
+      pthread_detach (thread);
+    }
+
+  log ("Started %d worker threads.", thread_count);
+}
+
+bool
+thread_pool_submit (struct thread_job *job)
+{
+  if (thread_count == 0)
+    return false;
+
+  pthread_mutex_lock (&lock);
+  if (pending_count >= THREAD_POOL_MAX_PENDING)
+    {
+      pthread_mutex_unlock (&lock);
+      log ("Thread pool saturated (%d jobs pending).", pending_count);
+      return false;
+    }
+
+  job->cancelled = false;
+  job->queued = true;
+  thread_job_list_enqueue (&pending, job);
+  pending_count ++;
+  pthread_cond_signal (&cond);
+  pthread_mutex_unlock (&lock);
+
+  return true;
+}
+
+void
+thread_pool_cancel (struct thread_job *job)
+{
+  pthread_mutex_lock (&lock);
+  job->cancelled = true;
+
+  if (job->queued)
+    /* It has not yet started.  Skip it.  */
+    {
+      thread_job_list_unlink (&pending, job);
+      pending_count --;
+      job->queued = false;
+
+      thread_pool_complete (job);
+    }
+  pthread_mutex_unlock (&lock);
+}
@@ -0,0 +1,60 @@
+/* thread_pool.h - Running CPU-intensive jobs off the event loop.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdbool.h>
+
+#include "list.h"
+
+/* A job to run on a worker thread.  The caller embeds this in its own
+   data structure and fills in RUN and DONE.  */
+struct thread_job
+{
+  /* Called on a worker thread.  It must not touch any data shared
+     with the event loop.  */
+  void (*run) (struct thread_job *job);
+  /* Called from the event loop once RUN has returned.  This is also
+     called if the job was cancelled, in which case CANCELLED is true
+     and RUN may not have been called.  It should free the job.  */
+  void (*done) (struct thread_job *job);
+
+  /* Set by thread_pool_cancel.  */
+  bool cancelled;
+
+  /* Private.  */
+  bool queued;
+  struct list_node node;
+};
+
+/* Start THREADS worker threads.  If THREADS is 0, start one per
+   online processor.  Must be called after the event base has been
+   initialized.  */
+extern void thread_pool_init (int threads);
+
+/* Queue JOB.  Returns false if the queue is full (or the pool could
+   not be started), in which case the caller should do without.  */
+extern bool thread_pool_submit (struct thread_job *job);
+
+/* Cancel JOB.  If it has not yet started, it will not be run.  In any
+   case, its done callback is still called (from the event loop) with
+   JOB->CANCELLED set.  */
+extern void thread_pool_cancel (struct thread_job *job);
+
+#endif
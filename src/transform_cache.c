@@ -0,0 +1,225 @@
+/* transform_cache.c - A cache of transformed content.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <event.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/tree.h>
+
+#include "transform_cache.h"
+#include "list.h"
+#include "log.h"
+
+/* The maximum number of bytes of results to keep.  */
+#define TRANSFORM_CACHE_MAX (16 * 1024 * 1024)
+/* The largest result we keep.  */
+#define TRANSFORM_CACHE_OBJECT_MAX (TRANSFORM_CACHE_MAX / 8)
+
+struct transform_entry
+{
+  struct transform_key key;
+
+  /* The result or NULL, if the transformation failed.  */
+  struct evbuffer *result;
+  size_t size;
+
+  RB_ENTRY(transform_entry) tree_node;
+  struct list_node lru_node;
+};
+
+static int
+transform_entry_compare (struct transform_entry *a,
+			 struct transform_entry *b)
+{
+  return memcmp (&a->key, &b->key, sizeof (a->key));
+}
+
+RB_HEAD(transform_tree, transform_entry);
+RB_PROTOTYPE(transform_tree, transform_entry, tree_node,
+	     transform_entry_compare)
+RB_GENERATE(transform_tree, transform_entry, tree_node,
+	    transform_entry_compare)
+
+/* Most recently used first.  (Zero initialization is sufficient.)  */
+LIST_CLASS(transform_lru, struct transform_entry, lru_node, true)
+
+/* Protects the following.  */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct transform_tree transform_tree
+  = RB_INITIALIZER (&transform_tree);
+static struct transform_lru_list transform_lru;
+static size_t transform_cache_used;
+static int transform_cache_hits;
+static int transform_cache_misses;
+
+void
+transform_key_init (struct transform_key *key, struct evbuffer *source,
+		    int transform, int parameter, int parameter2)
+{
+  /* So that we can compare keys using memcmp.  */
+  memset (key, 0, sizeof (*key));
+
+  const unsigned char *data = EVBUFFER_DATA (source);
+  size_t length = EVBUFFER_LENGTH (source);
+
+  /* 64-bit FNV-1a.  Together with a CRC-32 and the length, collisions
+     between different images are not a practical concern.  */
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t i;
+  for (i = 0; i < length; i ++)
+    {
+      hash ^= data[i];
+      hash *= 0x100000001b3ULL;
+    }
+
+  key->hash = hash;
+  key->crc = crc32 (crc32 (0, Z_NULL, 0), data, length);
+  key->length = length;
+  key->transform = transform;
+  key->parameter = parameter;
+  key->parameter2 = parameter2;
+}
+
+/* Return a copy of SOURCE, or NULL if SOURCE is NULL or memory can't
+   be allocated.  */
+static struct evbuffer *
+transform_cache_copy (struct evbuffer *source)
+{
+  if (! source)
+    return NULL;
+
+  struct evbuffer *copy = evbuffer_new ();
+  if (! copy)
+    return NULL;
+  if (evbuffer_add (copy, EVBUFFER_DATA (source),
+		    EVBUFFER_LENGTH (source)) < 0)
+    {
+      evbuffer_free (copy);
+      return NULL;
+    }
+  return copy;
+}
+
+static void
+transform_cache_remove (struct transform_entry *entry)
+{
+  RB_REMOVE (transform_tree, &transform_tree, entry);
+  transform_lru_list_unlink (&transform_lru, entry);
+  transform_cache_used -= entry->size;
+
+  if (entry->result)
+    evbuffer_free (entry->result);
+  free (entry);
+}
+
+bool
+transform_cache_lookup (const struct transform_key *key,
+			struct evbuffer **result)
+{
+  /* Copy the key bytewise.  Struct assignment need not copy the
+     padding, which transform_entry_compare compares.  */
+  struct transform_entry k;
+  memcpy (&k.key, key, sizeof (k.key));
+
+  pthread_mutex_lock (&lock);
+
+  struct transform_entry *entry
+    = RB_FIND (transform_tree, &transform_tree, &k);
+  if (! entry)
+    {
+      transform_cache_misses ++;
+      pthread_mutex_unlock (&lock);
+      return false;
+    }
+
+  transform_cache_hits ++;
+
+  transform_lru_list_unlink (&transform_lru, entry);
+  transform_lru_list_push (&transform_lru, entry);
+
+  /* Copy while holding the lock: another thread may evict the
+     entry.  */
+  *result = transform_cache_copy (entry->result);
+  bool hit = ! entry->result || *result;
+
+  log ("Transform cache hit (%d hits, %d misses, %zd bytes)",
+       transform_cache_hits, transform_cache_misses, transform_cache_used);
+
+  pthread_mutex_unlock (&lock);
+
+  return hit;
+}
+
+void
+transform_cache_insert (const struct transform_key *key,
+			struct evbuffer *result)
+{
+  size_t size = sizeof (struct transform_entry)
+    + (result ? EVBUFFER_LENGTH (result) : 0);
+  if (size > TRANSFORM_CACHE_OBJECT_MAX)
+    return;
+
+  struct transform_entry *entry = calloc (sizeof (*entry), 1);
+  if (! entry)
+    return;
+
+  memcpy (&entry->key, key, sizeof (entry->key));
+  entry->size = size;
+  /* Copy outside of the lock.  */
+  if (result)
+    {
+      entry->result = transform_cache_copy (result);
+      if (! entry->result)
+	{
+	  free (entry);
+	  return;
+	}
+    }
+
+  pthread_mutex_lock (&lock);
+
+  struct transform_entry *old
+    = RB_FIND (transform_tree, &transform_tree, entry);
+  if (old)
+    /* Another thread transformed the same data concurrently.  */
+    transform_cache_remove (old);
+
+  while (transform_cache_used + entry->size > TRANSFORM_CACHE_MAX)
+    transform_cache_remove (transform_lru_list_tail (&transform_lru));
+
+  RB_INSERT (transform_tree, &transform_tree, entry);
+  transform_lru_list_push (&transform_lru, entry);
+  transform_cache_used += entry->size;
+
+  pthread_mutex_unlock (&lock);
+}
+
+void
+transform_cache_stats (int *hits, int *misses, size_t *bytes)
+{
+  pthread_mutex_lock (&lock);
+  *hits = transform_cache_hits;
+  *misses = transform_cache_misses;
+  *bytes = transform_cache_used;
+  pthread_mutex_unlock (&lock);
+}
@@ -0,0 +1,65 @@
+/* transform_cache.h - A cache of transformed content.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#ifndef TRANSFORM_CACHE_H
+#define TRANSFORM_CACHE_H
+
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <event.h>
+
+/* Identifies the result of a transformation: the digest of the
+   source and the transformation's parameters.  */
+struct transform_key
+{
+  uint64_t hash;
+  uint32_t crc;
+  uint32_t length;
+  /* The transformation and its parameters (e.g., the quality and the
+     maximum size).  */
+  int transform;
+  int parameter;
+  int parameter2;
+};
+
+/* Compute the key for transforming the data in SOURCE using TRANSFORM
+   with parameters PARAMETER and PARAMETER2.  */
+extern void transform_key_init (struct transform_key *key,
+				struct evbuffer *source,
+				int transform, int parameter, int parameter2);
+
+/* Look up the result of the transformation KEY.  Returns false on a
+   miss.  On a hit, returns true and stores a copy of the result in
+   *RESULT, which is NULL if the transformation failed.  The caller
+   owns *RESULT.
+
+   The transform cache may be used from any thread.  */
+extern bool transform_cache_lookup (const struct transform_key *key,
+				    struct evbuffer **result);
+
+/* Remember that the transformation KEY produced RESULT (NULL if it
+   failed).  RESULT is copied.  */
+extern void transform_cache_insert (const struct transform_key *key,
+				    struct evbuffer *result);
+
+/* Return the cache's counters.  */
+extern void transform_cache_stats (int *hits, int *misses, size_t *bytes);
+
+#endif
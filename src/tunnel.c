@@ -0,0 +1,494 @@
+/* tunnel.c - CONNECT tunnels.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <event.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tunnel.h"
+#include "user_conn.h"
+#include "http_response.h"
+#include "dns.h"
+#include "log.h"
+
+/* How long to wait for the origin server to accept the connection
+   (in seconds).  */
+#define TUNNEL_CONNECT_TIMEOUT 45
+
+/* The most data to move in one go.  This is also the default capacity
+   of a pipe.  */
+#define TUNNEL_CHUNK (64 * 1024)
+
+/* CONNECT is only allowed to the HTTPS port.  Otherwise, we'd be an
+   open relay for any protocol.  */
+#define TUNNEL_PORT_ALLOWED(port) ((port) == 443)
+
+/* One direction of a tunnel.  */
+struct tunnel_half
+{
+  struct tunnel *tunnel;
+
+  /* Data is read from FROM and written to TO.  */
+  int from;
+  int to;
+
+#ifdef HAVE_SPLICE
+  /* The pipe through which data is spliced and the number of bytes in
+     it.  */
+  int pipe[2];
+  int queued;
+#endif
+
+  /* Data that must be written before anything else (e.g., data that
+     the user sent after the CONNECT request).  Without splice, all
+     data passes through here.  */
+  struct evbuffer *pending;
+
+  /* Whether FROM has been closed.  */
+  bool eof;
+  /* Whether all data has been forwarded and TO has been shut down.  */
+  bool done;
+
+  struct event read_event;
+  struct event write_event;
+
+  /* The counters to which data that is read from FROM respectively
+     written to TO is added.  */
+  int *in_bytes;
+  int *out_bytes;
+};
+
+struct tunnel
+{
+  struct user_conn *user_conn;
+  enum http_version client_version;
+
+  unsigned short port;
+
+  /* The connection to the origin server.  */
+  int fd;
+  struct dns_waiter *dns_waiter;
+  struct event connect_event;
+
+  /* Whether the connection to the origin server was established.  */
+  bool established;
+  /* Whether data is being relayed.  */
+  bool running;
+
+  /* From the user to the origin server.  */
+  struct tunnel_half up;
+  /* From the origin server to the user.  */
+  struct tunnel_half down;
+
+  /* HOST:PORT.  */
+  char authority[0];
+};
+
+/* The origin server could not be reached.  Tell the user and free
+   TUNNEL.  */
+static void
+tunnel_connect_failed (struct tunnel *tunnel)
+{
+  struct user_conn *user_conn = tunnel->user_conn;
+
+  log ("Failed to establish tunnel to %s", tunnel->authority);
+
+  user_conn->tunnel = NULL;
+  http_response_new_error (user_conn, NULL, 502, "Bad gateway.", true,
+			   tunnel->authority);
+  tunnel_free (tunnel);
+}
+
+static void
+tunnel_connected (int fd, short what, void *arg)
+{
+  struct tunnel *tunnel = arg;
+
+  if (what == EV_TIMEOUT)
+    {
+      log ("Timeout connecting to %s", tunnel->authority);
+      tunnel_connect_failed (tunnel);
+      return;
+    }
+
+  int error;
+  socklen_t errsz = sizeof (error);
+  if (getsockopt (tunnel->fd, SOL_SOCKET, SO_ERROR, &error, &errsz) == -1)
+    error = errno;
+  if (error)
+    {
+      log ("Connecting to %s: %s", tunnel->authority, strerror (error));
+      tunnel_connect_failed (tunnel);
+      return;
+    }
+
+  struct http_response *response
+    = http_response_new (tunnel->user_conn, NULL, tunnel->authority);
+  if (! response)
+    {
+      tunnel_connect_failed (tunnel);
+      return;
+    }
+
+  log ("Established tunnel to %s", tunnel->authority);
+  tunnel->established = true;
+
+  evbuffer_add_printf (response->buffer,
+		       "HTTP/1.%d 200 Connection established\r\n\r\n",
+		       tunnel->client_version == HTTP_11 ? 1 : 0);
+  response->ready_to_go = true;
+  user_conn_kick (tunnel->user_conn);
+}
+
+/* Start connecting to ADDR.  */
+static int
+tunnel_connect (struct tunnel *tunnel, const struct in_addr *addr)
+{
+  tunnel->fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (tunnel->fd == -1)
+    return -1;
+
+  if (fcntl (tunnel->fd, F_SETFL, O_NONBLOCK) == -1)
+    goto fail;
+
+  struct sockaddr_in sin;
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (tunnel->port);
+  sin.sin_addr = *addr;
+
+  if (connect (tunnel->fd, (struct sockaddr *) &sin, sizeof (sin)) == -1
+      && errno != EINPROGRESS)
+    goto fail;
+
+  struct timeval tv = { TUNNEL_CONNECT_TIMEOUT, 0 };
+  event_set (&tunnel->connect_event, tunnel->fd, EV_WRITE,
+	     tunnel_connected, tunnel);
+  event_add (&tunnel->connect_event, &tv);
+
+  return 0;
+
+ fail:
+  close (tunnel->fd);
+  tunnel->fd = -1;
+  return -1;
+}
+
+static void
+tunnel_resolved (const struct in_addr *addr, void *arg)
+{
+  struct tunnel *tunnel = arg;
+
+  tunnel->dns_waiter = NULL;
+
+  if (! addr || tunnel_connect (tunnel, addr) == -1)
+    tunnel_connect_failed (tunnel);
+}
+
+struct tunnel *
+tunnel_new (struct user_conn *user_conn, const char *authority,
+	    enum http_version client_version, bool *forbidden)
+{
+  *forbidden = false;
+
+  const char *colon = strrchr (authority, ':');
+  if (! colon || colon == authority)
+    {
+      log ("CONNECT to %s: no port", authority);
+      *forbidden = true;
+      return NULL;
+    }
+
+  char *end;
+  long port = strtol (colon + 1, &end, 10);
+  if (*end || ! TUNNEL_PORT_ALLOWED (port))
+    {
+      log ("CONNECT to %s: port not allowed", authority);
+      *forbidden = true;
+      return NULL;
+    }
+
+  int authority_len = strlen (authority);
+  struct tunnel *tunnel = calloc (sizeof (*tunnel) + authority_len + 1, 1);
+  if (! tunnel)
+    return NULL;
+
+  tunnel->user_conn = user_conn;
+  tunnel->client_version = client_version;
+  tunnel->port = port;
+  tunnel->fd = -1;
+  memcpy (tunnel->authority, authority, authority_len + 1);
+
+  /* The host is the part before the colon.  It comes from the
+     client and may be arbitrarily long.  */
+  char *host = strndup (authority, colon - authority);
+  if (! host)
+    {
+      free (tunnel);
+      return NULL;
+    }
+
+  struct in_addr addr;
+  int ret = dns_resolve (host, &addr, tunnel_resolved, tunnel,
+			 &tunnel->dns_waiter);
+  free (host);
+  switch (ret)
+    {
+    case 0:
+      if (tunnel_connect (tunnel, &addr) == -1)
+	{
+	  free (tunnel);
+	  return NULL;
+	}
+      break;
+    case 1:
+      /* tunnel_resolved continues.  */
+      break;
+    default:
+      free (tunnel);
+      return NULL;
+    }
+
+  return tunnel;
+}
+
+/* The tunnel is done, either because both sides closed it or because
+   of an error.  Frees the user connection, which frees TUNNEL.  */
+static void
+tunnel_close (struct tunnel *tunnel)
+{
+  log ("Closing tunnel to %s", tunnel->authority);
+
+  user_conn_free (tunnel->user_conn);
+}
+
+enum pump_status
+  {
+    PUMP_PROGRESS,
+    PUMP_WAIT_READ,
+    PUMP_WAIT_WRITE,
+    PUMP_DONE,
+    PUMP_ERROR,
+  };
+
+/* Move some data from HALF->FROM to HALF->TO.  */
+static enum pump_status
+tunnel_half_pump_once (struct tunnel_half *half)
+{
+  ssize_t n;
+
+  if (EVBUFFER_LENGTH (half->pending) > 0)
+    {
+      n = evbuffer_write (half->pending, half->to);
+      if (n == -1)
+	return errno == EAGAIN ? PUMP_WAIT_WRITE : PUMP_ERROR;
+
+      *half->out_bytes += n;
+      return PUMP_PROGRESS;
+    }
+
+#ifdef HAVE_SPLICE
+  if (half->queued > 0)
+    {
+      n = splice (half->pipe[0], NULL, half->to, NULL, half->queued,
+		  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n == -1)
+	return errno == EAGAIN ? PUMP_WAIT_WRITE : PUMP_ERROR;
+
+      half->queued -= n;
+      *half->out_bytes += n;
+      return PUMP_PROGRESS;
+    }
+#endif
+
+  if (half->eof)
+    return PUMP_DONE;
+
+#ifdef HAVE_SPLICE
+  n = splice (half->from, NULL, half->pipe[1], NULL, TUNNEL_CHUNK,
+	      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n > 0)
+    half->queued += n;
+#else
+  n = evbuffer_read (half->pending, half->from, TUNNEL_CHUNK);
+#endif
+  if (n == -1)
+    return errno == EAGAIN ? PUMP_WAIT_READ : PUMP_ERROR;
+
+  if (n == 0)
+    half->eof = true;
+  else
+    *half->in_bytes += n;
+
+  return PUMP_PROGRESS;
+}
+
+/* Move as much data as possible from HALF->FROM to HALF->TO and then
+   wait for more.  Returns false if the tunnel failed.  */
+static bool
+tunnel_half_pump (struct tunnel_half *half)
+{
+  enum pump_status status;
+  while ((status = tunnel_half_pump_once (half)) == PUMP_PROGRESS)
+    ;
+
+  switch (status)
+    {
+    case PUMP_WAIT_READ:
+      event_add (&half->read_event, NULL);
+      return true;
+
+    case PUMP_WAIT_WRITE:
+      event_add (&half->write_event, NULL);
+      return true;
+
+    case PUMP_DONE:
+      /* Pass the end of file on.  */
+      shutdown (half->to, SHUT_WR);
+      half->done = true;
+      return true;
+
+    default:
+      log ("Tunnel to %s: %s", half->tunnel->authority, strerror (errno));
+      return false;
+    }
+}
+
+static void
+tunnel_half_cb (int fd, short what, void *arg)
+{
+  struct tunnel_half *half = arg;
+  struct tunnel *tunnel = half->tunnel;
+
+  if (! tunnel_half_pump (half)
+      || (tunnel->up.done && tunnel->down.done))
+    tunnel_close (tunnel);
+}
+
+static bool
+tunnel_half_init (struct tunnel_half *half, struct tunnel *tunnel,
+		  int from, int to, int *in_bytes, int *out_bytes)
+{
+  half->tunnel = tunnel;
+  half->from = from;
+  half->to = to;
+  half->in_bytes = in_bytes;
+  half->out_bytes = out_bytes;
+#ifdef HAVE_SPLICE
+  half->pipe[0] = half->pipe[1] = -1;
+#endif
+
+  event_set (&half->read_event, from, EV_READ, tunnel_half_cb, half);
+  event_set (&half->write_event, to, EV_WRITE, tunnel_half_cb, half);
+
+  half->pending = evbuffer_new ();
+  if (! half->pending)
+    return false;
+
+#ifdef HAVE_SPLICE
+  if (pipe (half->pipe) == -1)
+    return false;
+  fcntl (half->pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl (half->pipe[1], F_SETFL, O_NONBLOCK);
+#endif
+
+  return true;
+}
+
+static void
+tunnel_half_destroy (struct tunnel_half *half)
+{
+  if (! half->tunnel)
+    /* Never initialized.  */
+    return;
+
+  event_del (&half->read_event);
+  event_del (&half->write_event);
+
+  if (half->pending)
+    evbuffer_free (half->pending);
+
+#ifdef HAVE_SPLICE
+  if (half->pipe[0] != -1)
+    {
+      close (half->pipe[0]);
+      close (half->pipe[1]);
+    }
+#endif
+}
+
+void
+tunnel_start (struct tunnel *tunnel)
+{
+  if (! tunnel->established || tunnel->running)
+    return;
+
+  tunnel->running = true;
+
+  struct user_conn *user_conn = tunnel->user_conn;
+  bufferevent_disable (user_conn->event_source, EV_READ | EV_WRITE);
+
+  if (fcntl (user_conn->fd, F_SETFL, O_NONBLOCK) == -1
+      || ! tunnel_half_init (&tunnel->up, tunnel,
+			     user_conn->fd, tunnel->fd,
+			     &user_conn->client_in_bytes,
+			     &user_conn->server_out_bytes)
+      || ! tunnel_half_init (&tunnel->down, tunnel,
+			     tunnel->fd, user_conn->fd,
+			     &user_conn->server_in_bytes,
+			     &user_conn->client_out_bytes))
+    {
+      tunnel_close (tunnel);
+      return;
+    }
+
+  /* The user may have sent data after the CONNECT request.  */
+  struct evbuffer *input = user_conn->event_source->input;
+  user_conn->client_in_bytes += EVBUFFER_LENGTH (input);
+  evbuffer_add_buffer (tunnel->up.pending, input);
+
+  log ("Relaying data through tunnel to %s", tunnel->authority);
+
+  if (! tunnel_half_pump (&tunnel->up) || ! tunnel_half_pump (&tunnel->down)
+      || (tunnel->up.done && tunnel->down.done))
+    tunnel_close (tunnel);
+}
+
+void
+tunnel_free (struct tunnel *tunnel)
+{
+  if (tunnel->dns_waiter)
+    dns_cancel (tunnel->dns_waiter);
+
+  if (tunnel->fd != -1)
+    {
+      event_del (&tunnel->connect_event);
+      close (tunnel->fd);
+    }
+
+  tunnel_half_destroy (&tunnel->up);
+  tunnel_half_destroy (&tunnel->down);
+
+  free (tunnel);
+}
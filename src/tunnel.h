@@ -0,0 +1,61 @@
+/* tunnel.h - CONNECT tunnels.
+   Copyright (C) 2009 Neal H. Walfield <neal@gnu.org>.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Library General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.  */
+
+#ifndef TUNNEL_H
+#define TUNNEL_H
+
+#include <stdbool.h>
+
+#include "http_request.h"
+
+/* Forward.  */
+struct user_conn;
+
+/* A tunnel relays bytes between a user connection and an origin
+   server without interpreting them.  Where available, the data is
+   moved with splice(), i.e., it never leaves the kernel.  */
+struct tunnel;
+
+/* Start connecting to AUTHORITY (HOST:PORT) on behalf of USER_CONN,
+   which sent a CONNECT request using CLIENT_VERSION.  Only ports that
+   are commonly used for TLS are allowed.  Returns NULL if AUTHORITY is
+   not acceptable, in which case *FORBIDDEN is set to true, or if the
+   connection can't be started (e.g., memory is exhausted), in which
+   case *FORBIDDEN is set to false.
+
+   Once the connection is established, a response is queued on
+   USER_CONN.  If the connection can't be established, an error
+   response is queued, USER_CONN->TUNNEL is cleared and the tunnel is
+   freed.  */
+extern struct tunnel *tunnel_new (struct user_conn *user_conn,
+				  const char *authority,
+				  enum http_version client_version,
+				  bool *forbidden);
+
+/* Should be called when all responses queued on the user connection
+   before the tunnel have been sent.  If the tunnel is established,
+   starts relaying data.  The tunnel takes over the user connection's
+   file descriptor and frees the user connection when either side
+   closes the tunnel.  */
+extern void tunnel_start (struct tunnel *tunnel);
+
+/* Free TUNNEL, closing the connection to the origin server.  Does not
+   close the user connection.  */
+extern void tunnel_free (struct tunnel *tunnel);
+
+#endif
@@ -25,16 +25,452 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include "user_conn.h"
 #include "http_conn.h"
 #include "http_request.h"
 #include "http_response.h"
 #include "http_headers.h"
+#include "http_header_table.h"
 #include "log.h"
 #include "gzip.h"
 #include "jpeg.h"
 #include "png-support.h"
+#include "thread_pool.h"
+#include "cache.h"
+#include "transform_cache.h"
+#include "collapse.h"
+#include "request_parser.h"
+#include "tunnel.h"
+#include "spill.h"
+
+/* The maximum number of connections a user connection opens to the
+   same origin server.  Pipelined requests are spread over them.  */
+#define HTTP_CONNS_PER_HOST 4
+
+/* While a request body is being forwarded, at most this many bytes
+   are buffered from the client.  Once the buffer is full, we stop
+   reading until the origin server has taken some of it.  */
+#define REQUEST_BODY_BUFFER (64 * 1024)
+
+/* When more than USER_CONN_HIGH_WATER bytes of response data are
+   buffered for a user connection, we stop reading from the origin
+   servers until less than USER_CONN_LOW_WATER bytes are buffered.  */
+#define USER_CONN_HIGH_WATER (256 * 1024)
+#define USER_CONN_LOW_WATER (64 * 1024)
+
+/* When all user connections together buffer more than this many
+   bytes, reading from origin servers is throttled until half of that
+   is buffered.  */
+#define BUFFER_CEILING (64 * 1024 * 1024)
+
+/* Return the content coding that we use to compress responses to a
+   client that sent the headers CLIENT_HEADERS, or NULL, if it accepts
+   none that we support.  */
+static const char *
+client_content_coding (struct http_headers *client_headers)
+{
+  int we_prefer_deflate = 1;
+
+  const char *accept_encoding
+    = http_headers_get (client_headers, HEADER_ACCEPT_ENCODING);
+  if (! accept_encoding)
+    return NULL;
+
+  char *accept_deflate = strstr (accept_encoding, "deflate");
+  char *accept_gzip = strstr (accept_encoding, "gzip");
+  if (accept_deflate && (! accept_gzip || we_prefer_deflate))
+    return "deflate";
+  if (accept_gzip)
+    return "gzip";
+  return NULL;
+}
+
+/* Return the maximum width and height of the images that we send to
+   a client that sent the headers CLIENT_HEADERS, or 0 if there is no
+   limit.  If the client describes its screen using the Viewport-Width
+   and DPR client hints, the configured limit is lowered to the
+   screen's width in device pixels.  If HINTED is not NULL, sets
+   *HINTED to whether the hints lowered the limit.  */
+static int
+client_image_limit (struct http_headers *client_headers, bool *hinted)
+{
+  if (hinted)
+    *hinted = false;
+
+  int limit = jpeg_max_size;
+  if (! limit)
+    return 0;
+
+  const char *viewport_width
+    = http_headers_find (client_headers, "Viewport-Width");
+  if (! viewport_width)
+    return limit;
+
+  double width = strtod (viewport_width, NULL);
+  const char *dpr = http_headers_find (client_headers, "DPR");
+  if (dpr)
+    {
+      double ratio = strtod (dpr, NULL);
+      if (ratio >= 1 && ratio <= 4)
+	width *= ratio;
+    }
+
+  /* Ignore nonsense.  */
+  if (width >= 64 && width < limit)
+    {
+      limit = width;
+      if (hinted)
+	*hinted = true;
+    }
+
+  return limit;
+}
+
+/* Return the cache key for the resource RESOURCE on HOST requested by
+   a client that sent CLIENT_HEADERS.  As the response that we send
+   depends on the codings the client accepts and on the size of the
+   images that it wants, so does the key.  The result must be
+   freed.  */
+static char *
+cache_key (const char *host, const char *resource,
+	   struct http_headers *client_headers)
+{
+  const char *coding = client_content_coding (client_headers);
+  bool hinted;
+  int limit = client_image_limit (client_headers, &hinted);
+
+  char *key;
+  int ret;
+  if (hinted)
+    ret = asprintf (&key, "%s %d http://%s%s",
+		    coding ?: "identity", limit, host, resource);
+  else
+    ret = asprintf (&key, "%s http://%s%s",
+		    coding ?: "identity", host, resource);
+  if (ret < 0)
+    return NULL;
+  return key;
+}
+
+/* Fill in RESPONSE, for a client that speaks CLIENT_VERSION, from the
+   cached response ENTRY and send it.  */
+static void
+http_response_fill_cached (struct http_response *response,
+			   enum http_version client_version,
+			   struct cache_entry *entry)
+{
+  struct user_conn *user_conn = response->message.user_conn;
+  struct evbuffer *message = response->buffer;
+
+  evbuffer_add_printf (message, "HTTP/1.%d %d %s\r\n",
+		       client_version == HTTP_11 ? 1 : 0,
+		       entry->status_code, entry->status_string);
+  evbuffer_add (message, EVBUFFER_DATA (entry->headers),
+		EVBUFFER_LENGTH (entry->headers));
+  evbuffer_add_printf (message, "Age: %d\r\n",
+		       entry->age + (int) (time (NULL) - entry->stored));
+
+  if (! (user_conn->event_source->enabled & EV_READ))
+    /* The user closed the connection.  Signal that this is the last
+       transfer.  */
+    evbuffer_add_printf (message, "Connection: close\r\n");
+
+  evbuffer_add_printf (message, "Content-Length: %zu\r\n\r\n",
+		       EVBUFFER_LENGTH (entry->body));
+  evbuffer_add (message, EVBUFFER_DATA (entry->body),
+		EVBUFFER_LENGTH (entry->body));
+
+  user_conn->cache_hits ++;
+
+  response->ready_to_go = true;
+  user_conn_kick (user_conn);
+}
+
+/* Queue the cached response ENTRY for the client USER_CONN, which
+   speaks CLIENT_VERSION.  Returns false if the response could not be
+   allocated.  */
+static bool
+user_conn_send_cached (struct user_conn *user_conn,
+		       enum http_version client_version,
+		       struct cache_entry *entry, const char *key)
+{
+  struct http_response *response = http_response_new (user_conn, NULL, key);
+  if (! response)
+    return false;
+
+  http_response_fill_cached (response, client_version, entry);
+  return true;
+}
+
+/* Forward the METHOD request for RESOURCE on HOST from the client
+   CONN to the origin server.  If METHOD has a body, its framing is in
+   CONN->BODY.  Takes ownership of CLIENT_HEADERS.  Returns the request
+   or NULL on failure.  */
+static struct http_request *
+user_conn_forward (struct user_conn *conn, const char *host,
+		   const char *resource, enum http_method method,
+		   enum http_version client_version,
+		   struct http_headers *client_headers)
+{
+  /* Try to reuse an existing server connection.  evhttp only sends a
+     request once the response to the previous one has arrived.  To
+     fetch pipelined requests in parallel, prefer an idle connection
+     and otherwise open another one.  Once we have HTTP_CONNS_PER_HOST
+     connections to HOST, queue on the least busy.  The responses are
+     still delivered in order as CONN->MESSAGES is in request
+     order.  */
+  struct http_conn *http_conn = NULL;
+  struct http_conn *least_busy = NULL;
+  int least_busy_count = 0;
+  int count = 0;
+  struct http_conn *c;
+  for (c = user_conn_http_conn_list_head (&conn->http_conns);
+       c; c = user_conn_http_conn_list_next (c))
+    if (! c->close && strcmp (host, c->host) == 0)
+      {
+	int requests = http_conn_http_request_list_count (&c->requests);
+	if (requests == 0)
+	  {
+	    http_conn = c;
+	    break;
+	  }
+
+	if (! least_busy || requests < least_busy_count)
+	  {
+	    least_busy = c;
+	    least_busy_count = requests;
+	  }
+	count ++;
+      }
+
+  if (! http_conn && count >= HTTP_CONNS_PER_HOST)
+    http_conn = least_busy;
+
+  if (! http_conn)
+    /* Allocate an http connection.  */
+    {
+      http_conn = http_conn_new (host, conn);
+      if (! http_conn)
+	{
+	  log ("Failed to create http connection.");
+	  http_headers_free (client_headers);
+	  return NULL;
+	}
+    }
+
+  /* Forward the request.  */
+
+  /* Add the appropriate headers.  They are written straight into the
+     buffer from which the request is sent.  */
+  struct evbuffer *request_headers = evbuffer_new ();
+  if (! request_headers)
+    {
+      log ("Failed to allocate request headers.");
+      http_headers_free (client_headers);
+      return NULL;
+    }
+
+  /* A chunked body is forwarded as is.  Transfer-Encoding is a
+     hop-by-hop header so we add it ourselves.  */
+  bool chunked = (method == HTTP_POST || method == HTTP_PUT)
+    && conn->body.chunked;
+  if (chunked)
+    evbuffer_add_printf (request_headers, "Transfer-Encoding: chunked\r\n");
+
+  /* Forward most client provided headers, e.g., don't forward
+     hop-by-hop headers.  */
+  struct http_header *h;
+  for (h = client_headers->head; h; h = h->next)
+    if (h->id == HEADER_CONTENT_LENGTH && chunked)
+      /* The chunked coding takes precedence.  */
+      log ("Not forwarding: %s: %s", h->key, h->value);
+    else if (! (http_header_flags (h->id)
+		& (HEADER_HOP_BY_HOP | HEADER_REQUEST_STRIP)))
+      {
+	http_header_write (request_headers, h);
+	log ("Forwarding: %s: %s", h->key, h->value);
+      }
+    else
+      log ("Not forwarding: %s: %s", h->key, h->value);
+
+  struct http_request *request
+    = http_request_new (conn, http_conn,
+			resource, method, request_headers,
+			client_version, client_headers);
+  if (! request)
+    {
+      log ("Failed to create http request.");
+      http_headers_free (client_headers);
+      if (! http_conn_http_request_list_head (&http_conn->requests))
+	/* Don't abort other requests queued on a shared connection.  */
+	http_conn_free (http_conn);
+    }
+
+  log ("http conn: %p; request: %p", http_conn, request);
+
+  return request;
+}
+
+/* Queue a response for the client CONN that waits for the fetch
+   COLLAPSE of the same resource (whose cache key is KEY).  On success,
+   takes ownership of CLIENT_HEADERS and returns true.  */
+static bool
+user_conn_wait (struct user_conn *conn, struct collapse *collapse,
+		const char *key, const char *host, const char *resource,
+		enum http_version client_version,
+		struct http_headers *client_headers)
+{
+  struct http_response *response = http_response_new (conn, NULL, key);
+  if (! response)
+    return false;
+
+  struct collapse_waiter *waiter
+    = collapse_wait (collapse, response, client_version, client_headers,
+		     host, resource);
+  if (! waiter)
+    {
+      http_response_free (response);
+      return false;
+    }
+
+  response->waiter = waiter;
+  return true;
+}
+
+void
+collapse_waiter_done_cb (struct collapse_waiter *waiter,
+			 struct cache_entry *entry)
+{
+  struct http_response *response = waiter->response;
+  struct user_conn *user_conn = response->message.user_conn;
+
+  response->waiter = NULL;
+
+  if (user_conn->dead)
+    /* The response is about to be freed.  */
+    return;
+
+  if (entry && cache_entry_matches (entry, waiter->client_headers))
+    {
+      log ("Collapsed request for %s answered", response->origin);
+      http_response_fill_cached (response, waiter->client_version, entry);
+      return;
+    }
+
+  /* We can't use the other request's response.  Fetch the resource
+     ourselves.  */
+  log ("Collapsed request for %s: fetching", response->origin);
+
+  struct http_headers *client_headers = waiter->client_headers;
+  waiter->client_headers = NULL;
+  struct http_request *request
+    = user_conn_forward (user_conn, waiter->host, waiter->resource,
+			 HTTP_GET, waiter->client_version, client_headers);
+  if (! request)
+    /* Give up: close the connection.  */
+    {
+      bufferevent_disable (user_conn->event_source, EV_READ);
+      response->ready_to_go = true;
+      user_conn_kick (user_conn);
+      return;
+    }
+
+  /* The request takes the response's place in the queue.  */
+  http_message_destroy (&request->message);
+  user_conn_http_message_list_insert_after (&user_conn->messages,
+					    &request->message,
+					    &response->message);
+  http_response_free (response);
+}
+
+/* The body of the request being received is complete or can't be
+   delimited.  */
+static void
+user_conn_body_done (struct user_conn *conn)
+{
+  conn->body.active = false;
+  conn->body_request = NULL;
+
+  /* Stop limiting how much is read.  */
+  bufferevent_setwatermark (conn->event_source, EV_READ, 0, 0);
+
+  if (conn->close_after_body)
+    {
+      conn->close_after_body = false;
+      bufferevent_disable (conn->event_source, EV_READ);
+    }
+}
+
+/* Move as much of the body of the request being received from CONN's
+   input buffer to OUTPUT (or, if OUTPUT is NULL, discard it) as is
+   available, but at most REQUEST_BODY_BUFFER bytes.  Returns whether
+   the body is complete.  */
+static bool
+user_conn_body_take (struct user_conn *conn, struct evbuffer *output)
+{
+  struct evbuffer *input = conn->event_source->input;
+
+  int len = EVBUFFER_LENGTH (input);
+  if (len > REQUEST_BODY_BUFFER)
+    len = REQUEST_BODY_BUFFER;
+
+  int n = request_body_scan (&conn->body,
+			     (char *) EVBUFFER_DATA (input), len);
+  if (n == -1)
+    /* We can't tell where the next request starts.  Close the
+       connection once the pending responses have been sent.  */
+    {
+      log ("Malformed chunked request body on user conn %p", conn);
+      bufferevent_disable (conn->event_source, EV_READ);
+      evbuffer_drain (input, EVBUFFER_LENGTH (input));
+      user_conn_body_done (conn);
+      return true;
+    }
+
+  conn->client_in_bytes += n;
+  if (output)
+    {
+      conn->server_out_bytes += n;
+      evbuffer_add (output, EVBUFFER_DATA (input), n);
+    }
+  evbuffer_drain (input, n);
+
+  if (conn->body.active)
+    return false;
+
+  user_conn_body_done (conn);
+  return true;
+}
+
+bool
+http_request_body_cb (struct http_request *request, struct evbuffer *output)
+{
+  struct user_conn *conn = request->http_conn->user_conn;
+
+  if (! user_conn_body_take (conn, output))
+    return false;
+
+  /* Any requests that followed the body are parsed from the event
+     loop: we were called by the downloader.  */
+  struct timeval tv = { 0, 0 };
+  evtimer_add (&conn->resume_event, &tv);
+  return true;
+}
+
+void
+user_conn_drop_body (struct user_conn *conn)
+{
+  conn->body_request = NULL;
+
+  if (! conn->dead)
+    {
+      struct timeval tv = { 0, 0 };
+      evtimer_add (&conn->resume_event, &tv);
+    }
+}
 
 static void
 user_conn_error (struct bufferevent *source, short what, void *arg)
@@ -74,6 +510,8 @@ user_conn_input_available (struct bufferevent *source, void *arg)
   struct user_conn *conn = arg;
   assert (! conn->dead);
   assert (source == conn->event_source);
+  /* Reading is disabled when a tunnel is requested.  */
+  assert (! conn->tunnel);
 
 #define DEFAULT_ERROR 501
 #define DEFAULT_ERROR_STRING "Unsupported method."
@@ -88,83 +526,93 @@ user_conn_input_available (struct bufferevent *source, void *arg)
 	http_response_new_error (conn, NULL, send_error, send_error_string,
 				 true, NULL);
       /* Drain the last read input.  */
-      evbuffer_drain (source->input, do_drain);
+      if (do_drain)
+	{
+	  evbuffer_drain (source->input, do_drain);
+	  request_parser_reset (&conn->parser);
+	  do_drain = 0;
+	}
+
+      if (conn->body.active)
+	/* The body of the previous request is being received.  */
+	{
+	  if (conn->body_request)
+	    /* The origin connection pulls it.  */
+	    {
+	      http_request_body_available (conn->body_request);
+	      break;
+	    }
+
+	  if (! user_conn_body_take (conn, NULL))
+	    break;
+	}
 
       send_error = DEFAULT_ERROR;
       send_error_string = DEFAULT_ERROR_STRING;
 
 
-      /* See if we have a pending command.  */
+      /* See if we have a complete request.  The parser resumes where
+	 it left off the last time.  */
       char *command = (char *) EVBUFFER_DATA (source->input);
-
-      /* A command ends with the following string.  */
-#define EOC "\r\n\r\n"
-#define EOC_LEN (sizeof (EOC) - 1)
-      char *eoc = memmem (command, EVBUFFER_LENGTH (source->input),
-			  EOC, EOC_LEN);
-      if (! eoc)
+      enum request_parser_status status
+	= request_parser_parse (&conn->parser, command,
+				EVBUFFER_LENGTH (source->input));
+      if (status == REQUEST_INCOMPLETE)
 	/* No end of command => no command ready to process.  */
 	break;
 
+      if (status == REQUEST_TOO_LARGE)
+	/* Don't buffer the request without bound.  Give up on the
+	   connection.  */
+	{
+	  log ("Request exceeds %d bytes", REQUEST_MAX);
+	  http_response_new_error (conn, NULL, 431, "Request too large.",
+				   true, NULL);
+	  evbuffer_drain (source->input, EVBUFFER_LENGTH (source->input));
+	  request_parser_reset (&conn->parser);
+	  return;
+	}
+
       /* We got a whole command.  */
 
       conn->request_count ++;
 
-      int eoc_offset = (intptr_t) eoc - (intptr_t) command;
-      do_drain = eoc_offset + EOC_LEN;
-
-      /* NUL terminate the command by replacing the first terminating
-	 character with a \0.  */
-      *eoc = 0;
-
-      log (BOLD ("request: ") " on user conn %p: `%s'",
-	   conn, command);
-
-      /* Process the command.  */
+      do_drain = conn->parser.length;
 
-      /* Some clients gratuitous \r\n or \n's at the end of a command.
-	 Don't be confused.  */
-      while (strncmp (command, "\r\n", 2) == 0)
-	command += 2;
-      while (*command == '\n')
-	command ++;
-
-      /* Extract the method.  */
-
-      /* Ignore any leading white space.  */
-      while (*command == ' ')
-	command ++;
-      const char *verb = command;
-      const char *verb_end = strchr (command, ' ');
-      if (! verb_end)
+      if (status == REQUEST_BAD)
 	{
-	  log ("Garbage request (%s)", command);
+	  log ("Garbage request (%.*s)", do_drain, command);
 	  continue;
 	}
 
-      int verb_len = (intptr_t) verb_end - (intptr_t) verb;
+      /* NUL terminate the parts of the request line by replacing the
+	 character following each.  */
+      char *verb = command + conn->parser.method.offset;
+      int verb_len = conn->parser.method.len;
+      verb[verb_len] = 0;
+      char *url = command + conn->parser.uri.offset;
+      url[conn->parser.uri.len] = 0;
+      char *version = command + conn->parser.version.offset;
+      version[conn->parser.version.len] = 0;
 
-      const char *url = verb_end + 1;
-      while (*url == ' ')
-	url ++;
+      log (BOLD ("request: ") " on user conn %p: `%s %s %s'",
+	   conn, verb, url, version);
 
-      char *url_end = strchr (url, ' ');
-      if (! url_end)
-	{
-	  log ("Request (%s) lacks a URL!", command);
-	  continue;
-	}
+      /* Process the command.  */
 
       enum http_method method = -1;
+      bool connect = false;
       if (verb_len == 3 && memcmp (verb, "GET", 3) == 0)
 	method = HTTP_GET;
-#if 0
+      else if (verb_len == 7 && memcmp (verb, "CONNECT", 7) == 0)
+	connect = true;
       else if (verb_len == 4 && memcmp (verb, "POST", 4) == 0)
 	method = HTTP_POST;
-      else if (verb_len == 4 && memcmp (verb, "HEAD", 4) == 0)
-	method = HTTP_HEAD;
       else if (verb_len == 3 && memcmp (verb, "PUT", 3) == 0)
 	method = HTTP_PUT;
+#if 0
+      else if (verb_len == 4 && memcmp (verb, "HEAD", 4) == 0)
+	method = HTTP_HEAD;
       else if (verb_len == 7 && memcmp (verb, "DELETE", 7) == 0)
 	method = HTTP_DELETE;
       else if (verb_len == 7 && memcmp (verb, "OPTIONS", 7) == 0)
@@ -174,120 +622,129 @@ user_conn_input_available (struct bufferevent *source, void *arg)
 #endif
       else
 	{
-	  log ("Request (%s) does not include supported verb!", command);
+	  log ("Request (%s) does not include supported verb!", verb);
 	  continue;
 	}
 
-      char *version = url_end + 1;
-      while (*version == ' ')
-	version ++;
-
       enum http_version client_version;
-      if (strncmp (version, "HTTP/1.1", 8) == 0)
+      if (strcmp (version, "HTTP/1.1") == 0)
 	client_version = HTTP_11;
-      else if (strncmp (version, "HTTP/1.0", 8) == 0)
+      else if (strcmp (version, "HTTP/1.0") == 0)
 	client_version = HTTP_10;
       else
 	{
-	  log ("Request (%s): unknown http version.", command);
+	  log ("Request (%s): unknown http version.", url);
 	  continue;
 	}
 
-      char *request_end = strchr (url, '\n');
-      if (! request_end)
+      if (connect)
+	/* The URL is the authority (HOST:PORT).  Whatever follows the
+	   request is for the origin server.  */
 	{
-	  log ("Request (%s): badly formed request.", command);
-	  continue;
+	  bool forbidden;
+	  conn->tunnel = tunnel_new (conn, url, client_version, &forbidden);
+	  if (! conn->tunnel && forbidden)
+	    http_response_new_error (conn, NULL, 403, "Tunnel not allowed.",
+				     true, url);
+	  else if (! conn->tunnel)
+	    http_response_new_error (conn, NULL, 502, "Bad gateway.",
+				     true, url);
+
+	  bufferevent_disable (conn->event_source, EV_READ);
+	  evbuffer_drain (source->input, do_drain);
+	  request_parser_reset (&conn->parser);
+	  break;
 	}
 
-      /* Parse the headers.  */
-      char *headers = request_end + 1;
-      struct http_headers *client_headers = http_headers_new (headers);
+      struct http_headers *client_headers = conn->parser.headers;
 
       /* Extract the host.  */
-      const char *host = http_headers_find (client_headers, "Host");
+      const char *host = http_headers_get (client_headers, HEADER_HOST);
       if (! host)
 	{
-	  log ("Request (%s) does not include a Host field (%.10s...)!",
-	       command, host);
+	  log ("Request (%s) does not include a Host field!", url);
 	  continue;
 	}
 
-      /* Try to reuse an existing server connection.  */
-      struct http_conn *http_conn;
-      for (http_conn = user_conn_http_conn_list_head (&conn->http_conns);
-	   http_conn;
-	   http_conn = user_conn_http_conn_list_next (http_conn))
-	if (! http_conn->close && strcmp (host, http_conn->host) == 0)
-	  break;
+      /* We own the headers now.  */
+      conn->parser.headers = NULL;
 
-      if (! http_conn)
-	/* Allocate an http connection.  */
+      if (method == HTTP_POST || method == HTTP_PUT)
+	/* Find out how the body is delimited.  */
 	{
-	  http_conn = http_conn_new (host, conn);
-	  if (! http_conn)
+	  const char *transfer_encoding
+	    = http_headers_get (client_headers, HEADER_TRANSFER_ENCODING);
+	  const char *content_length
+	    = http_headers_get (client_headers, HEADER_CONTENT_LENGTH);
+
+	  const char *error = NULL;
+	  if (transfer_encoding
+	      && strcasecmp (transfer_encoding, "identity") != 0)
 	    {
-	      log ("Failed to create http connection.");
-	      continue;
+	      if (strcasecmp (transfer_encoding, "chunked") == 0)
+		request_body_init (&conn->body, true, 0);
+	      else
+		error = "Unsupported transfer coding.";
 	    }
-	}
+	  else if (content_length)
+	    {
+	      char *end;
+	      long long length = strtoll (content_length, &end, 10);
+	      if (end == content_length || *end || length < 0)
+		error = "Bad content length.";
+	      else
+		request_body_init (&conn->body, false, length);
+	    }
+	  else
+	    request_body_init (&conn->body, false, 0);
 
-      /* Forward the request.  */
-      
-      /* Add the appropriate headers.  */
-      struct http_headers *request_headers = http_headers_new (NULL);
+	  if (error)
+	    /* We can't tell where the next request starts.  Give up on
+	       the connection.  */
+	    {
+	      log ("Request (%s): %s", url, error);
+	      http_headers_free (client_headers);
+	      http_response_new_error (conn, NULL, 400, error, true, url);
+	      evbuffer_drain (source->input, EVBUFFER_LENGTH (source->input));
+	      request_parser_reset (&conn->parser);
+	      return;
+	    }
 
-      /* Forward most client provided headers, e.g., don't forward
-	 hop-by-hop headers.  */
-      struct http_header *h;
-      for (h = client_headers->head; h; h = h->next)
-	if (strcmp (h->key, "Connection") == 0)
-	  {
-	    if (strcmp (h->value, "close") == 0)
-	      bufferevent_disable (conn->event_source, EV_READ);
-	  }
-	else if (strcmp (h->key, "Keep-Alive") != 0
-		 && strcmp (h->key, "Public") != 0
-		 && strcmp (h->key, "Proxy-Authenticate") != 0
-		 && strcmp (h->key, "Transfer-Encoding") != 0
-		 && strcmp (h->key, "Upgrade") != 0
-
-		 && strcmp (h->key, "Accept-Encoding") != 0
-		 && strcmp (h->key, "Range") != 0
-		 && strcmp (h->key, "Proxy-Connection") != 0
-		 && strcmp (h->key, "Proxy-Authorization") != 0)
-	  {
-	    http_headers_add (request_headers, h->key, h->value);
-	    log ("Forwarding: %s: %s", h->key, h->value);
-	  }
-	else
-	  log ("Not forwarding: %s: %s", h->key, h->value);
+	  if (conn->body.active)
+	    /* Don't buffer more of the body than the origin server
+	       takes.  */
+	    bufferevent_setwatermark (conn->event_source, EV_READ,
+				      0, REQUEST_BODY_BUFFER);
+	}
 
+      bool persistent;
       const char *connection
-	= http_headers_find (client_headers, "Connection");
+	= http_headers_get (client_headers, HEADER_CONNECTION);
       if (client_version == HTTP_10)
 	/* HTTP 1.0 connections are not persistent by default.  */
 	{
 	  const char *keep_alive
-	    = http_headers_find (client_headers, "Keep-Alive");
-	  if (connection && strcmp (connection, "Keep-Alive") == 0
-	      && keep_alive)
-	    /* We can use a persistent connection.  */;
-	  else
-	    bufferevent_disable (conn->event_source, EV_READ);
+	    = http_headers_get (client_headers, HEADER_KEEP_ALIVE);
+	  persistent = connection && strcmp (connection, "Keep-Alive") == 0
+	    && keep_alive;
 	}
       else
 	/* HTTP 1.1 connections are persistent by default.  See if the
 	   client overrode it.  */
+	persistent = ! (connection && strcmp (connection, "close") == 0);
+
+      if (! persistent)
 	{
-	  if (connection && strcmp (connection, "close") == 0)
+	  if (conn->body.active)
+	    /* We still have to read the body.  */
+	    conn->close_after_body = true;
+	  else
 	    bufferevent_disable (conn->event_source, EV_READ);
 	}
 
       /* We can't send an absolute URI to an HTTP 1.0 server.
 	 However, 1.1 servers will accept Host + resource.  Do that by
 	 default.  */
-      *url_end = 0;
       const char *resource = url;
       if (strncasecmp (url, "http://", 7) == 0
 	  && strncasecmp (url + 7, host, strlen (host)) == 0)
@@ -299,28 +756,204 @@ user_conn_input_available (struct bufferevent *source, void *arg)
 	    resource = url;
 	}
 
-      struct http_request *request
-	= http_request_new (conn, http_conn,
-			    resource, HTTP_GET, request_headers, NULL,
-			    client_version, client_headers);
-      if (! request)
+      /* See if we can answer the request from the cache.  */
+      struct collapse *collapse = NULL;
+      char *key = method == HTTP_GET
+	? cache_key (host, resource, client_headers) : NULL;
+      if (key)
+	{
+	  struct cache_entry *entry = cache_lookup (key, client_headers);
+	  bool served = entry && user_conn_send_cached (conn, client_version,
+							entry, key);
+	  if (served)
+	    {
+	      log ("Cache hit: %s", key);
+	      http_headers_free (client_headers);
+	    }
+	  else if (cache_request_shareable (client_headers))
+	    /* If the resource is already being fetched, wait for that
+	       response instead of fetching it again.  Otherwise, let
+	       others wait for our response.  */
+	    {
+	      collapse = collapse_find (key);
+	      if (collapse)
+		{
+		  served = user_conn_wait (conn, collapse, key, host, resource,
+					   client_version, client_headers);
+		  collapse = NULL;
+		}
+	      else
+		collapse = collapse_begin (key);
+	    }
+	  free (key);
+
+	  if (served)
+	    {
+	      send_error = 0;
+	      continue;
+	    }
+	}
+
+      if (conn->body.active)
+	/* The body follows the request in the input buffer.  Drain the
+	   request now: the origin connection may start taking the body
+	   right away.  */
 	{
-	  log ("Failed to create http request.");
-	  http_conn_free (http_conn);
+	  resource = strdupa (resource);
+	  evbuffer_drain (source->input, do_drain);
+	  request_parser_reset (&conn->parser);
+	  do_drain = 0;
 	}
 
-      log ("http conn: %p; request: %p", http_conn, request);
+      struct http_request *request
+	= user_conn_forward (conn, host, resource, method, client_version,
+			     client_headers);
+      if (request)
+	request->collapse = collapse;
+      else if (collapse)
+	collapse_end (collapse, NULL);
+
+      if (conn->body.active)
+	/* If the request failed, the body is discarded.  */
+	conn->body_request = request;
 
       send_error = 0;
     }
 }
 
+/* A request body was received.  Parse any requests that followed
+   it.  */
+static void
+user_conn_resume (int fd, short event, void *arg)
+{
+  struct user_conn *conn = arg;
+
+  user_conn_input_available (conn->event_source, conn);
+}
+
 /* Forward.  */
 static void user_conn_output_buffer_drained (struct bufferevent *output,
 					     void *arg);
 
+/* Forward.  */
+static size_t recompress_buffered (struct http_request *request);
+
 static struct user_conn_list user_conns;
 
+/* The sum of the user connections' BUFFERED.  */
+static long long buffered_total;
+/* Whether BUFFERED_TOTAL exceeded BUFFER_CEILING (and did not yet drop
+   below half of it).  */
+static bool memory_pressure;
+
+/* REQUEST's origin connection is being paused because its client
+   does not keep up.  Identical requests from other clients must not
+   wait for this client: let them fetch the resource themselves.  */
+static void
+http_request_release_collapse (struct http_request *request)
+{
+  struct collapse **collapse = &request->collapse;
+  if (! *collapse && request->response)
+    collapse = &request->response->collapse;
+
+  if (*collapse)
+    {
+      collapse_end (*collapse, NULL);
+      *collapse = NULL;
+    }
+}
+
+/* Update CONN->BUFFERED and pause or resume reading from CONN's http
+   connections accordingly.  */
+static void
+user_conn_throttle_one (struct user_conn *conn)
+{
+  if (conn->dead)
+    return;
+
+  /* The data in the output buffer drains at the client's speed.  */
+  int out = EVBUFFER_LENGTH (conn->event_source->output);
+
+  int buffered = out;
+  struct http_message *message;
+  for (message = user_conn_http_message_list_head (&conn->messages);
+       message; message = user_conn_http_message_list_next (message))
+    if (message->type == HTTP_RESPONSE)
+      buffered
+	+= EVBUFFER_LENGTH (((struct http_response *) message)->buffer);
+    else
+      {
+	struct http_request *request = (struct http_request *) message;
+	if (request->evhttp_request)
+	  /* A body that is buffered so that it can be transformed.  */
+	  buffered += EVBUFFER_LENGTH (request->evhttp_request->input_buffer);
+	if (request->recompress)
+	  buffered += recompress_buffered (request);
+      }
+
+  buffered_total += buffered - conn->buffered;
+  conn->buffered = buffered;
+
+  struct http_message *head
+    = user_conn_http_message_list_head (&conn->messages);
+  struct http_conn *http_conn;
+  for (http_conn = user_conn_http_conn_list_head (&conn->http_conns);
+       http_conn; http_conn = user_conn_http_conn_list_next (http_conn))
+    {
+      struct http_request *request
+	= http_conn_http_request_list_head (&http_conn->requests);
+
+      bool pause = false;
+      if (! request)
+	;
+      else if (head == &request->message
+	       || (request->response && head == &request->response->message))
+	/* The response at the head of the queue is sent as it arrives.
+	   Only the client's speed matters.  (Don't stall it on the
+	   data of the responses that wait for it.)  */
+	pause = out > (memory_pressure
+		       ? USER_CONN_LOW_WATER : USER_CONN_HIGH_WATER)
+	  || (http_conn->paused && out >= USER_CONN_LOW_WATER);
+      else if (spill_threshold && request->response
+	       && ! spill_over_budget ())
+	/* The response waits for those ahead of it, but whatever does
+	   not fit in memory is spilled to disk.  */
+	pause = memory_pressure;
+      else
+	/* The response waits for those ahead of it.  */
+	pause = memory_pressure || buffered > USER_CONN_HIGH_WATER
+	  || (http_conn->paused && buffered >= USER_CONN_LOW_WATER);
+
+      if (pause)
+	http_request_release_collapse (request);
+      http_conn_pause (http_conn, pause);
+    }
+}
+
+/* Called whenever the amount of data that CONN buffers may have
+   changed.  */
+static void
+user_conn_throttle (struct user_conn *conn)
+{
+  user_conn_throttle_one (conn);
+
+  if (! memory_pressure && buffered_total > BUFFER_CEILING)
+    {
+      log ("%lld bytes buffered; throttling origin servers", buffered_total);
+      memory_pressure = true;
+    }
+  else if (memory_pressure && buffered_total < BUFFER_CEILING / 2)
+    {
+      log ("%lld bytes buffered; no longer throttling", buffered_total);
+      memory_pressure = false;
+
+      struct user_conn *uc;
+      for (uc = user_conn_list_head (&user_conns);
+	   uc; uc = user_conn_list_next (uc))
+	user_conn_throttle_one (uc);
+    }
+}
+
 void
 user_conns_dump (void)
 {
@@ -329,6 +962,12 @@ user_conns_dump (void)
   int reqs = 0;
   int resps = 0;
 
+  int hits, misses;
+  size_t bytes;
+  transform_cache_stats (&hits, &misses, &bytes);
+  printf ("Transform cache: %d hits, %d misses, %zd bytes\n",
+	  hits, misses, bytes);
+
   struct user_conn *user_conn;
   for (user_conn = user_conn_list_head (&user_conns);
        user_conn;
@@ -337,11 +976,13 @@ user_conns_dump (void)
       printf ("User conn (%d: %p):\n"
 	      " origin: %s\n"
 	      " buffered input: %d bytes\n"
-	      " request count: %d\n",
+	      " request count: %d\n"
+	      " cache hits: %d\n",
 	      ++ ucs, user_conn,
 	      user_conn->ip,
 	      EVBUFFER_LENGTH (user_conn->event_source->input),
-	      user_conn->request_count);
+	      user_conn->request_count,
+	      user_conn->cache_hits);
       if (! (user_conn->event_source->enabled & EV_READ))
 	printf (BOLD ("  pending close") "\n");
 
@@ -419,6 +1060,11 @@ user_conn_new (int fd, const char *ip)
 
   user_conn->fd = fd;
 
+  /* Spilled responses are sent directly to FD.  This must not
+     block.  */
+  if (fcntl (fd, F_SETFL, O_NONBLOCK) == -1)
+    log ("Failed to make %d non-blocking: %s", fd, strerror (errno));
+
   user_conn->event_source
     = bufferevent_new (user_conn->fd,
 		       user_conn_input_available,
@@ -428,6 +1074,8 @@ user_conn_new (int fd, const char *ip)
   if (! user_conn->event_source)
     goto bufferevent_new_fail;
 
+  evtimer_set (&user_conn->resume_event, user_conn_resume, user_conn);
+
   /* Reading is disabled by default and writing is enabled.  */
   bufferevent_enable (user_conn->event_source, EV_READ);
   bufferevent_disable (user_conn->event_source, EV_WRITE);
@@ -477,6 +1125,15 @@ user_conn_free (struct user_conn *user_conn)
       http_message_free (message);
     }
 
+  if (user_conn->tunnel)
+    tunnel_free (user_conn->tunnel);
+
+  buffered_total -= user_conn->buffered;
+
+  evtimer_del (&user_conn->resume_event);
+
+  request_parser_destroy (&user_conn->parser);
+
   close (user_conn->fd);
 
   user_conn_list_unlink (&user_conns, user_conn);
@@ -484,39 +1141,109 @@ user_conn_free (struct user_conn *user_conn)
   free (user_conn);
 }
 
-static void
-user_conn_output_buffer_drained (struct bufferevent *output, void *arg)
+/* Move the data of any responses at the head of USER_CONN's message
+   queue that are ready to go to the output buffer.  Frees any
+   responses that are complete.  Returns 1 if any data was queued, 0
+   if not, and -1 if a response could not be sent completely, in which
+   case the connection must be closed.  */
+static int
+user_conn_flush (struct user_conn *user_conn)
 {
-  struct user_conn *user_conn = arg;
-
-  assert (! user_conn->dead);
-  assert ((output->enabled & EV_WRITE));
+  int queued = 0;
 
-  /* See if a response is pending.  */
-  struct http_message *message
-    = user_conn_http_message_list_head (&user_conn->messages);
-  if (message && message->type == HTTP_RESPONSE
-      && ((struct http_response *) message)->ready_to_go)
-    /* Start copying the next response.  */
+  struct http_message *message;
+  while ((message = user_conn_http_message_list_head (&user_conn->messages))
+	 && message->type == HTTP_RESPONSE
+	 && ((struct http_response *) message)->ready_to_go)
     {
       struct http_response *response = (struct http_response *) message;
 
-      int len = EVBUFFER_LENGTH (response->buffer);
-      log ("sending %d bytes to client", len);
-      user_conn->client_out_bytes += len;
+      if (response->spill && spill_pending (response->spill) > 0)
+	/* The spilled data precedes the data in the buffer.  */
+	{
+	  if (EVBUFFER_LENGTH (user_conn->event_source->output) > 0)
+	    /* Wait until the output buffer has been sent.  */
+	    {
+	      queued = 1;
+	      break;
+	    }
 
-      bufferevent_write_buffer (user_conn->event_source, response->buffer);
-    }
-  else
-    {
-      /* Disable the copying.  */
-      bufferevent_disable (user_conn->event_source, EV_WRITE);
+	  ssize_t n = spill_send (response->spill, user_conn->fd);
+	  if (n > 0)
+	    user_conn->client_out_bytes += n;
+	  else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+	    /* Nothing being sent means the spill file ended early.  */
+	    {
+	      log ("Sending spilled response %s: %s", response->origin,
+		   n == 0 ? "file truncated" : strerror (errno));
+
+	      /* The response is truncated.  Anything that we send after
+		 it would be taken as the rest of its body.  */
+	      return -1;
+	    }
+
+	  if (spill_pending (response->spill) > 0)
+	    /* The output buffer is empty, so the bufferevent won't wait
+	       for the socket to become writable on its own.  */
+	    {
+	      bufferevent_enable (user_conn->event_source, EV_WRITE);
+	      queued = 1;
+	      break;
+	    }
+	}
+
+      size_t len = EVBUFFER_LENGTH (response->buffer);
+      if (len > 0)
+	{
+	  log ("sending %zu bytes to client", len);
+	  user_conn->client_out_bytes += len;
+
+	  /* bufferevent_write_buffer moves the bytes.  */
+	  bufferevent_write_buffer (user_conn->event_source, response->buffer);
+	  queued = 1;
+	}
+
+      if (response->partial)
+	/* More data will follow.  */
+	break;
+
+      http_response_free (response);
+    }
+
+  return queued;
+}
+
+static void
+user_conn_output_buffer_drained (struct bufferevent *output, void *arg)
+{
+  struct user_conn *user_conn = arg;
+
+  assert (! user_conn->dead);
+  assert ((output->enabled & EV_WRITE));
 
-      /* If there are no pending requests or responses and the user
-	 side has been closed, destroy the connection.  */
-      if (! message
-	  && ! (user_conn->event_source->enabled & EV_READ))
-	user_conn_free (user_conn);
+  /* See if a response is pending.  */
+  int queued = user_conn_flush (user_conn);
+  if (queued < 0)
+    {
+      user_conn_free (user_conn);
+      return;
+    }
+  user_conn_throttle (user_conn);
+  if (! queued)
+    {
+      /* Disable the copying.  */
+      bufferevent_disable (user_conn->event_source, EV_WRITE);
+
+      if (! user_conn_http_message_list_head (&user_conn->messages))
+	{
+	  if (user_conn->tunnel)
+	    /* Everything before the tunnel has been sent.  */
+	    tunnel_start (user_conn->tunnel);
+	  else if (! (user_conn->event_source->enabled & EV_READ))
+	    /* There are no pending requests or responses and the user
+	       side has been closed, destroy the connection.  */
+	    user_conn_free (user_conn);
+	}
     }
 }
 
@@ -530,19 +1257,19 @@ user_conn_kick (struct user_conn *user_conn)
     return;
 
   if ((user_conn->event_source->enabled & EV_WRITE))
-    /* Already sending.  */
+    /* Already sending.  The drained callback will pick up any new
+       data.  */
     {
       log ("%p already sending (%x)",
 	   user_conn, user_conn->event_source->enabled);
       return;
     }
 
-  struct http_message *message
-    = user_conn_http_message_list_head (&user_conn->messages);
-  if (! message)
+  if (! user_conn_http_message_list_head (&user_conn->messages))
     /* Nothing waiting.  */
     {
-      if (! (user_conn->event_source->enabled & EV_READ))
+      if (! (user_conn->event_source->enabled & EV_READ)
+	  && ! user_conn->tunnel)
 	{
 	  log ("%p: read disabled and nothing pending (%x)",
 	       user_conn, user_conn->event_source->enabled);
@@ -550,52 +1277,912 @@ user_conn_kick (struct user_conn *user_conn)
 	}
       return;
     }
-  if (message->type != HTTP_RESPONSE)
-    /* Not a response.  */
-    return;
 
-  struct http_response *response = (struct http_response *) message;
-  if (response->ready_to_go)
-    /* The response is finished.  Queue it up.  */
+  int queued = user_conn_flush (user_conn);
+  if (queued < 0)
+    user_conn_free (user_conn);
+  else if (queued)
+    bufferevent_enable (user_conn->event_source, EV_WRITE);
+}
+
+/* How the proxy would like to transform a response's body.  */
+enum transform
+  {
+    TRANSFORM_NONE,
+    TRANSFORM_GZIP,
+    TRANSFORM_DEFLATE,
+    TRANSFORM_JPEG,
+    TRANSFORM_PNG,
+  };
+
+/* Interesting headers of an origin server's response.  */
+struct response_info
+{
+  const char *transfer_encoding;
+  const char *content_length;
+  const char *connection;
+  const char *content_encoding;
+  const char *content_type;
+};
+
+/* If HEADER, whose id is ID, is interesting, record it in INFO.  */
+static void
+response_info_note (struct response_info *info, struct evkeyval *header,
+		    enum http_header_id id)
+{
+  switch (id)
+    {
+    case HEADER_TRANSFER_ENCODING:
+      info->transfer_encoding = header->value;
+      break;
+    case HEADER_CONTENT_LENGTH:
+      info->content_length = header->value;
+      break;
+    case HEADER_CONNECTION:
+      info->connection = header->value;
+      break;
+    case HEADER_CONTENT_ENCODING:
+      info->content_encoding = header->value;
+      break;
+    case HEADER_CONTENT_TYPE:
+      info->content_type = header->value;
+      break;
+    default:
+      break;
+    }
+}
+
+/* Fill in INFO from the headers of REQUEST's response.  */
+static void
+response_info_get (struct http_request *request,
+		   struct response_info *info)
+{
+  memset (info, 0, sizeof (*info));
+
+  struct evkeyval *header;
+  TAILQ_FOREACH(header, request->evhttp_request->input_headers, next)
+    response_info_note (info, header,
+			http_header_classify (header->key,
+					      strlen (header->key)));
+}
+
+/* Append the headers of REQUEST's response that should be forwarded
+   to the client to BUFFER.  The headers that we handle ourselves are
+   not forwarded but returned in INFO.  If CACHE is not NULL, the
+   headers that should be stored with a cached copy of the response
+   are also appended to it.  */
+static void
+response_forward_headers (struct http_request *request,
+			  struct evbuffer *buffer,
+			  struct evbuffer *cache,
+			  struct response_info *info)
+{
+  memset (info, 0, sizeof (*info));
+
+  struct evkeyval *header;
+  TAILQ_FOREACH(header, request->evhttp_request->input_headers, next)
     {
-      user_conn->client_out_bytes += EVBUFFER_LENGTH (response->buffer);
-      log ("sending %d bytes to client", EVBUFFER_LENGTH (response->buffer));
-      bufferevent_write_buffer (user_conn->event_source, response->buffer);
-      bufferevent_enable (user_conn->event_source, EV_WRITE);
+      enum http_header_id id
+	= http_header_classify (header->key, strlen (header->key));
+      response_info_note (info, header, id);
 
-      /* bufferevent_write_buffer copies the bytes.  */
-      http_response_free (response);
+      /* Don't forward hop-by-hop headers, those that we generate
+	 ourselves or junk.  */
+      if (http_header_flags (id) & (HEADER_HOP_BY_HOP | HEADER_RESPONSE_STRIP))
+	{
+	  log ("Ignoring %s: %s", header->key, header->value);
+	  continue;
+	}
+
+      log ("Forwarding: %s: %s", header->key, header->value);
+
+      evbuffer_add_printf (buffer, "%s: %s\r\n",
+			   header->key, header->value);
+      if (cache && id != HEADER_AGE)
+	/* We compute the age of cached responses ourselves.  */
+	evbuffer_add_printf (cache, "%s: %s\r\n",
+			     header->key, header->value);
+    }
+}
+
+/* Decide how to transform the body of REQUEST's response.  */
+static enum transform
+response_transform (struct http_request *request,
+		    struct response_info *info)
+{
+  if (info->content_type)
+    {
+      if (strcmp (info->content_type, "image/jpeg") == 0)
+	return TRANSFORM_JPEG;
+      if (strcmp (info->content_type, "image/png") == 0)
+	return TRANSFORM_PNG;
+    }
+
+  if (info->content_encoding)
+    /* The data is already encoded.  */
+    return TRANSFORM_NONE;
+
+  /* The data is not encoded and it looks like some sort of text.
+     gzip it!  */
+  const char *coding = client_content_coding (request->client_headers);
+  if (! coding)
+    {
+      log ("Client refuses gzip encoding: %s",
+	   http_headers_get (request->client_headers, HEADER_ACCEPT_ENCODING));
+      return TRANSFORM_NONE;
+    }
+
+  if (strcmp (coding, "deflate") == 0)
+    return TRANSFORM_DEFLATE;
+  return TRANSFORM_GZIP;
+}
+
+/* The origin server asked us to close the connection.  Note it.  */
+static void
+response_note_connection (struct http_request *request,
+			  struct response_info *info)
+{
+  if (! request->http_conn->close
+      && info->connection && strcmp (info->connection, "close") == 0)
+    request->http_conn->close = true;
+}
+
+/* Start recording REQUEST's response, RESPONSE, so that it can be
+   added to the cache once it is complete.  Does nothing if the
+   response may not be cached.  */
+static void
+http_response_cache_start (struct http_response *response,
+			   struct http_request *request)
+{
+  struct evhttp_request *evrequest = request->evhttp_request;
+
+  if (request->method == HTTP_GET)
+    {
+      char *key = cache_key (request->http_conn->host, request->url,
+			     request->client_headers);
+      if (key)
+	{
+	  response->cache_entry
+	    = cache_entry_new (key, request->client_headers,
+			       evrequest->response_code,
+			       evrequest->response_code_line,
+			       evrequest->input_headers);
+	  free (key);
+	}
+    }
+
+  if (request->collapse)
+    {
+      if (response->cache_entry)
+	/* Identical requests wait for the complete response.  */
+	response->collapse = request->collapse;
+      else
+	/* The response can't be shared.  Let the waiters fetch it
+	   themselves now rather than once it is complete.  */
+	collapse_end (request->collapse, NULL);
+      request->collapse = NULL;
+    }
+}
+
+/* RESPONSE won't be cached after all.  Discard what was recorded and
+   let any identical requests waiting for it fetch it themselves.  */
+static void
+http_response_cache_drop (struct http_response *response)
+{
+  if (response->cache_entry)
+    {
+      cache_entry_free (response->cache_entry);
+      response->cache_entry = NULL;
+    }
+
+  if (response->collapse)
+    {
+      collapse_end (response->collapse, NULL);
+      response->collapse = NULL;
+    }
+}
+
+/* Record the LEN bytes at DATA, which are part of RESPONSE's body
+   (after any transformation).  */
+static void
+http_response_cache_body (struct http_response *response,
+			  const void *data, int len)
+{
+  if (response->cache_entry
+      && ! cache_entry_add_body (response->cache_entry, data, len))
+    /* Too large.  */
+    http_response_cache_drop (response);
+}
+
+/* RESPONSE is complete.  Add it to the cache.  */
+static void
+http_response_cache_finish (struct http_response *response)
+{
+  if (response->collapse)
+    {
+      collapse_end (response->collapse, response->cache_entry);
+      response->collapse = NULL;
     }
+
+  if (response->cache_entry)
+    {
+      cache_insert (response->cache_entry);
+      response->cache_entry = NULL;
+    }
+}
+
+/* Start streaming REQUEST's response to the client.  The response's
+   headers have arrived; the body has not yet been read.  The response
+   is not sent until http_request_send_headers is called.  Returns
+   false if the response could not be allocated.  */
+static bool
+http_request_start_stream (struct http_request *request)
+{
+  struct user_conn *user_conn = request->http_conn->user_conn;
+
+  struct http_response *response = http_response_new (user_conn, request,
+						      request->url);
+  if (! response)
+    return false;
+
+  request->response = response;
+  response->partial = true;
+
+  /* The response takes REQUEST's place in the message queue.  This
+     way, it is sent as soon as all earlier responses have been
+     sent.  */
+  http_message_destroy (&request->message);
+
+  return true;
 }
 
+/* Queue the status line and headers of REQUEST's streamed response.
+   If CONTENT_ENCODING is not NULL, the body is encoded using it.  */
 static void
-encode_compressed_content (struct http_request *request,
-			   struct http_response *response,
-			   int min_percent, 
-			   int deflate_flag)
-{
-  char *encoding_type = deflate_flag ? "deflate" : "gzip";
-  struct evbuffer *compressed
-    = evbuffer_gzip (request->evhttp_request->input_buffer, min_percent, 
-		     deflate_flag);
-  if (compressed)
-    {
-      log ("compressed (%s): %d -> %d",
-	   encoding_type,
-	   EVBUFFER_LENGTH (request->evhttp_request->input_buffer),
-	   EVBUFFER_LENGTH (compressed));
-
-      evbuffer_drain (request->evhttp_request->input_buffer,
-		      EVBUFFER_LENGTH (request->evhttp_request
-				       ->input_buffer));
-      evbuffer_add_buffer (request->evhttp_request->input_buffer,
-			   compressed);
-      evbuffer_free (compressed);
+http_request_send_headers (struct http_request *request,
+			   const char *content_encoding)
+{
+  struct user_conn *user_conn = request->http_conn->user_conn;
+  struct evhttp_request *evrequest = request->evhttp_request;
+  struct http_response *response = request->response;
+
+  struct response_info info;
+  response_info_get (request, &info);
+
+  /* If we don't know the length of the body, we either use the
+     chunked transfer coding or, if the client does not understand it,
+     delimit the body by closing the connection.  If we encode the
+     body, we don't know its length.  */
+  bool length_known = ! content_encoding && ! evrequest->chunked
+    && info.content_length;
+  if (! length_known && request->client_version == HTTP_11)
+    response->chunked = true;
+
+  log ("%s -> %d: %s (HTTP/%d.%d), streaming%s%s%s",
+       request->url, evrequest->response_code,
+       evrequest->response_code_line,
+       evrequest->major, evrequest->minor,
+       response->chunked ? " (chunked)" : "",
+       content_encoding ? ", " : "",
+       content_encoding ? content_encoding : "");
+
+  if (response->chunked)
+    evbuffer_add_printf (response->buffer, "HTTP/1.1 %d %s\r\n",
+			 evrequest->response_code,
+			 evrequest->response_code_line);
+  else
+    evbuffer_add_printf (response->buffer, "HTTP/%d.%d %d %s\r\n",
+			 evrequest->major, evrequest->minor,
+			 evrequest->response_code,
+			 evrequest->response_code_line);
+
+  http_response_cache_start (response, request);
+  if (length_known
+      && ! cache_body_fits (strtoll (info.content_length, NULL, 10)))
+    /* The body is passed through as is and is too large to cache.  */
+    http_response_cache_drop (response);
+  struct cache_entry *entry = response->cache_entry;
+
+  response_forward_headers (request, response->buffer,
+			    entry ? entry->headers : NULL, &info);
+
+  if (! length_known && ! response->chunked)
+    /* The end of the body is signalled by closing the connection.  */
+    bufferevent_disable (user_conn->event_source, EV_READ);
 
+  if (! (user_conn->event_source->enabled & EV_READ))
+    /* The user closed the connection.  Signal that this is the last
+       transfer.  */
+    evbuffer_add_printf (response->buffer, "Connection: close\r\n");
+
+  if (content_encoding)
+    {
       evbuffer_add_printf (response->buffer,
-			   "Content-Encoding: %s\r\n", encoding_type);
-      log ("Adding: Content-Encoding: %s", encoding_type);
+			   "Content-Encoding: %s\r\n", content_encoding);
+      if (entry)
+	evbuffer_add_printf (entry->headers,
+			     "Content-Encoding: %s\r\n", content_encoding);
+      log ("Adding: Content-Encoding: %s", content_encoding);
+    }
+
+  if (length_known)
+    evbuffer_add_printf (response->buffer, "Content-Length: %s\r\n",
+			 info.content_length);
+  else if (response->chunked)
+    evbuffer_add_printf (response->buffer, "Transfer-Encoding: chunked\r\n");
+
+  evbuffer_add_printf (response->buffer, "\r\n");
+
+  response->ready_to_go = true;
+}
+
+/* If RESPONSE buffers more than the spill threshold, move the data to
+   its spill file.  */
+static void
+http_response_spill (struct http_response *response)
+{
+  if (! spill_threshold
+      || EVBUFFER_LENGTH (response->buffer) < spill_threshold
+      || spill_over_budget ())
+    /* If the disk budget is exhausted, the data stays in memory and
+       the origin server is throttled as usual.  */
+    return;
+
+  struct user_conn *user_conn = response->message.user_conn;
+  if (! response->spill
+      && user_conn_http_message_list_head (&user_conn->messages)
+      == &response->message)
+    /* The data goes to the client as soon as possible anyway.  */
+    return;
+
+  if (! response->spill)
+    {
+      response->spill = spill_new ();
+      if (! response->spill)
+	/* Keep the data in memory.  */
+	return;
+
+      log ("%s: spilling response", response->origin);
+    }
+
+  /* On failure, the data stays in the buffer, which is sent after the
+     data that was spilled.  */
+  spill_write (response->spill, response->buffer);
+}
+
+/* Append the data in DATA to REQUEST's streamed response, draining
+   DATA.  */
+static void
+http_request_stream_data (struct http_request *request,
+			  struct evbuffer *data)
+{
+  struct http_response *response = request->response;
+
+  int len = EVBUFFER_LENGTH (data);
+  if (len == 0)
+    return;
+
+  http_response_cache_body (response, EVBUFFER_DATA (data), len);
+
+  if (response->chunked)
+    evbuffer_add_printf (response->buffer, "%x\r\n", len);
+  evbuffer_add_buffer (response->buffer, data);
+  if (response->chunked)
+    evbuffer_add_printf (response->buffer, "\r\n");
+
+  http_response_spill (response);
+}
+
+/* Act on the result of feeding REQUEST's gzip stream.  */
+static void
+http_request_stream_gzip (struct http_request *request,
+			  enum gzip_status status)
+{
+  struct http_response *response = request->response;
+  struct gzip_stream *gzip = request->gzip;
+
+  switch (status)
+    {
+    case GZIP_SAMPLING:
+      return;
+
+    case GZIP_COMPRESSING:
+      if (! response->ready_to_go)
+	http_request_send_headers (request, gzip_stream_encoding (gzip));
+      http_request_stream_data (request, gzip_stream_output (gzip));
+      return;
+
+    case GZIP_ABANDONED:
+      /* Send the rest as is.  */
+      http_request_send_headers (request, NULL);
+      http_request_stream_data (request, gzip_stream_output (gzip));
+      break;
+
+    case GZIP_ERROR:
+      log ("%s: compression failed, truncating response", request->url);
+
+      /* If the headers have not yet been queued, the client just sees
+	 the connection close.  */
+      response->ready_to_go = true;
+
+      /* Don't terminate the body and close the connection: the client
+	 will see that the response is incomplete.  */
+      response->chunked = false;
+      bufferevent_disable (request->http_conn->user_conn->event_source,
+			   EV_READ);
+      request->discard = true;
+
+      if (response->cache_entry)
+	{
+	  cache_entry_free (response->cache_entry);
+	  response->cache_entry = NULL;
+	}
+      break;
+    }
+
+  gzip_stream_free (gzip);
+  request->gzip = NULL;
+}
+
+/* Forward.  */
+static bool http_request_recompress_start (struct http_request *request,
+					   struct response_info *info);
+static void http_request_recompress_feed (struct http_request *request);
+
+void
+http_request_data_cb (struct http_request *request)
+{
+  struct evhttp_request *evrequest = request->evhttp_request;
+
+  if (! request->response && ! request->recompress)
+    /* The headers just arrived.  Decide whether to stream the body to
+       the client as it arrives, or to buffer it so that we can
+       transform it.  */
+    {
+      struct response_info info;
+      response_info_get (request, &info);
+
+      enum transform transform = response_transform (request, &info);
+      if ((transform == TRANSFORM_JPEG || transform == TRANSFORM_PNG)
+	  && spill_threshold && info.content_length
+	  && strtoll (info.content_length, NULL, 10) > spill_threshold)
+	/* Too large to buffer.  Send it as is.  */
+	transform = TRANSFORM_NONE;
+
+      if (transform == TRANSFORM_JPEG
+	  && http_request_recompress_start (request, &info))
+	/* Decode the image as it arrives.  The response is formulated
+	   once the image is complete.  */
+	;
+      else if (transform == TRANSFORM_JPEG || transform == TRANSFORM_PNG
+	       || ! http_request_start_stream (request))
+	/* Buffer the body.  Clearing the chunk callback causes evhttp
+	   to accumulate the body in EVREQUEST->INPUT_BUFFER and call
+	   http_request_processed_cb when it is complete.  */
+	{
+	  evhttp_request_set_chunked_cb (evrequest, NULL);
+	  return;
+	}
+      else
+	{
+	  if (transform == TRANSFORM_GZIP || transform == TRANSFORM_DEFLATE)
+	    /* Compress the body as it arrives.  We only send the headers
+	       once the gzip stream has decided whether compressing the
+	       body is worthwhile.  */
+	    request->gzip = gzip_stream_new (75,
+					     transform == TRANSFORM_DEFLATE);
+
+	  if (! request->gzip)
+	    http_request_send_headers (request, NULL);
+	}
+    }
+
+  struct evbuffer *data = evrequest->input_buffer;
+  int len = EVBUFFER_LENGTH (data);
+  if (len == 0)
+    return;
+
+  request->http_conn->user_conn->server_in_bytes += len;
+
+  if (request->recompress)
+    http_request_recompress_feed (request);
+  else if (request->discard)
+    evbuffer_drain (data, len);
+  else if (request->gzip)
+    http_request_stream_gzip (request,
+			      gzip_stream_feed (request->gzip, data));
+  else
+    http_request_stream_data (request, data);
+
+  user_conn_throttle (request->http_conn->user_conn);
+  user_conn_kick (request->http_conn->user_conn);
+}
+
+/* REQUEST's response has been completely streamed.  */
+static void
+http_request_finish_stream (struct http_request *request)
+{
+  struct user_conn *user_conn = request->http_conn->user_conn;
+  struct http_response *response = request->response;
+
+  log ("%s: streamed response complete", request->url);
+
+  if (request->gzip)
+    http_request_stream_gzip (request,
+			      gzip_stream_finish (request->gzip));
+
+  if (response->chunked)
+    /* The last chunk.  */
+    evbuffer_add_printf (response->buffer, "0\r\n\r\n");
+  response->partial = false;
+
+  http_response_cache_finish (response);
+
+  struct response_info info;
+  response_info_get (request, &info);
+  response_note_connection (request, &info);
+
+  struct http_conn *http_conn = request->http_conn;
+  http_request_free (request);
+  if (http_conn->close)
+    http_conn_free (http_conn);
+
+  user_conn_kick (user_conn);
+}
+
+/* Add the Content-Length header and the body PAYLOAD to RESPONSE,
+   draining PAYLOAD, and mark RESPONSE as ready to be sent.  */
+static void
+http_response_add_body (struct http_response *response,
+			struct evbuffer *payload)
+{
+  struct evbuffer *message = response->buffer;
+
+  /* Add a content-length field.  */
+  evbuffer_add_printf (message, "Content-Length: %zu\r\n",
+		       EVBUFFER_LENGTH (payload));
+  log ("Adding: Content-Length: %zu", EVBUFFER_LENGTH (payload));
+
+  evbuffer_add_printf (message, "\r\n");
+
+  http_response_cache_body (response, EVBUFFER_DATA (payload),
+			    EVBUFFER_LENGTH (payload));
+  http_response_cache_finish (response);
+
+  evbuffer_add_buffer (message, payload);
+  http_response_spill (response);
+
+  response->ready_to_go = true;
+}
+
+/* The quality that images are recompressed to.  */
+#define IMAGE_QUALITY 30
+
+/* An image being recompressed by a worker thread.  */
+struct recompress_job
+{
+  struct thread_job job;
+
+  enum transform transform;
+  /* The maximum width and height of the result (0 means no limit).  */
+  int max_size;
+  /* The response the image belongs to.  Its headers have been
+     queued.  While a streamed image is arriving, NULL.  */
+  struct http_response *response;
+  /* The image.  */
+  struct evbuffer *payload;
+  /* The recompressed image or NULL, if recompression failed.  */
+  struct evbuffer *result;
+
+  /* If the image is decoded as it arrives, the decoder.  The first
+     FED bytes of PAYLOAD were fed to it.  */
+  struct jpeg_stream *stream;
+  size_t fed;
+  /* While the image is arriving, the request.  */
+  struct http_request *request;
+  /* Whether the job is queued or running.  Until it is done, only the
+     worker thread may touch STREAM.  */
+  bool busy;
+  /* Whether PAYLOAD is complete.  */
+  bool complete;
+  /* Whether the queued or running job is the last one.  */
+  bool final;
+  /* Whether the decoder gave up.  */
+  bool failed;
+};
+
+/* Called on a worker thread.  */
+static void
+recompress_run (struct thread_job *job)
+{
+  struct recompress_job *rj = (struct recompress_job *) job;
+
+  /* The same images pass through over and over.  */
+  struct transform_key key;
+  transform_key_init (&key, rj->payload, rj->transform, IMAGE_QUALITY,
+		      rj->max_size);
+  if (transform_cache_lookup (&key, &rj->result))
+    return;
+
+  if (rj->transform == TRANSFORM_JPEG)
+    rj->result = jpeg_recompress (rj->payload, IMAGE_QUALITY, rj->max_size);
+  else
+    rj->result = png_recompress (rj->payload, IMAGE_QUALITY);
+
+  transform_cache_insert (&key, rj->result);
+}
+
+/* Called on a worker thread to decode the part of a streamed image
+   that has arrived.  */
+static void
+recompress_stream_run (struct thread_job *job)
+{
+  struct recompress_job *rj = (struct recompress_job *) job;
+
+  if (! rj->final)
+    {
+      if (! jpeg_stream_run (rj->stream))
+	rj->failed = true;
+      return;
+    }
+
+  /* The image is complete.  If it was recompressed before, the work
+     done so far is wasted, but encoding the image is not.  */
+  struct transform_key key;
+  transform_key_init (&key, rj->payload, rj->transform, IMAGE_QUALITY,
+		      rj->max_size);
+  if (transform_cache_lookup (&key, &rj->result))
+    return;
+
+  if (jpeg_stream_run (rj->stream))
+    rj->result = jpeg_stream_result (rj->stream);
+
+  transform_cache_insert (&key, rj->result);
+}
+
+/* Called from the event loop when the recompression is done.  */
+static void
+recompress_done (struct thread_job *job)
+{
+  struct recompress_job *rj = (struct recompress_job *) job;
+  struct http_response *response = rj->response;
+  struct evbuffer *payload = rj->payload;
+  struct evbuffer *result = rj->result;
+
+  if (job->cancelled)
+    /* The response is gone.  */
+    goto out;
+
+  response->job = NULL;
+
+  if (rj->transform == TRANSFORM_JPEG)
+    /* If we end up sending the original, it need not include the
+       metadata.  Compare against what we would send.  */
+    jpeg_strip (payload);
+
+  if (result)
+    {
+      log (BOLD ("compressed (%s): %zu -> %zu (%zu%%)"),
+	   response->origin,
+	   EVBUFFER_LENGTH (payload),
+	   EVBUFFER_LENGTH (result),
+	   (EVBUFFER_LENGTH (result) * 100)
+	   / EVBUFFER_LENGTH (payload));
+
+      if (EVBUFFER_LENGTH (result)
+	  < 90 * EVBUFFER_LENGTH (payload) / 100)
+	/* Only send if we get at least a 10% size reduction.
+	   Why only 10%?  Due to the quality reduction.  */
+	{
+	  evbuffer_drain (payload, EVBUFFER_LENGTH (payload));
+	  evbuffer_add_buffer (payload, result);
+	}
+      else
+	log ("Too large, using original");
+    }
+  else
+    log ("Recompression failed");
+
+  http_response_add_body (response, payload);
+  user_conn_kick (response->message.user_conn);
+
+ out:
+  if (result)
+    evbuffer_free (result);
+  evbuffer_free (payload);
+  if (rj->stream)
+    jpeg_stream_free (rj->stream);
+  free (rj);
+}
+
+/* Feed the part of RJ's image that arrived since the last run to the
+   decoder and run it.  Once the image is complete, runs the decoder a
+   last time.  If that is not possible, sends the original image and
+   frees RJ.  */
+static void
+recompress_stream_kick (struct recompress_job *rj)
+{
+  if (rj->busy)
+    /* The done callback calls us again.  */
+    return;
+
+  if (! rj->failed)
+    {
+      size_t len = EVBUFFER_LENGTH (rj->payload);
+      bool fresh = len > rj->fed;
+      if (fresh
+	  && jpeg_stream_feed (rj->stream, EVBUFFER_DATA (rj->payload) + rj->fed,
+			       len - rj->fed) < 0)
+	rj->failed = true;
+      rj->fed = len;
+
+      if (! rj->failed && rj->complete)
+	{
+	  jpeg_stream_finish (rj->stream);
+	  rj->final = true;
+	}
+
+      if (! rj->failed && (fresh || rj->final)
+	  && thread_pool_submit (&rj->job))
+	rj->busy = true;
+    }
+
+  if (rj->complete && ! rj->busy)
+    /* The image can't be recompressed.  */
+    recompress_done (&rj->job);
+}
+
+/* Called from the event loop when a run of a streamed image's decoder
+   is done.  */
+static void
+recompress_stream_done (struct thread_job *job)
+{
+  struct recompress_job *rj = (struct recompress_job *) job;
+
+  rj->busy = false;
+
+  if (job->cancelled || rj->final)
+    recompress_done (job);
+  else
+    /* More of the image may have arrived in the meantime.  */
+    recompress_stream_kick (rj);
+}
+
+/* Start recompressing REQUEST's image, whose headers INFO describes,
+   as it arrives.  Returns false if that is not possible.  */
+static bool
+http_request_recompress_start (struct http_request *request,
+			       struct response_info *info)
+{
+  struct recompress_job *rj = calloc (sizeof (*rj), 1);
+  if (! rj)
+    return false;
+
+  rj->transform = TRANSFORM_JPEG;
+  rj->max_size = client_image_limit (request->client_headers, NULL);
+
+  size_t size_hint = 0;
+  if (info->content_length)
+    size_hint = strtoll (info->content_length, NULL, 10);
+
+  rj->payload = evbuffer_new ();
+  rj->stream = jpeg_stream_new (IMAGE_QUALITY, rj->max_size, size_hint);
+  if (! rj->payload || ! rj->stream)
+    {
+      if (rj->payload)
+	evbuffer_free (rj->payload);
+      if (rj->stream)
+	jpeg_stream_free (rj->stream);
+      free (rj);
+      return false;
+    }
+
+  rj->job.run = recompress_stream_run;
+  rj->job.done = recompress_stream_done;
+  rj->request = request;
+  request->recompress = rj;
+
+  return true;
+}
+
+/* Move the part of REQUEST's image that arrived to the decoder.  */
+static void
+http_request_recompress_feed (struct http_request *request)
+{
+  struct recompress_job *rj = request->recompress;
+
+  evbuffer_add_buffer (rj->payload, request->evhttp_request->input_buffer);
+  recompress_stream_kick (rj);
+}
+
+/* The number of bytes of REQUEST's image that are buffered.  */
+static size_t
+recompress_buffered (struct http_request *request)
+{
+  return EVBUFFER_LENGTH (request->recompress->payload);
+}
+
+/* Detach the streamed image RJ from its request and free it.  */
+static void
+recompress_stream_abandon (struct recompress_job *rj)
+{
+  if (rj->request)
+    rj->request->recompress = NULL;
+  rj->request = NULL;
+
+  if (rj->busy)
+    /* The done callback frees RJ.  */
+    thread_pool_cancel (&rj->job);
+  else
+    {
+      rj->job.cancelled = true;
+      recompress_done (&rj->job);
+    }
+}
+
+void
+http_request_drop_recompress (struct http_request *request)
+{
+  recompress_stream_abandon (request->recompress);
+}
+
+/* The streamed image RJ is complete.  When it is recompressed, add it
+   to RESPONSE and mark RESPONSE as ready to go.  */
+static void
+http_response_recompress_stream (struct http_response *response,
+				 struct recompress_job *rj)
+{
+  rj->request->recompress = NULL;
+  rj->request = NULL;
+
+  rj->response = response;
+  response->job = &rj->job;
+  rj->complete = true;
+
+  recompress_stream_kick (rj);
+}
+
+/* Recompress the image in PAYLOAD on a worker thread, scaling it down
+   if its width or height exceeds MAX_SIZE (if not 0).  When done, add
+   it to RESPONSE and mark RESPONSE as ready to go.  On success, drains
+   PAYLOAD and returns true.  If the image can't be recompressed now,
+   returns false.  */
+static bool
+http_response_recompress (struct http_response *response,
+			  enum transform transform, int max_size,
+			  struct evbuffer *payload)
+{
+  struct recompress_job *rj = calloc (sizeof (*rj), 1);
+  if (! rj)
+    return false;
+
+  rj->payload = evbuffer_new ();
+  if (! rj->payload)
+    {
+      free (rj);
+      return false;
     }
+
+  rj->job.run = recompress_run;
+  rj->job.done = recompress_done;
+  rj->transform = transform;
+  rj->max_size = max_size;
+  rj->response = response;
+  /* PAYLOAD belongs to the evhttp request, which will be freed when
+     we return.  Move the data.  */
+  evbuffer_add_buffer (rj->payload, payload);
+
+  if (! thread_pool_submit (&rj->job))
+    {
+      log ("%s: not recompressing", response->origin);
+      evbuffer_add_buffer (payload, rj->payload);
+      evbuffer_free (rj->payload);
+      free (rj);
+      return false;
+    }
+
+  response->job = &rj->job;
+  return true;
 }
 
 void
@@ -604,12 +2191,26 @@ http_request_processed_cb (struct http_request *request)
   /* NB: REQUEST->EVHTTP_REQUEST will disappear when we return.  We
      must copy any data that we would like to preserve.  */
 
-  int we_prefer_deflate = 1;
+  if (request->response)
+    {
+      http_request_finish_stream (request);
+      return;
+    }
 
   struct user_conn *user_conn = request->http_conn->user_conn;
 
   struct evbuffer *payload = request->evhttp_request->input_buffer;
 
+  user_conn->server_in_bytes += EVBUFFER_LENGTH (payload);
+
+  /* If the image was decoded as it arrived, the job.  */
+  struct recompress_job *rj = request->recompress;
+  if (rj)
+    {
+      evbuffer_add_buffer (rj->payload, payload);
+      payload = rj->payload;
+    }
+
   struct http_response *response = http_response_new (user_conn, request,
 						      request->url);
   struct evbuffer *message = response->buffer;
@@ -628,158 +2229,94 @@ http_request_processed_cb (struct http_request *request)
 		       request->evhttp_request->response_code,
 		       request->evhttp_request->response_code_line);
 
-  const char *transfer_encoding = NULL;
-  const char *content_length = NULL;
-  const char *connection = NULL;
-  const char *content_encoding = NULL;
-  const char *content_type = NULL;
-
-  struct evkeyval *header;
-  TAILQ_FOREACH(header, request->evhttp_request->input_headers, next)
-    {
-      if (strcasecmp (header->key, "transfer-encoding") == 0)
-	/* Skip.  */
-	{
-	  log ("Ignoring %s: %s", header->key, header->value);
-	  transfer_encoding = header->value;
-	  continue;
-	}
-      else if (strcasecmp (header->key, "content-length") == 0)
-	{
-	  log ("Ignoring %s: %s", header->key, header->value);
-	  content_length = header->value;
-	  continue;
-	}
-      else if (strcasecmp (header->key, "connection") == 0)
-	{
-	  log ("Ignoring %s: %s", header->key, header->value);
-	  connection = header->value;
-	  continue;
-	}
-      else if (strcasecmp (header->key, "content-encoding") == 0)
-	content_encoding = header->value;
-      else if (strcasecmp (header->key, "content-type") == 0)
-	content_type = header->value;
-
-      /* Don't both sending these headers...  */
-      else if (strcasecmp (header->key, "Server") == 0
-	       || strcasecmp (header->key, "X-Powered-By") == 0
-	       || strcasecmp (header->key, "X-Cnection") == 0)
-	{
-	  log ("Ignoring %s: %s", header->key, header->value);
-	  continue;
-	}
-
-      log ("Forwarding: %s: %s", header->key, header->value);
+  http_response_cache_start (response, request);
 
-      evbuffer_add_printf (message, "%s: %s\r\n",
-			   header->key, header->value);
-    }
+  struct response_info info;
+  response_forward_headers (request, message,
+			    response->cache_entry
+			    ? response->cache_entry->headers : NULL,
+			    &info);
 
   if (! (user_conn->event_source->enabled & EV_READ))
     /* The user closed the connection.  Signal that this is the last
        transfer.  */
     evbuffer_add_printf (message, "Connection: close\r\n");
 
-  if (! request->http_conn->close
-      && connection && strcmp (connection, "close") == 0)
-    request->http_conn->close = true;
+  response_note_connection (request, &info);
+
+  /* Whether the body is being recompressed by a worker thread.  */
+  bool recompressing = false;
 
+  /* gzip adds a 20 byte header.  If we don't have at least 100 bytes
+     it's not worth even trying.  */
   if (EVBUFFER_LENGTH (payload) > 100)
     {
-      if (! content_encoding
-	  /* gzip adds a 20 byte header.  If we don't have at least 100
-	     bytes it's not worth even trying.  */
-	  && (! content_type
-	      /* Don't bother trying to compress jpeg or png images.  */
-	      && strcmp (content_type, "image/jpeg") != 0)
-	      && strcmp (content_type, "image/png") != 0)
-	/* The data is not encoded and it looks like some sort of text.
-	   gzip it!  */
-	{
-	  const char *accept_encoding
-	    = http_headers_find (request->client_headers, "Accept-Encoding");
-	  if (accept_encoding)
-	    {
-	      char *accept_deflate = strstr (accept_encoding, "deflate");
-	      char *accept_gzip = strstr (accept_encoding, "gzip");
-	      if (accept_deflate && accept_gzip)
-		{
-		  if (we_prefer_deflate)
-		    encode_compressed_content (request, response, 75, 1);
-		  else
-		    encode_compressed_content (request, response, 75, 0);
-		}
-	      else if (accept_deflate)
-		encode_compressed_content (request, response, 75, 1);
-	      else if (accept_gzip)
-		encode_compressed_content (request, response, 75, 0);
-	      else
-		log ("Client refuses gzip encoding: %s", accept_encoding);
-	    }
-	  else
-	    log ("Client refuses gzip encoding: %s", accept_encoding);
-	}
-      else
-	log ("Content-Encoding: %s; length: %d: Content-Type: %s",
-	     content_encoding,
-	     EVBUFFER_LENGTH (payload),
-	     content_type);
-
-      if (content_type
-	  && (strcmp (content_type, "image/jpeg") == 0
-	      || strcmp (content_type, "image/png") == 0))
+      enum transform transform = response_transform (request, &info);
+      switch (transform)
 	{
-	  struct evbuffer *result;
-	  if (strcmp (content_type, "image/jpeg") == 0)
-	    result = jpeg_recompress (payload, 30);
-	  else
-	    result = png_recompress (payload, 30);
+	case TRANSFORM_JPEG:
+	  {
+	    bool hinted;
+	    int max_size = client_image_limit (request->client_headers,
+					       &hinted);
+	    if (hinted)
+	      /* The image depends on the client's screen.  */
+	      {
+		const char *vary = "Vary: Viewport-Width, DPR\r\n";
+		evbuffer_add_printf (message, "%s", vary);
+		if (response->cache_entry)
+		  evbuffer_add_printf (response->cache_entry->headers,
+				       "%s", vary);
+	      }
 
-	  if (result)
-	    {
-	      log (BOLD ("compressed (%s): %d -> %d (%d%%)"),
-		   request->url,
-		   EVBUFFER_LENGTH (payload),
-		   EVBUFFER_LENGTH (result),
-		   (EVBUFFER_LENGTH (result) * 100)
-		   / EVBUFFER_LENGTH (payload));
-
-	      if (EVBUFFER_LENGTH (result)
-		  < 90 * EVBUFFER_LENGTH (payload) / 100)
-		/* Only send if we get at least a 10% size reduction.
-		   Why only 10%?  Due to the quality reduction.  */
-		{
-		  evbuffer_drain (payload, EVBUFFER_LENGTH (payload));
-		  evbuffer_add_buffer (payload, result);
-		}
-	      else
-		log ("Too large, using original");
+	    if (rj)
+	      {
+		http_response_recompress_stream (response, rj);
+		rj = NULL;
+		recompressing = true;
+	      }
+	    else
+	      recompressing = http_response_recompress (response, transform,
+							max_size, payload);
 
-	      evbuffer_free (result);
-	    }
-	  else
-	    log ("Recompression failed");
+	    if (! recompressing)
+	      /* At least remove the metadata.  */
+	      jpeg_strip (payload);
+	  }
+	  break;
+
+	case TRANSFORM_PNG:
+	  recompressing = http_response_recompress (response, transform,
+						    0, payload);
+	  break;
+
+	case TRANSFORM_GZIP:
+	case TRANSFORM_DEFLATE:
+	  /* We compress bodies as they are streamed.  We only get here
+	     if streaming the response failed.  */
+	case TRANSFORM_NONE:
+	  log ("Content-Encoding: %s; length: %zu: Content-Type: %s",
+	       info.content_encoding,
+	       EVBUFFER_LENGTH (payload),
+	       info.content_type);
+	  break;
 	}
     }
 
 
-  /* Add a content-length field.  */
-  evbuffer_add_printf (message, "Content-Length: %d\r\n",
-		       EVBUFFER_LENGTH (payload));
-  log ("Adding: Content-Length: %d", EVBUFFER_LENGTH (payload));
-
-  evbuffer_add_printf (message, "\r\n");
+  if (! recompressing)
+    /* Mark the response as ready to be sent.  */
+    http_response_add_body (response, payload);
 
-  evbuffer_add_buffer (message, payload);
+  if (rj)
+    /* The image was too small to bother.  */
+    recompress_stream_abandon (rj);
 
   struct http_conn *http_conn = request->http_conn;
   http_request_free (request);
   if (http_conn->close)
     http_conn_free (http_conn);
 
-  /* Mark the response as ready to be sent.  */
-  response->ready_to_go = true;
   /* Start sending, if appropriate.  */
   user_conn_kick (user_conn);
 }
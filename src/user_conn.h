@@ -25,6 +25,10 @@
 
 #include "http_conn.h"
 #include "list.h"
+#include "request_parser.h"
+
+/* Forward.  */
+struct tunnel;
 
 struct user_conn
 {
@@ -46,14 +50,38 @@ struct user_conn
   /* If being freed.  */
   bool dead;
 
+  /* If the user sent a CONNECT request, the tunnel.  Once the tunnel
+     is established and all earlier responses have been sent, the
+     tunnel takes over the connection.  */
+  struct tunnel *tunnel;
+
+  /* The state of the parser for the request being received.  */
+  struct request_parser parser;
+
+  /* If the body of a request is being received, its framing and the
+     request to which it is forwarded (NULL if it is discarded).  No
+     further requests are parsed until the body is complete.  */
+  struct request_body body;
+  struct http_request *body_request;
+  /* Whether to close the connection once the body is complete.  */
+  bool close_after_body;
+  /* Used to resume parsing requests once a body is complete.  */
+  struct event resume_event;
+
   /* Number of requests handled by this connection.  */
   int request_count;
+  /* Number of those answered from the cache.  */
+  int cache_hits;
 
   /* Number of bytes received from client.  */
   int client_in_bytes;
   /* Number of bytes sent to client.  */
   int client_out_bytes;
 
+  /* Number of bytes of response data that are buffered for the
+     client (as of the last check).  */
+  int buffered;
+
   /* Number of bytes received from web servers.  */
   int server_in_bytes;
   /* Number of bytes sent to web servers.  */
@@ -88,4 +116,25 @@ extern void user_conn_kick (struct user_conn *user_conn);
    deallocated.  */
 extern void http_request_processed_cb (struct http_request *request);
 
+/* Called by the downloader when the origin server can take more of
+   REQUEST's body.  Moves what is available to OUTPUT.  Returns true
+   once the whole body was moved.  */
+extern bool http_request_body_cb (struct http_request *request,
+				  struct evbuffer *output);
+
+/* The request whose body USER_CONN is receiving went away.  Discard
+   the rest of the body.  */
+extern void user_conn_drop_body (struct user_conn *user_conn);
+
+/* Called by the downloader when the headers of REQUEST's response
+   have arrived and, if the response is being streamed, whenever more
+   of the body is available in REQUEST->EVHTTP_REQUEST->INPUT_BUFFER.
+   To buffer the body instead, the callee clears the evhttp request's
+   chunk callback.  */
+extern void http_request_data_cb (struct http_request *request);
+
+/* REQUEST is being freed while the image in its response's body is
+   being decoded.  Stop decoding it.  */
+extern void http_request_drop_recompress (struct http_request *request);
+
 #endif